@@ -0,0 +1,104 @@
+/* ======================================================================== */
+/* crc32c:                                                                  */
+/* CRC32C with a runtime choice between the SSE4.2 crc32 instruction and a  */
+/* portable slicing-by-8 implementation. Both give identical results.       */
+/* ======================================================================== */
+
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define POLY 0x82F63B78     //Reflected Castagnoli polynomial
+
+static uint32_t table[8][256];      //Slicing-by-8 lookup tables
+static int use_hardware;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;     //Instances on several threads may start at once
+
+static void crc_init() {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    use_hardware = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#else
+    use_hardware = 0;
+#endif
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+        }
+        table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            table[t][i] = (table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t) p & 7)) {    //Align to 8 bytes
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {                      //8 bytes per step, one table per byte
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^
+              table[5][(word >> 16) & 0xFF] ^ table[4][(word >> 24) & 0xFF] ^
+              table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] ^
+              table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t) p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    uint64_t c64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c64 = _mm_crc32_u64(c64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t) c64;
+#endif
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+int crc32c_hardware() {
+    pthread_once(&crc_once, crc_init);
+    return use_hardware;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+#ifdef HAVE_X86
+    if (crc32c_hardware()) {
+        return ~crc32c_hw(crc, buf, len);
+    }
+#endif
+    return ~crc32c_sw(crc, buf, len);
+}
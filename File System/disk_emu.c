@@ -1,24 +1,851 @@
+#define _GNU_SOURCE
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
-#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "disk_emu.h"
 
+#define SECTOR_SIZE 512             //Unit a torn write is cut at
 
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+//Part of a request served by one image. A contiguous run of logical blocks
+//is a contiguous run on every image, scattered over the caller's buffer.
+typedef struct {
+    int first;                  //First block on the image
+    int nblocks;
+    int iovcnt;
+    struct iovec *iov;          //One entry per stripe unit touched
+    int is_write;
+    int result;
+} image_request;
+
+typedef struct {
+    disk_device *disk;
+    int image;
+} worker_arg;
+
+//Everything one emulated device keeps, see disk_create
+struct disk_device
+{
+    int image_fd[DISK_MAX_IMAGES];      //Backing image of every stripe member
+    int n_images;                       //Images currently open, 0 = disk closed
+    int stripes;                        //Images the next init_* stripes the volume across
+    int stripe_unit;                    //Consecutive blocks kept on one image
+    int image_blocks;                   //Blocks held by each image
+    int sparse;                         //Images are created sparse and discarded blocks punched out
+    unsigned char *mapped;              //Blocks that may hold data, one bit each (sparse images only)
+    int direct;                         //Images are opened with O_DIRECT, past the host page cache
+    int alignment;                      //Buffer alignment the open images need, 1 unless direct
+    int block_size, max_block;
+
+    disk_model model;                   //Current device model, zeroed = no latency
+    double elapsed_us;                  //Virtual time charged by the model so far
+    int head_position[DISK_MAX_IMAGES]; //Block the emulated head of every image is resting on
+    unsigned int rng_state;             //State of the model's private random generator
+    disk_counters counters;             //Requests served since the last reset
+
+    disk_faults faults;                 //Injected faults, zeroed = none
+    unsigned int fault_rng_state;       //Kept apart from the model's, so faults don't move with it
+    long fault_writes;                  //Write requests since set_disk_faults
+    int crashed;                        //Power lost, writes are dropped until the next init_*
+
+    //Worker threads, one per image past the first, serving sub-requests in parallel
+    pthread_t workers[DISK_MAX_IMAGES];
+    worker_arg worker_args[DISK_MAX_IMAGES];
+    int workers_started;
+    int stopping;                       //Set by disk_destroy, workers exit
+    image_request *pending[DISK_MAX_IMAGES];
+    int outstanding;
+    pthread_mutex_t pool_lock;
+    pthread_cond_t pool_work;
+    pthread_cond_t pool_done;
+};
+
+disk_device default_disk = {
+    .stripes = 1,
+    .stripe_unit = 1,
+    .pool_lock = PTHREAD_MUTEX_INITIALIZER,
+    .pool_work = PTHREAD_COND_INITIALIZER,
+    .pool_done = PTHREAD_COND_INITIALIZER
+};
+__thread disk_device *disk = &default_disk;    //Device the calling thread works on
+
+/*----------------------------------------------------------*/
+/*Devices are independent: several can be open at once, one */
+/*per thread or switched with disk_select. Every other call */
+/*works on the calling thread's current device, which is a  */
+/*default one unless disk_select was used. disk_create     */
+/*returns NULL when out of memory.                          */
+/*----------------------------------------------------------*/
+disk_device *disk_create()
+{
+    disk_device *d = calloc(1, sizeof(disk_device));
+    if (d == NULL)
+    {
+        return NULL;
+    }
+    d->stripes = 1;
+    d->stripe_unit = 1;
+    pthread_mutex_init(&d->pool_lock, NULL);
+    pthread_cond_init(&d->pool_work, NULL);
+    pthread_cond_init(&d->pool_done, NULL);
+    return d;
+}
+
+/*----------------------------------------------------------*/
+/*Closes the device and stops its workers. The default      */
+/*device can't be destroyed, it is only closed.             */
+/*----------------------------------------------------------*/
+void disk_destroy(disk_device *d)
+{
+    disk_device *previous = disk_select(d);
+    close_disk();
+    disk_select(previous == d ? NULL : previous);
+    if (d == &default_disk)
+    {
+        return;
+    }
+    pthread_mutex_lock(&d->pool_lock);
+    d->stopping = 1;
+    pthread_cond_broadcast(&d->pool_work);
+    pthread_mutex_unlock(&d->pool_lock);
+    for (int i = 1; i <= d->workers_started; i++)
+    {
+        pthread_join(d->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&d->pool_lock);
+    pthread_cond_destroy(&d->pool_work);
+    pthread_cond_destroy(&d->pool_done);
+    free(d);
+}
+
+disk_device *disk_select(disk_device *d)
+{
+    disk_device *previous = disk;
+    disk = d ? d : &default_disk;
+    return previous;
+}
+
+/*----------------------------------------------------------*/
+/*Built-in device profiles, roughly a 7200rpm disk and a    */
+/*SATA SSD. Values are per request/block, in microseconds.  */
+/*----------------------------------------------------------*/
+int disk_model_preset(const char *name, disk_model *out)
+{
+    memset(out, 0, sizeof(disk_model));
+    out->max_retry = 3;
+    out->seed = 1;
+
+    if (strcmp(name, "none") == 0)
+    {
+        return 0;
+    }
+    if (strcmp(name, "hdd") == 0)
+    {
+        out->request_us = 100;
+        out->block_us = 8;
+        out->seek_us = 4000;
+        out->seek_us_per_block = 2;
+        out->max_seek_us = 12000;
+        out->bandwidth_mbps = 120;
+        out->jitter = 0.10;
+        out->error_rate = 0.0001;
+        return 0;
+    }
+    if (strcmp(name, "ssd") == 0)
+    {
+        out->request_us = 60;
+        out->block_us = 2;
+        out->bandwidth_mbps = 500;
+        out->jitter = 0.05;
+        out->error_rate = 0.00001;
+        return 0;
+    }
+    printf("Unknown disk profile %s\n", name);
+    return -1;
+}
+
+/*----------------------------------------------------------*/
+/*Installs a device model and restarts its random sequence. */
+/*----------------------------------------------------------*/
+void set_disk_model(const disk_model *m)
+{
+    disk->model = *m;
+    disk->rng_state = disk->model.seed ? disk->model.seed : 1;
+    memset(disk->head_position, 0, sizeof(disk->head_position));
+}
+
+void get_disk_model(disk_model *m)
+{
+    *m = disk->model;
+}
+
+double disk_elapsed_us()
+{
+    return disk->elapsed_us;
+}
+
+void disk_reset_clock()
+{
+    disk->elapsed_us = 0;
+}
+
+void get_disk_counters(disk_counters *c)
+{
+    *c = disk->counters;
+}
+
+void reset_disk_counters()
+{
+    memset(&disk->counters, 0, sizeof(disk_counters));
+}
+
+/*----------------------------------------------------------*/
+/*xorshift32, kept private so the model never disturbs the  */
+/*caller's rand() sequence. Returns a value in [0, 1).      */
+/*----------------------------------------------------------*/
+static double xorshift(unsigned int *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return (*state >> 8) / 16777216.0;
+}
+
+static double next_random()
+{
+    return xorshift(&disk->rng_state);
+}
+
+/*----------------------------------------------------------*/
+/*Arms a set of faults on the current device and restarts   */
+/*its sequence and write count. Powers the device back on.  */
+/*----------------------------------------------------------*/
+void set_disk_faults(const disk_faults *f)
+{
+    disk->faults = *f;
+    disk->fault_rng_state = f->seed ? f->seed : 1;
+    disk->fault_writes = 0;
+    disk->crashed = 0;
+}
+
+int disk_crashed()
+{
+    return disk->crashed;
+}
+
+/*----------------------------------------------------------*/
+/*RAID-0 layout for the next init_*: logical blocks go to   */
+/*the images in turn, unit blocks at a time. With more than */
+/*one image, image i of "disk" is the file "disk.i".        */
+/*----------------------------------------------------------*/
+int set_disk_stripes(int images, int unit)
+{
+    if (images < 1 || images > DISK_MAX_IMAGES || unit < 1)
+    {
+        printf("Invalid stripe layout %d x %d blocks\n", images, unit);
+        return -1;
+    }
+    disk->stripes = images;
+    disk->stripe_unit = unit;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Thin provisioning for the next init_*: images start out   */
+/*as holes, discard_blocks gives space back to the host and */
+/*blocks never written read as zeros without any I/O.       */
+/*----------------------------------------------------------*/
+void set_disk_sparse(int on)
+{
+    disk->sparse = on;
+}
+
+int disk_is_sparse()
+{
+    return disk->sparse && disk->n_images > 0;
+}
+
+/*----------------------------------------------------------*/
+/*Direct I/O for the next init_*: the images are opened     */
+/*with O_DIRECT, so requests go to the device and nothing   */
+/*is kept in the host page cache. Buffers must then be      */
+/*aligned to disk_alignment(); others still work but are    */
+/*copied through an aligned one (counters.bounced).         */
+/*----------------------------------------------------------*/
+void set_disk_direct(int on)
+{
+    disk->direct = on;
+}
+
+int disk_is_direct()
+{
+    return disk->direct && disk->n_images > 0;
+}
+
+int disk_alignment()
+{
+    return disk->alignment > 1 ? disk->alignment : 1;
+}
+
+/*----------------------------------------------------------*/
+/*Allocates a buffer aligned to DISK_DIRECT_ALIGN, good for */
+/*direct I/O on any device. Released with free().           */
+/*----------------------------------------------------------*/
+void *disk_alloc(size_t size)
+{
+    void *buffer;
+    if (posix_memalign(&buffer, DISK_DIRECT_ALIGN, size > 0 ? size : 1) != 0)
+    {
+        return NULL;
+    }
+    return buffer;
+}
+
+/*----------------------------------------------------------*/
+/*Write barrier: returns once every write served so far is  */
+/*on stable storage (fdatasync of every image). Direct I/O  */
+/*skips the page cache, not the device's own write cache.   */
+/*----------------------------------------------------------*/
+int disk_barrier()
+{
+    int result = 0;
+
+    if (disk->n_images == 0)
+    {
+        printf("Could not sync, disk not open\n");
+        return -1;
+    }
+    if (disk->crashed)
+    {
+        return 0;
+    }
+    for (int i = 0; i < disk->n_images; i++)
+    {
+        if (fdatasync(disk->image_fd[i]) < 0)
+        {
+            printf("Could not sync image %d\n", i);
+            result = -1;
+        }
+    }
+    disk->counters.barriers++;
+    return result;
+}
+
+/*----------------------------------------------------------*/
+/*Picks up DISK_EMU_PROFILE / DISK_EMU_SEED so existing     */
+/*programs can be run against a profile without rebuilding, */
+/*DISK_EMU_STRIPES ("images" or "images:unit") and          */
+/*DISK_EMU_SPARSE (1 = sparse images) and DISK_EMU_DIRECT   */
+/*(1 = direct I/O).                                         */
+/*----------------------------------------------------------*/
+static void model_from_env()
+{
+    char *profile = getenv("DISK_EMU_PROFILE");
+    char *seed = getenv("DISK_EMU_SEED");
+    char *layout = getenv("DISK_EMU_STRIPES");
+    char *thin = getenv("DISK_EMU_SPARSE");
+    char *direct = getenv("DISK_EMU_DIRECT");
+    disk_model m;
+
+    if (thin != NULL)
+    {
+        set_disk_sparse(atoi(thin));
+    }
+    if (direct != NULL)
+    {
+        set_disk_direct(atoi(direct));
+    }
+    if (layout != NULL)
+    {
+        char *unit = strchr(layout, ':');
+        set_disk_stripes(atoi(layout), unit ? atoi(unit + 1) : 1);
+    }
+    if (profile == NULL)
+    {
+        return;
+    }
+    if (disk_model_preset(profile, &m) == 0)
+    {
+        if (seed != NULL)
+        {
+            m.seed = (unsigned int) strtoul(seed, NULL, 10);
+        }
+        set_disk_model(&m);
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Adds the modeled service time of a request to one image   */
+/*to *total and moves its head. Returns -1 if the request   */
+/*failed every retry.                                       */
+/*----------------------------------------------------------*/
+static int charge_request(int image, int start_address, int nblocks, double *total)
+{
+    int attempt;
+
+    for (attempt = 0; attempt <= disk->model.max_retry; attempt++)
+    {
+        double t = disk->model.request_us;
+        int distance = abs(start_address - disk->head_position[image]);
+
+        if (distance != 0)
+        {
+            double seek = disk->model.seek_us + disk->model.seek_us_per_block * distance;
+            if (disk->model.max_seek_us > 0 && seek > disk->model.max_seek_us)
+            {
+                seek = disk->model.max_seek_us;
+            }
+            t += seek;
+        }
+
+        double transfer = disk->model.block_us * nblocks;
+        if (disk->model.bandwidth_mbps > 0)
+        {
+            /*bytes / (MB/s) gives microseconds directly*/
+            double capped = (double) nblocks * disk->block_size / disk->model.bandwidth_mbps;
+            if (capped > transfer)
+            {
+                transfer = capped;
+            }
+        }
+        t += transfer;
+
+        if (disk->model.jitter > 0)
+        {
+            t *= 1.0 + disk->model.jitter * (2.0 * next_random() - 1.0);
+        }
+
+        *total += t;
+        disk->head_position[image] = start_address + nblocks;
+
+        if (disk->model.error_rate <= 0 || next_random() >= disk->model.error_rate)
+        {
+            return 0;
+        }
+    }
+    disk->counters.errors++;
+    printf("disk error at block %d of image %d after %d retries\n", start_address, image, disk->model.max_retry);
+    return -1;
+}
+
+static int physical_block(int block, int *image)     /*Where a logical block lives*/
+{
+    int stripe = block / disk->stripe_unit;
+    *image = stripe % disk->n_images;
+    return (stripe / disk->n_images) * disk->stripe_unit + block % disk->stripe_unit;
+}
+
+static int logical_block(int image, int block)
+{
+    return ((block / disk->stripe_unit) * disk->n_images + image) * disk->stripe_unit + block % disk->stripe_unit;
+}
+
+static void set_mapped(int start, int nblocks, int on)
+{
+    for (int b = start; b < start + nblocks; b++)
+    {
+        if (on)
+        {
+            disk->mapped[b / 8] |= 1 << (b % 8);
+        }
+        else
+        {
+            disk->mapped[b / 8] &= ~(1 << (b % 8));
+        }
+    }
+}
+
+static int any_mapped(int start, int nblocks)
+{
+    for (int b = start; b < start + nblocks; b++)
+    {
+        if (disk->mapped[b / 8] & (1 << (b % 8)))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Moves one sub-request to or from its image, looping over  */
+/*short transfers.                                          */
+/*----------------------------------------------------------*/
+static void image_io(disk_device *d, int image, image_request *r)
+{
+    off_t offset = (off_t) r->first * d->block_size;
+    struct iovec *iov = r->iov;
+    int iovcnt = r->iovcnt;
+
+    r->result = 0;
+    while (iovcnt > 0)
+    {
+        ssize_t n = r->is_write ? pwritev(d->image_fd[image], iov, iovcnt, offset)
+                                : preadv(d->image_fd[image], iov, iovcnt, offset);
+        if (n <= 0)
+        {
+            r->result = -1;
+            return;
+        }
+        offset += n;
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void *image_worker(void *arg)
+{
+    disk_device *d = ((worker_arg *) arg)->disk;    /*Not the worker's own current device*/
+    int image = ((worker_arg *) arg)->image;
+
+    pthread_mutex_lock(&d->pool_lock);
+    for (;;)
+    {
+        while (d->pending[image] == NULL && !d->stopping)
+        {
+            pthread_cond_wait(&d->pool_work, &d->pool_lock);
+        }
+        if (d->stopping)
+        {
+            break;
+        }
+        image_request *r = d->pending[image];
+        pthread_mutex_unlock(&d->pool_lock);
+        image_io(d, image, r);
+        pthread_mutex_lock(&d->pool_lock);
+        d->pending[image] = NULL;
+        if (--d->outstanding == 0)
+        {
+            pthread_cond_signal(&d->pool_done);
+        }
+    }
+    pthread_mutex_unlock(&d->pool_lock);
+    return NULL;
+}
+
+/*----------------------------------------------------------*/
+/*Splits a request over the images, charges the model for   */
+/*the slowest one (they work in parallel), and serves the   */
+/*sub-requests: the first on the calling thread, the rest   */
+/*on the workers.                                           */
+/*----------------------------------------------------------*/
+static int transfer(int start_address, int nblocks, void *buffer, int is_write)
+{
+    if (nblocks <= 0)
+    {
+        return 0;       /*Nothing to split, and no image to serve it*/
+    }
+
+    image_request req[DISK_MAX_IMAGES];
+    struct iovec *iov = malloc(sizeof(struct iovec) * (nblocks / disk->stripe_unit + 2) * disk->n_images);
+    double slowest = 0;
+    int i, result = 0;
+
+    for (i = 0; i < disk->n_images; i++)
+    {
+        req[i].nblocks = 0;
+        req[i].iovcnt = 0;
+        req[i].iov = iov + i * (nblocks / disk->stripe_unit + 2);
+        req[i].is_write = is_write;
+    }
+    for (int b = start_address; b < start_address + nblocks; )
+    {
+        int image;
+        int physical = physical_block(b, &image);
+        int run = disk->stripe_unit - b % disk->stripe_unit;
+        if (run > start_address + nblocks - b)
+        {
+            run = start_address + nblocks - b;
+        }
+        image_request *r = &req[image];
+        if (r->nblocks == 0)
+        {
+            r->first = physical;
+        }
+        r->iov[r->iovcnt].iov_base = (char *) buffer + (long) (b - start_address) * disk->block_size;
+        r->iov[r->iovcnt].iov_len = (size_t) run * disk->block_size;
+        r->iovcnt++;
+        r->nblocks += run;
+        b += run;
+    }
+
+    /*Pause until the modeled service time is elapsed*/
+    for (i = 0; i < disk->n_images; i++)
+    {
+        double t = 0;
+        if (req[i].nblocks > 0 && charge_request(i, req[i].first, req[i].nblocks, &t) < 0)
+        {
+            result = -1;
+        }
+        slowest = t > slowest ? t : slowest;
+    }
+    disk->elapsed_us += slowest;
+    if (disk->model.sleep && slowest >= 1)
+    {
+        usleep((useconds_t) slowest);
+    }
+    if (result < 0)
+    {
+        free(iov);
+        return -1;
+    }
+
+    int own = -1, busy = 0;
+    for (i = 0; i < disk->n_images; i++)
+    {
+        if (req[i].nblocks > 0)
+        {
+            own = own < 0 ? i : own;
+            busy++;
+        }
+    }
+    if (busy > 1)
+    {
+        pthread_mutex_lock(&disk->pool_lock);
+        for (i = own + 1; i < disk->n_images; i++)
+        {
+            if (req[i].nblocks > 0)
+            {
+                disk->pending[i] = &req[i];
+                disk->outstanding++;
+            }
+        }
+        pthread_cond_broadcast(&disk->pool_work);
+        pthread_mutex_unlock(&disk->pool_lock);
+    }
+
+    image_io(disk, own, &req[own]);
+
+    if (busy > 1)
+    {
+        pthread_mutex_lock(&disk->pool_lock);
+        while (disk->outstanding > 0)
+        {
+            pthread_cond_wait(&disk->pool_done, &disk->pool_lock);
+        }
+        pthread_mutex_unlock(&disk->pool_lock);
+    }
+
+    for (i = 0; i < disk->n_images; i++)
+    {
+        if (req[i].nblocks > 0 && req[i].result < 0)
+        {
+            printf("I/O error on image %d\n", i);
+            result = -1;
+        }
+    }
+    free(iov);
+    return result < 0 ? -1 : nblocks;
+}
+
+/*----------------------------------------------------------*/
+/*transfer for callers whose buffer direct I/O may refuse:  */
+/*an unaligned one goes through an aligned copy.            */
+/*----------------------------------------------------------*/
+static int aligned_transfer(int start_address, int nblocks, void *buffer, int is_write)
+{
+    if (disk->alignment <= 1 || (uintptr_t) buffer % disk->alignment == 0)
+    {
+        return transfer(start_address, nblocks, buffer, is_write);
+    }
+
+    size_t size = (size_t) nblocks * disk->block_size;
+    char *bounce = disk_alloc(size);
+    if (bounce == NULL)
+    {
+        return -1;
+    }
+    disk->counters.bounced++;
+    if (is_write)
+    {
+        memcpy(bounce, buffer, size);
+    }
+    int result = transfer(start_address, nblocks, bounce, is_write);
+    if (!is_write && result >= 0)
+    {
+        memcpy(buffer, bounce, size);
+    }
+    free(bounce);
+    return result;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
-    if(NULL != fp)
+    for (int i = 0; i < disk->n_images; i++)
     {
-        fclose(fp);
+        close(disk->image_fd[i]);
+    }
+    disk->n_images = 0;
+    disk->alignment = 1;
+    free(disk->mapped);
+    disk->mapped = NULL;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Finds the blocks of existing sparse images that hold data.*/
+/*----------------------------------------------------------*/
+static void scan_mapped()
+{
+    for (int i = 0; i < disk->n_images; i++)
+    {
+        off_t end = (off_t) disk->image_blocks * disk->block_size;
+        off_t data = lseek(disk->image_fd[i], 0, SEEK_DATA);
+        while (data >= 0 && data < end)
+        {
+            off_t hole = lseek(disk->image_fd[i], data, SEEK_HOLE);
+            if (hole < 0 || hole > end)
+            {
+                hole = end;
+            }
+            for (int b = data / disk->block_size; b < (hole + disk->block_size - 1) / disk->block_size; b++)
+            {
+                int block = logical_block(i, b);
+                if (block < disk->max_block)
+                {
+                    set_mapped(block, 1, 1);
+                }
+            }
+            data = lseek(disk->image_fd[i], hole, SEEK_DATA);
+        }
+    }
+}
+
+static void image_name(char *name, int size, char *filename, int image, int images)
+{
+    if (images == 1)
+    {
+        snprintf(name, size, "%s", filename);
+    }
+    else
+    {
+        snprintf(name, size, "%s.%d", filename, image);
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Copies the images as they are now, holes included, to     */
+/*another volume of the same layout: "filename" for a       */
+/*single image, "filename.i" for image i of a striped one.  */
+/*With faults armed this keeps what a crash left behind.    */
+/*----------------------------------------------------------*/
+int disk_save_image(char *filename)
+{
+    char name[4096];
+    size_t size = (size_t) disk->image_blocks * disk->block_size;
+    char *copy = disk_alloc(size);
+    int result = 0;
+
+    for (int i = 0; i < disk->n_images && result == 0; i++)
+    {
+        image_name(name, sizeof(name), filename, i, disk->n_images);
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || pread(disk->image_fd[i], copy, size, 0) != (ssize_t) size
+            || pwrite(fd, copy, size, 0) != (ssize_t) size)
+        {
+            printf("Could not save disk image %d to %s\n", i, name);
+            result = -1;
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    free(copy);
+    return disk->n_images > 0 ? result : -1;
+}
+
+/*----------------------------------------------------------*/
+/*Buffer alignment direct I/O on an image needs, or -1 if   */
+/*the image can't do direct I/O in blocks of block_size.    */
+/*Unknown when the kernel doesn't say, then the worst case. */
+/*----------------------------------------------------------*/
+static int direct_alignment(int fd)
+{
+#ifdef STATX_DIOALIGN
+    struct statx sx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) == 0 && (sx.stx_mask & STATX_DIOALIGN))
+    {
+        if (sx.stx_dio_offset_align == 0 || disk->block_size % sx.stx_dio_offset_align != 0)
+        {
+            return -1;
+        }
+        return sx.stx_dio_mem_align > 1 ? (int) sx.stx_dio_mem_align : 1;
+    }
+#endif
+    return DISK_DIRECT_ALIGN;
+}
+
+/*----------------------------------------------------------*/
+/*Opens (or creates) the images of the volume and starts a  */
+/*worker for every image past the first.                    */
+/*----------------------------------------------------------*/
+static int open_images(char *filename, int flags)
+{
+    char name[4096];
+
+    model_from_env();
+    memset(disk->head_position, 0, sizeof(disk->head_position));
+    close_disk();
+    disk->crashed = 0;          /*Power comes back*/
+
+    int rows = (disk->max_block + disk->stripes * disk->stripe_unit - 1) / (disk->stripes * disk->stripe_unit);
+    disk->image_blocks = rows * disk->stripe_unit;
+
+    for (int i = 0; i < disk->stripes; i++)
+    {
+        image_name(name, sizeof(name), filename, i, disk->stripes);
+        disk->image_fd[i] = open(name, flags | (disk->direct ? O_DIRECT : 0), 0644);
+        if (disk->image_fd[i] < 0)
+        {
+            printf("Could not open %s%s: %s\n\n", name, disk->direct ? " for direct I/O" : "", strerror(errno));
+            disk->n_images = i;
+            close_disk();
+            return -1;
+        }
+        disk->n_images = i + 1;
+        if (disk->direct)
+        {
+            int alignment = direct_alignment(disk->image_fd[i]);
+            if (alignment < 0)
+            {
+                printf("Could not open %s for direct I/O in blocks of %d bytes\n\n", name, disk->block_size);
+                close_disk();
+                return -1;
+            }
+            disk->alignment = alignment > disk->alignment ? alignment : disk->alignment;
+        }
+    }
+    if (disk->sparse)
+    {
+        disk->mapped = calloc((disk->max_block + 7) / 8, 1);
+    }
+
+    while (disk->workers_started < disk->n_images - 1)
+    {
+        disk->workers_started++;
+        worker_arg *arg = &disk->worker_args[disk->workers_started];
+        arg->disk = disk;
+        arg->image = disk->workers_started;
+        pthread_create(&disk->workers[disk->workers_started], NULL, image_worker, arg);
     }
     return 0;
 }
@@ -28,30 +855,42 @@ int close_disk()
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
 
-    if (fp == NULL)
+    /*Creates the new files*/
+    if (open_images(filename, O_RDWR | O_CREAT | O_TRUNC) < 0)
     {
-        printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+
+    /*Sparse images are all holes, nothing is written*/
+    if (disk->sparse)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
+        for (int i = 0; i < disk->n_images; i++)
         {
-            fputc(0, fp);
+            if (ftruncate(disk->image_fd[i], (off_t) disk->image_blocks * disk->block_size) < 0)
+            {
+                printf("Could not size disk image %d\n\n", i);
+                return -1;
+            }
         }
+        return 0;
     }
+
+    /*Fills the files with 0's to their given size*/
+    char *zero = disk_alloc((size_t) disk->image_blocks * disk->block_size);
+    memset(zero, 0, (size_t) disk->image_blocks * disk->block_size);
+    for (int i = 0; i < disk->n_images; i++)
+    {
+        if (pwrite(disk->image_fd[i], zero, (size_t) disk->image_blocks * disk->block_size, 0) != (ssize_t) disk->image_blocks * disk->block_size)
+        {
+            printf("Could not fill disk image %d\n\n", i);
+            free(zero);
+            return -1;
+        }
+    }
+    free(zero);
     return 0;
 }
 /*----------------------------*/
@@ -59,17 +898,18 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
 
-    if (fp == NULL)
+    /*Opens the files*/
+    if (open_images(filename, O_RDWR) < 0)
     {
-        printf("Could not open %s\n\n", filename);
         return -1;
     }
+    if (disk->sparse)
+    {
+        scan_mapped();
+    }
     return 0;
 }
 
@@ -78,32 +918,65 @@ int init_disk(char *filename, int block_size, int num_blocks)
 /*-------------------------------------------------------------------*/
 int read_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, s;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address < 0 || start_address + nblocks > disk->max_block || disk->n_images == 0)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    disk->counters.reads++;
+    disk->counters.blocks_read += nblocks;
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+    if (disk->faults.read_error_rate > 0 && xorshift(&disk->fault_rng_state) < disk->faults.read_error_rate)
     {
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        disk->counters.errors++;
+        disk->counters.faults++;
+        printf("injected read error at block %d\n", start_address);
+        return -1;
+    }
+
+    /*Blocks never written (or discarded) are zeros, no need to go to the disk*/
+    if (disk->mapped != NULL && !any_mapped(start_address, nblocks))
+    {
+        memset(buffer, 0, (size_t) nblocks * disk->block_size);
+        return nblocks;
     }
 
-    free(blockRead);
-    return s;
+    /*Every block requested in one transfer per image*/
+    return aligned_transfer(start_address, nblocks, buffer, 0);
+}
+
+/*----------------------------------------------------------*/
+/*Power goes off during this write. A torn write keeps a    */
+/*random number of its leading sectors, the rest of the     */
+/*blocks keep what they had before.                         */
+/*----------------------------------------------------------*/
+static int power_loss(int start_address, int nblocks, void *buffer)
+{
+    int sectors = nblocks * disk->block_size / SECTOR_SIZE;
+    int kept = disk->faults.torn_writes ? (int) (xorshift(&disk->fault_rng_state) * (sectors + 1)) : 0;
+    int full = kept * SECTOR_SIZE / disk->block_size;
+    int rest = kept * SECTOR_SIZE % disk->block_size;
+
+    if (full > 0)
+    {
+        aligned_transfer(start_address, full, buffer, 1);
+    }
+    if (rest > 0)
+    {
+        char *block = disk_alloc(disk->block_size);
+        if (transfer(start_address + full, 1, block, 0) == 1)
+        {
+            memcpy(block, (char *) buffer + (long) full * disk->block_size, rest);
+            transfer(start_address + full, 1, block, 1);
+        }
+        free(block);
+    }
+    disk->crashed = 1;
+    disk->faults.crash_after_writes = 0;
+    disk->counters.faults++;
+    return nblocks;
 }
 
 /*------------------------------------------------------------------*/
@@ -111,33 +984,72 @@ int read_blocks(int start_address, int nblocks, void *buffer)
 /*------------------------------------------------------------------*/
 int write_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, s;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address < 0 || start_address + nblocks > disk->max_block || disk->n_images == 0)
     {
         printf("out of bound error\n");
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    disk->counters.writes++;
+    disk->counters.blocks_written += nblocks;
+    if (disk->mapped != NULL)
+    {
+        set_mapped(start_address, nblocks, 1);
+    }
 
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
+    /*Power is off, or goes off now: the caller is told the write went through*/
+    if (disk->crashed)
+    {
+        disk->counters.faults++;
+        return nblocks;
+    }
+    if (disk->faults.crash_after_writes > 0 && ++disk->fault_writes == disk->faults.crash_after_writes)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        return power_loss(start_address, nblocks, buffer);
+    }
 
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+    /*Every block requested in one transfer per image*/
+    return aligned_transfer(start_address, nblocks, buffer, 1);
+}
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+/*------------------------------------------------------------------*/
+/*Tells the disk a series of blocks no longer holds data. On sparse  */
+/*images their space goes back to the host and they read as zeros,   */
+/*otherwise nothing happens.                                         */
+/*------------------------------------------------------------------*/
+int discard_blocks(int start_address, int nblocks)
+{
+    if (start_address < 0 || start_address + nblocks > disk->max_block || disk->n_images == 0)
+    {
+        printf("out of bound error\n");
+        return -1;
     }
-    free(blockWrite);
-    return s;
+    if (disk->mapped == NULL || disk->crashed)
+    {
+        return 0;
+    }
+
+    disk->counters.discards++;
+    disk->counters.blocks_discarded += nblocks;
+
+    for (int b = start_address; b < start_address + nblocks; )
+    {
+        int image;
+        int physical = physical_block(b, &image);
+        int run = disk->stripe_unit - b % disk->stripe_unit;
+        if (run > start_address + nblocks - b)
+        {
+            run = start_address + nblocks - b;
+        }
+        if (fallocate(disk->image_fd[image], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t) physical * disk->block_size, (off_t) run * disk->block_size) < 0)
+        {
+            printf("Could not punch blocks %d-%d of image %d\n", physical, physical + run - 1, image);
+            return -1;
+        }
+        set_mapped(b, run, 0);
+        b += run;
+    }
+    return 0;
 }
@@ -1,5 +1,80 @@
+#include <stddef.h>
+
+//Device model used by the emulator to charge latency on every request.
+//All times are in microseconds. A zeroed model means "no latency, no errors".
+typedef struct {
+    double request_us;          //Fixed cost paid by every read/write request
+    double block_us;            //Transfer cost per block
+    double seek_us;             //Fixed cost whenever the head has to move
+    double seek_us_per_block;   //Additional cost per block of head travel
+    double max_seek_us;         //Cap on the seek penalty (0 = uncapped)
+    double bandwidth_mbps;      //Bandwidth cap in MB/s (0 = unlimited)
+    double jitter;              //Random +/- fraction applied to the service time
+    double error_rate;          //Probability that a request fails and is retried
+    int max_retry;              //Retries before a failing request is reported
+    unsigned int seed;          //Seed for jitter and errors, same seed = same run
+    int sleep;                  //1 = really sleep, 0 = only account virtual time
+} disk_model;
+
+//Running totals of the requests served by the emulator
+typedef struct {
+    long reads;                 //read_blocks calls
+    long writes;                //write_blocks calls
+    long blocks_read;
+    long blocks_written;
+    long errors;                //Requests that failed every retry
+    long discards;              //discard_blocks calls on sparse images
+    long blocks_discarded;
+    long faults;                //Requests failed, torn or lost by injected faults
+    long bounced;               //Direct requests copied through an aligned buffer
+    long barriers;              //disk_barrier calls that reached the images
+} disk_counters;
+
+//Faults injected into the device, for crash-consistency testing. A zeroed
+//set means no faults. Power loss happens once: the write request it hits
+//reaches the disk only partly (torn_writes) or not at all, and every later
+//write or discard is lost without the caller knowing, until the next
+//init_* powers the device back on.
+typedef struct {
+    unsigned int seed;          //Seed of the fault sequence, same seed = same faults
+    long crash_after_writes;    //Write request power is lost at, counted from set_disk_faults (0 = never)
+    int torn_writes;            //1 = a random number of its 512-byte sectors make it, in order
+    double read_error_rate;     //Probability that a read request fails, without retries
+} disk_faults;
+
+#define DISK_MAX_IMAGES 16     //Most images a volume can be striped across
+#define DISK_DIRECT_ALIGN 4096 //Alignment of disk_alloc buffers, enough for direct I/O anywhere
+
+//An emulated device: its images, layout, model, clock and counters.
+//Every call below works on the calling thread's current device.
+typedef struct disk_device disk_device;
+
+disk_device *disk_create();
+void disk_destroy(disk_device *disk);
+disk_device *disk_select(disk_device *disk);
+
+int disk_model_preset(const char *name, disk_model *model);
+int set_disk_stripes(int images, int unit);
+void set_disk_sparse(int on);
+int disk_is_sparse();
+void set_disk_direct(int on);
+int disk_is_direct();
+int disk_alignment();
+void *disk_alloc(size_t size);
+int disk_barrier();
+void set_disk_model(const disk_model *model);
+void get_disk_model(disk_model *model);
+double disk_elapsed_us();
+void disk_reset_clock();
+void get_disk_counters(disk_counters *counters);
+void reset_disk_counters();
+void set_disk_faults(const disk_faults *faults);
+int disk_crashed();
+int disk_save_image(char *filename);
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int discard_blocks(int start_address, int nblocks);
 int close_disk();
@@ -23,6 +23,10 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
+    } else if (strcmp(path, SFS_STATS_PATH) == 0) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = sfs_stats_format(NULL, 0);
     } else if((size = sfs_getfilesize(path)) != -1) {
         stbuf->st_mode = S_IFREG | 0666;
         stbuf->st_nlink = 1;
@@ -33,19 +37,29 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
     return res;
 }
 
+//Entries go with the offset of the next one, so FUSE can page through a large directory:
+//".", ".." and the stats file, then the sfs_readdir cursor past FIXED_ENTRIES
+#define FIXED_ENTRIES 3
+
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
-    char file_name[MAXFILENAME];
+    const char *fixed[FIXED_ENTRIES] = { ".", "..", &SFS_STATS_PATH[1] };
+    char file_name[MAXFILENAME + 1];
+    int cursor;
     
     if (strcmp(path, "/") != 0)
         return -ENOENT;
     
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    for (; offset < FIXED_ENTRIES; offset++) {
+        if (filler(buf, fixed[offset], NULL, offset + 1))
+            return 0;
+    }
     
-    while(sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+    cursor = offset - FIXED_ENTRIES;
+    while(sfs_readdir(&cursor, file_name) > 0) {
+        if (filler(buf, &file_name[1], NULL, cursor + FIXED_ENTRIES))
+            break;      //Buffer full, FUSE comes back with this offset
     }
     
     return 0;
@@ -56,6 +70,9 @@ static int fuse_unlink(const char *path)
     int res;
     char filename[MAXFILENAME];
     
+    if (strcmp(path, SFS_STATS_PATH) == 0)
+        return -EACCES;
+    
     strcpy(filename, path);
     res = sfs_remove(filename);
     if (res == -1)
@@ -69,6 +86,13 @@ static int fuse_open(const char *path, struct fuse_file_info *fi)
     int res;
     char filename[MAXFILENAME];
     
+    if (strcmp(path, SFS_STATS_PATH) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        fi->direct_io = 1;      /* content changes on every call, don't trust st_size */
+        return 0;
+    }
+    
     strcpy(filename, path);
     
     res = sfs_fopen(filename);
@@ -79,6 +103,25 @@ static int fuse_open(const char *path, struct fuse_file_info *fi)
     return 0;
 }
 
+static int read_stats(char *buf, size_t size, off_t offset)
+{
+    int len = sfs_stats_format(NULL, 0);
+    char *text = malloc(len + 1);
+    if (text == NULL)
+        return -ENOMEM;
+    
+    sfs_stats_format(text, len + 1);
+    if (offset >= len) {
+        free(text);
+        return 0;
+    }
+    if (offset + size > len)
+        size = len - offset;
+    memcpy(buf, text + offset, size);
+    free(text);
+    return size;
+}
+
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
@@ -87,6 +130,9 @@ static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
     
     char filename[MAXFILENAME];
     
+    if (strcmp(path, SFS_STATS_PATH) == 0)
+        return read_stats(buf, size, offset);
+    
     strcpy(filename, path);
     
     fd = sfs_fopen(filename);
@@ -112,6 +158,9 @@ static int fuse_write(const char *path, const char *buf, size_t size,
     
     char filename[MAXFILENAME];
     
+    if (strcmp(path, SFS_STATS_PATH) == 0)
+        return -EACCES;
+    
     strcpy(filename, path);
     
     fd = sfs_fopen(filename);
@@ -134,6 +183,9 @@ static int fuse_truncate(const char *path, off_t size)
     char filename[MAXFILENAME];
     int fd;
     
+    if (strcmp(path, SFS_STATS_PATH) == 0)
+        return -EACCES;
+    
     strcpy(filename, path);
     
     fd = sfs_remove(filename);
@@ -182,6 +234,14 @@ static struct fuse_operations xmp_oper = {
 
 int main(int argc, char *argv[])
 {
+  char *trace = getenv("SFS_TRACE");      //Records the calls the mount makes, for sfs_replay
+  int result;
+
   mksfs(0);
-  return fuse_main(argc, argv, &xmp_oper, NULL);
+  if (trace && sfs_trace_start(trace) < 0)
+    return 1;
+  result = fuse_main(argc, argv, &xmp_oper, NULL);
+  if (trace)
+    sfs_trace_stop();
+  return result;
 }
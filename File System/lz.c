@@ -0,0 +1,169 @@
+/* ======================================================================== */
+/* lz:                                                                      */
+/* Greedy LZ77 with a single-probe hash table, emitting LZ4 block format.   */
+/* Fast rather than tight: one hash lookup per position, no lazy matching.  */
+/* ======================================================================== */
+
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define LAST_LITERALS 5         //The format requires the block to end in literals
+#define MAX_INPUT 65536
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static int hash(uint32_t v) {
+    return (int)((v * 2654435761u) >> (32 - HASH_BITS));
+}
+
+static char *write_length(char *op, char *end, int len) {      //Length continuation bytes after a 15 in the token
+    while (len >= 255) {
+        if (op >= end) {
+            return NULL;
+        }
+        *op++ = (char)255;
+        len -= 255;
+    }
+    if (op >= end) {
+        return NULL;
+    }
+    *op++ = (char)len;
+    return op;
+}
+
+static char *emit(char *op, char *end, const char *literals, int lit_len, int offset, int match_len) {
+    char *token = op++;
+    if (op > end) {
+        return NULL;
+    }
+    *token = (char)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15 && !(op = write_length(op, end, lit_len - 15))) {
+        return NULL;
+    }
+    if (op + lit_len > end) {
+        return NULL;
+    }
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) {       //Final sequence: literals only
+        return op;
+    }
+    if (op + 2 > end) {
+        return NULL;
+    }
+    *op++ = (char)(offset & 0xFF);
+    *op++ = (char)(offset >> 8);
+    match_len -= MIN_MATCH;
+    *token |= (char)(match_len >= 15 ? 15 : match_len);
+    if (match_len >= 15 && !(op = write_length(op, end, match_len - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+int lz_compress(const char *src, int size, char *dst, int capacity) {
+    uint16_t table[1 << HASH_BITS];
+    const char *ip = src;
+    const char *anchor = src;           //Start of pending literals
+    const char *limit = src + size - LAST_LITERALS;
+    char *op = dst;
+    char *end = dst + capacity;
+
+    if (size > MAX_INPUT) {
+        return 0;
+    }
+    memset(table, 0, sizeof(table));
+
+    while (size >= MIN_MATCH + LAST_LITERALS && ip + MIN_MATCH <= limit) {
+        uint32_t seq = read32(ip);
+        int h = hash(seq);
+        const char *ref = src + table[h];
+        table[h] = (uint16_t)(ip - src);
+
+        if (ref >= ip || ip - ref > 65535 || read32(ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        int len = MIN_MATCH;
+        while (ip + len < limit && ip[len] == ref[len]) {
+            len++;
+        }
+        op = emit(op, end, anchor, (int)(ip - anchor), (int)(ip - ref), len);
+        if (!op) {
+            return 0;
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    op = emit(op, end, anchor, (int)(src + size - anchor), 0, 0);
+    return op ? (int)(op - dst) : 0;
+}
+
+int lz_decompress(const char *src, int size, char *dst, int capacity) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + size;
+    char *op = dst;
+    char *oend = dst + capacity;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int lit_len = token >> 4;
+        if (lit_len == 15) {
+            int b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (ip + lit_len > iend || op + lit_len > oend) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == iend) {       //Last sequence has no match
+            break;
+        }
+        if (ip + 2 > iend) {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int match_len = (token & 15);
+        if (match_len == 15) {
+            int b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += MIN_MATCH;
+
+        if (offset == 0 || offset > op - dst || op + match_len > oend) {
+            return -1;
+        }
+        const char *ref = op - offset;
+        for (int i = 0; i < match_len; i++) {       //Byte copy, matches may overlap their output
+            op[i] = ref[i];
+        }
+        op += match_len;
+    }
+    return (int)(op - dst);
+}
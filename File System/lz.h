@@ -0,0 +1,14 @@
+#ifndef LZ_H
+#define LZ_H
+
+//Small LZ77 codec using the LZ4 block format (token, literals, 16-bit
+//offset, match length). Inputs are limited to 64KB.
+
+//Returns the compressed size, or 0 if it would not fit in capacity bytes.
+int lz_compress(const char *src, int size, char *dst, int capacity);
+
+//Returns the decompressed size, or -1 if the input is malformed or would
+//not fit in capacity bytes.
+int lz_decompress(const char *src, int size, char *dst, int capacity);
+
+#endif
@@ -4,7 +4,6 @@
 /* as a result.                                                             */
 /* ======================================================================== */
 
-
 #include <stdio.h>
 #include <strings.h>
 #include <string.h>
@@ -13,64 +12,194 @@
 #include "sfs_api.h"
 #include "disk_emu.h"
 
-//i-Node structure
-typedef struct {
-    int mode;               //File permissions          
-    int link_cnt;           //Count of data blocks containing file data
-    int size;               //Size of file
-    int pointers[12];       //Pointers to data blocks      
-    int indirect_pointers;  //Indirect pointer to block containing pointers
-} i_node;
-
-//Superblock structure
-typedef struct {
-    char magic[16];             //            
-    int block_size;             //Set to 1024 bytes            
-    int file_system_size;       //Amount of blocks   
-    int i_node_table_length;    //Size of i-Node table in blocks            
-    int root_directory;         //Pointer to i-Node associated with root directory
-} super_block;
-
-//Open File Descriptor entry structure
-typedef struct {
-    i_node* inode;      //Pointer to i-Node associated will opened file
-    int rwpointer;      //Location of where to start reading from/writing to
-} file_descriptor;
-
-//Directory entry structure
-typedef struct {
-    int i_node_num;     //Pointer to i-Node given to file               
-    char *file_name;    //Name of the file                    
-} dir_entry;
-
-unsigned char bitmap[BLOCK_AMOUNT/8];           //Bitmap using a character array, covers max amount of blocks implemented                    
-i_node i_node_table[INODE_AMOUNT];              //i-Node table cache - capped at 129 entries                                           
-dir_entry root_directory[DIR_AMOUNT];           //Root directory cache - capped at 128 entries                   
-file_descriptor open_fd_table[MAX_FD_AMOUNT];   //Open File Descriptor Table - capped at 128 entries                            
-int root_directory_position;                    //Used to capture the current position of the getnextfilename() method            
 
 int get_free_block() {
+    if (log_active()) {         //The next free block at the head of the log instead
+        return log_alloc();
+    }
+    stats_cache(SFS_CACHE_BITMAP, 1, 0, 0);
     for (int i = 0; i < BLOCK_AMOUNT/8; i++) {  //Iterates through bitmap                    
-        if (bitmap[i] > 0) {                        
-            return i*8 + ffs(bitmap[i]) - 1;    //Returns position of bit that represents an empty block                    
+        if (sfs->bitmap[i] > 0) {                        
+            return i*8 + ffs(sfs->bitmap[i]) - 1;    //Returns position of bit that represents an empty block                    
         }
     }
     printf("%s", "SFS_API: NO FREE BLOCKS FOUND\n");
     return -1;
 }
 
+int get_free_run(int n) {     //First run of n free blocks in a row, -1 if there is none
+    for (int b = 0; b < BLOCK_AMOUNT; ) {
+        if (!(sfs->bitmap[b/8] & (1 << (b % 8)))) {
+            b++;
+            continue;
+        }
+        int run = 1;
+        while (run < n && b + run < BLOCK_AMOUNT && (sfs->bitmap[(b + run)/8] & (1 << ((b + run) % 8)))) {
+            run++;
+        }
+        if (run == n) {
+            return b;
+        }
+        b += run;
+    }
+    return -1;
+}
+
 void remove_bit(int block) {
     int index = (int)block/8;
     int bit_offset = block % 8;
-    char current_set_of_blocks = bitmap[index];
-    bitmap[index] = current_set_of_blocks & ~(1 << bit_offset);     //Turns bit to 0, meaning that the block is no longer free
+    char current_set_of_blocks = sfs->bitmap[index];
+    sfs->bitmap[index] = current_set_of_blocks & ~(1 << bit_offset);     //Turns bit to 0, meaning that the block is no longer free
+    sfs->discard_pending[index] &= ~(1 << bit_offset);                   //Taken again before the call ended, keep it
 }
 
 void set_bit(int block) {
+    if (log_defer_free(block)) {    //The last checkpoint may still use it
+        return;
+    }
     int index = (int)block/8;
     int bit_offset = block % 8;
-    char current_set_of_blocks = bitmap[index];
-    bitmap[index] = current_set_of_blocks | (1 << bit_offset);      //Turns bit to 1, meaning that the block is now free
+    char current_set_of_blocks = sfs->bitmap[index];
+    sfs->bitmap[index] = current_set_of_blocks | (1 << bit_offset);      //Turns bit to 1, meaning that the block is now free
+    if (disk_is_sparse()) {
+        sfs->discard_pending[index] |= 1 << bit_offset;
+        sfs->discards_queued = 1;
+    }
+}
+
+/* ======================================================================== */
+/* discard_flush:                                                           */
+/* Hands the blocks freed during the call back to a sparse disk image,      */
+/* adjacent ones in a single discard. Runs at the end of the call so a      */
+/* block freed and taken again in between is never punched.                 */
+/* ======================================================================== */
+void discard_flush() {
+    if (!sfs->discards_queued) {
+        return;
+    }
+    for (int block = 0; block < BLOCK_AMOUNT; block++) {
+        if (!(sfs->discard_pending[block/8] & (1 << (block % 8)))) {
+            continue;
+        }
+        int run = 1;
+        while (block + run < BLOCK_AMOUNT && (sfs->discard_pending[(block + run)/8] & (1 << ((block + run) % 8)))) {
+            run++;
+        }
+        region_discard(block, run);
+        block += run - 1;
+    }
+    memset(sfs->discard_pending, 0, sizeof(sfs->discard_pending));
+    sfs->discards_queued = 0;
+}
+
+/* ======================================================================== */
+/* load_slots / mask_unwritten / own_indirect / store_slots:                */
+/* A file's block pointers as one array, direct pointers first and then     */
+/* the ones in the indirect block. A slot holds a block number, -1 when no  */
+/* block is allocated, or the length of a compressed chunk (see             */
+/* sfs_compress.c). The last i-Node->unwritten slots hold blocks reserved   */
+/* by sfs_fallocate that were never written, mask_unwritten hides them so   */
+/* they read as zeros.                                                      */
+/* Before a call changes any slot past the 12 direct ones it takes the      */
+/* indirect block those slots will be written to with own_indirect:         */
+/* allocated the first time, copied if a snapshot or clone shares it, moved */
+/* in log mode. That is the only step that can run out of blocks, and it    */
+/* runs while nothing has changed yet, so a full disk never leaves data     */
+/* slots changed that can't be stored. store_slots then writes the indirect */
+/* block if one of its slots changed or it was moved, and releases the      */
+/* block it replaced. old_indirect is the file's indirect block before the  */
+/* call; one taken for slots that never got a block is given back.          */
+/* load_slots returns -1 if the indirect block can't be read (read error or */
+/* checksum mismatch), callers give up before changing anything.            */
+/* ======================================================================== */
+int load_slots(i_node *inode, int *slots) {
+    int count = inode->link_cnt;
+    for (int i = 0; i < MAX_FILE_BLOCKS; i++) {
+        slots[i] = -1;
+    }
+    memcpy(slots, inode->pointers, sizeof(inode->pointers));
+    if (count > 12 && inode->indirect_pointers >= 0) {
+        int *indirect_block = (int *) disk_alloc(BLOCK_SIZE);
+        int result = region_read(SFS_REGION_INDIRECT, inode->indirect_pointers, 1, indirect_block);
+        if (result >= 0) {
+            memcpy(slots + 12, indirect_block, (count - 12) * sizeof(int));
+        }
+        free(indirect_block);
+        if (result < 0) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+void mask_unwritten(i_node *inode, int *slots) {    //Slots as reads see them: reserved blocks hold no data yet
+    for (int i = inode->link_cnt - inode->unwritten; i < inode->link_cnt; i++) {
+        slots[i] = -1;
+    }
+}
+
+int own_indirect(i_node *inode, int old_indirect) {
+    if (inode->indirect_pointers != old_indirect) {     //Taken earlier in the same call
+        return 0;
+    }
+    if (old_indirect >= 0 && !block_is_shared(old_indirect) && !log_active()) {    //Written in place
+        return 0;
+    }
+    int block = get_free_block();
+    if (block < 0) {
+        return -1;
+    }
+    remove_bit(block);
+    inode->indirect_pointers = block;
+    return 0;
+}
+
+int store_slots(i_node *inode, int *slots, int *old_slots, int count, int old_indirect) {
+    if (count <= 12 && inode->indirect_pointers != old_indirect) {      //No slot past the direct ones got a block
+        set_bit(inode->indirect_pointers);
+        inode->indirect_pointers = old_indirect;
+    }
+    int changed = count > 12 && memcmp(slots + 12, old_slots + 12, (count - 12) * sizeof(int)) != 0;
+    if (changed && own_indirect(inode, old_indirect) < 0) {    //The caller didn't take it first, nothing changed yet
+        return -1;
+    }
+    memcpy(inode->pointers, slots, sizeof(inode->pointers));
+    if (!changed && inode->indirect_pointers == old_indirect) {
+        return 0;
+    }
+    int *indirect_block = (int *) disk_alloc(BLOCK_SIZE);
+    memset(indirect_block, 0, BLOCK_SIZE);
+    memcpy(indirect_block, slots + 12, (count - 12) * sizeof(int));
+    region_write(SFS_REGION_INDIRECT, inode->indirect_pointers, 1, indirect_block);
+    free(indirect_block);
+    if (old_indirect >= 0 && inode->indirect_pointers != old_indirect) {   //A snapshot or clone keeps the old one, or the log frees it
+        block_release(old_indirect);
+    }
+    return 0;
+}
+
+void write_superblock() {       //Initialise and set data for superblock, then write it to block 0
+    if (log_active()) {         //Written by the next checkpoint
+        return;
+    }
+    super_block superblock;
+    memset(&superblock, 0, sizeof(superblock));
+    memcpy(superblock.magic,SFS_MAGIC,strlen(SFS_MAGIC));
+    superblock.block_size = BLOCK_SIZE;
+    superblock.file_system_size = BLOCK_AMOUNT;
+    superblock.i_node_table_length = sfs->inode_table_length;
+    memcpy(superblock.i_node_blocks, sfs->inode_blocks, sizeof(superblock.i_node_blocks));
+    superblock.root_directory = 0;
+    superblock.features = sfs->features;
+    superblock.snapshot_root = sfs->snapshot_root;
+    write_meta(SFS_REGION_SUPERBLOCK, 0, sizeof(superblock), &superblock);
+}
+
+void write_bitmap() {           //Held back until the next checkpoint in log mode
+    if (log_active()) {
+        return;
+    }
+    write_meta(SFS_REGION_BITMAP, BITMAP_START, sizeof(sfs->bitmap), &sfs->bitmap);
 }
 
 int size_to_blocks(int size) {          //Pretty much just gets the ceiling of input in blocks
@@ -80,40 +209,244 @@ int size_to_blocks(int size) {          //Pretty much just gets the ceiling of i
     return size/BLOCK_SIZE;
 }
 
-int scan_dir_name(char* fname) {        //Scans the directory for a given file and returns index of i-Node 
+/* ======================================================================== */
+/* Directory index:                                                         */
+/* A bitmap of the directory entries in use (1 = in use), rebuilt whenever  */
+/* the directory is read and kept up to date on create and remove. Listing  */
+/* the directory and looking for a free entry jump from one entry to the    */
+/* next with a bit scan instead of looking at every entry.                  */
+/* ======================================================================== */
+static void dir_index_set(int slot, int in_use) {
+    if (in_use) {
+        sfs->dir_live[slot / 64] |= (uint64_t) 1 << (slot % 64);
+    }
+    else {
+        sfs->dir_live[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+    }
+}
+
+static void dir_index_load() {
+    memset(sfs->dir_live, 0, sizeof(sfs->dir_live));
     for (int i = 0; i < DIR_AMOUNT; i++) {
-        if (strcmp(root_directory[i].file_name, fname) == 0) {
-            return root_directory[i].i_node_num;                //Returns the index of inode for a given file
+        dir_index_set(i, sfs->root_directory[i].file_name[0] != '\0');
+    }
+}
+
+static int dir_next(int from) {         //First entry in use at or after from, -1 if none
+    while (from < DIR_AMOUNT) {
+        uint64_t bits = sfs->dir_live[from / 64] >> (from % 64);
+        if (bits) {
+            return from + __builtin_ctzll(bits);
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+static int dir_free_slot() {            //First free entry, -1 if the directory is full
+    for (int w = 0; w < DIR_WORDS; w++) {
+        if (~sfs->dir_live[w]) {
+            int slot = w * 64 + __builtin_ctzll(~sfs->dir_live[w]);
+            return slot < DIR_AMOUNT ? slot : -1;
+        }
+    }
+    return -1;
+}
+
+int scan_dir_name(char* fname) {        //Scans the directory for a given file and returns index of i-Node 
+    stats_cache(SFS_CACHE_DIRECTORY, 1, 0, 0);
+    for (int i = dir_next(0); i >= 0; i = dir_next(i + 1)) {
+        if (strcmp(sfs->root_directory[i].file_name, fname) == 0) {
+            return sfs->root_directory[i].i_node_num;                //Returns the index of inode for a given file
         }
     }        
     return -1;
 }
 
-int find_free_i_node () {                       //Finds index of a free i-Node
-    for (int i = 0; i < INODE_AMOUNT; i++) {
-        if (i_node_table[i].size == -1) {
-            return i;
+/* ======================================================================== */
+/* i-Node allocation:                                                       */
+/* The on-disk i-Node table starts out as one block and grows a block at a  */
+/* time, wherever the allocator finds one, when every i-Node it holds is in */
+/* use. Free i-Nodes are tracked in a bitmap built at mount, and a few of   */
+/* them are kept at hand in a cache: creating a file pops the cache,        */
+/* removing one pushes onto it, and only an empty cache looks at the        */
+/* bitmap, resuming where it stopped the last time.                         */
+/* ======================================================================== */
+static int inode_capacity() {       //i-Nodes the table's blocks hold
+    int capacity = sfs->inode_table_length * INODES_PER_BLOCK;
+    return capacity < INODE_AMOUNT ? capacity : INODE_AMOUNT;
+}
+
+static void clear_i_node(int index) {   //Back to a free i-Node
+    i_node *inode = &sfs->i_node_table[index];
+    inode->mode = 0;
+    inode->link_cnt = 0;
+    inode->size = -1;
+    for (int j = 0; j < 12; j++) {
+        inode->pointers[j] = -1;
+    }
+    inode->indirect_pointers = -1;
+    memset(inode->inline_data, 0, SFS_INLINE_MAX);
+    inode->unwritten = 0;
+}
+
+void inode_map_load() {         //Bitmap of the free i-Nodes in the table, empty cache
+    memset(sfs->inode_bitmap, 0, sizeof(sfs->inode_bitmap));
+    for (int i = 1; i < inode_capacity(); i++) {    //i-Node 0 is the root directory
+        if (sfs->i_node_table[i].size == -1) {
+            sfs->inode_bitmap[i/8] |= 1 << (i % 8);
         }
     }
+    sfs->free_inode_count = 0;
+    sfs->inode_scan = 0;
+}
+
+static void refill_inode_cache() {
+    int capacity = inode_capacity();
+    for (int looked = 0; looked < capacity && sfs->free_inode_count < SFS_INODE_CACHE; looked++) {
+        int i = sfs->inode_scan;
+        sfs->inode_scan = (i + 1) % capacity;
+        if (sfs->inode_bitmap[i/8] & (1 << (i % 8))) {
+            sfs->inode_bitmap[i/8] &= ~(1 << (i % 8));
+            sfs->free_inodes[sfs->free_inode_count++] = i;
+        }
+    }
+}
+
+static int grow_inode_table() {     //One more table block, its i-Nodes all free
+    if (sfs->inode_table_length == INODE_TABLE_BLOCKS) {
+        return -1;
+    }
+    int block = get_free_block();
+    if (block < 0) {
+        return -1;
+    }
+    remove_bit(block);
+    int first = sfs->inode_table_length * INODES_PER_BLOCK;
+    sfs->inode_blocks[sfs->inode_table_length++] = block;
+    for (int i = first; i < inode_capacity(); i++) {
+        sfs->inode_bitmap[i/8] |= 1 << (i % 8);
+    }
+    write_inode(first);
+    write_superblock();
+    write_bitmap();
+    return 0;
+}
+
+int alloc_i_node() {            //Returns a free i-Node, -1 if the table can't hold another one
+    stats_cache(SFS_CACHE_INODE_TABLE, 1, 0, 0);
+    if (sfs->free_inode_count == 0) {
+        refill_inode_cache();
+    }
+    if (sfs->free_inode_count == 0 && grow_inode_table() == 0) {
+        refill_inode_cache();
+    }
+    if (sfs->free_inode_count == 0) {
+        return -1;
+    }
+    return sfs->free_inodes[--sfs->free_inode_count];
+}
+
+void free_i_node(int index) {
+    clear_i_node(index);
+    if (sfs->free_inode_count < SFS_INODE_CACHE) {
+        sfs->free_inodes[sfs->free_inode_count++] = index;
+    }
+    else {
+        sfs->inode_bitmap[index/8] |= 1 << (index % 8);
+    }
+}
+
+int region_cache(int region) {     //In-memory cache that holds a metadata region, -1 if none
+    switch (region) {
+        case SFS_REGION_INODE_TABLE: return SFS_CACHE_INODE_TABLE;
+        case SFS_REGION_BITMAP: return SFS_CACHE_BITMAP;
+        case SFS_REGION_DIRECTORY: return SFS_CACHE_DIRECTORY;
+    }
     return -1;
 }
 
+void write_meta(int region, int start, int size, void *data) {     //Writes a structure through a zeroed block-sized buffer, so no bytes past it are written
+    if (region_cache(region) >= 0) {
+        stats_cache(region_cache(region), 0, 0, 1);
+    }
+    int blocks = size_to_blocks(size);
+    char *buffer = disk_alloc(blocks * BLOCK_SIZE);
+    memcpy(buffer, data, size);
+    memset(buffer + size, 0, blocks * BLOCK_SIZE - size);
+    region_write(region, start, blocks, buffer);
+    free(buffer);
+}
+
+int read_meta(int region, int start, int size, void *data) {       //Reads a structure through a block-sized buffer, so no bytes past it are overwritten; -1 leaves data as it was
+    if (region_cache(region) >= 0) {
+        stats_cache(region_cache(region), 0, 1, 0);
+    }
+    int blocks = size_to_blocks(size);
+    char *buffer = disk_alloc(blocks * BLOCK_SIZE);
+    int result = region_read(region, start, blocks, buffer);
+    if (result >= 0) {
+        memcpy(data, buffer, size);
+    }
+    free(buffer);
+    return result < 0 ? -1 : 0;
+}
+
+void write_inode(int index) {      //Writes only the i-Node table block holding the given i-Node
+    int block = index / INODES_PER_BLOCK;
+    if (log_active()) {         //Moved to the log by the next checkpoint
+        sfs->log_table_dirty[block] = 1;
+        return;
+    }
+    int first = block * INODES_PER_BLOCK;
+    int count = INODE_AMOUNT - first < INODES_PER_BLOCK ? INODE_AMOUNT - first : INODES_PER_BLOCK;
+    write_meta(SFS_REGION_INODE_TABLE, sfs->inode_blocks[block], count * sizeof(i_node), &sfs->i_node_table[first]);
+}
+
+static int read_inode_table() {    //i-Nodes past the blocks the table has are free
+    for (int i = 0; i < INODE_AMOUNT; i++) {
+        clear_i_node(i);
+    }
+    for (int block = 0; block < sfs->inode_table_length; block++) {
+        int first = block * INODES_PER_BLOCK;
+        int count = INODE_AMOUNT - first < INODES_PER_BLOCK ? INODE_AMOUNT - first : INODES_PER_BLOCK;
+        if (read_meta(SFS_REGION_INODE_TABLE, sfs->inode_blocks[block], count * sizeof(i_node), &sfs->i_node_table[first]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 void write_directory() {        //writes directory from memory to disk using i-nodes
-    i_node root_i_node = i_node_table[0];
+    i_node root_i_node = sfs->i_node_table[0];
 
-    int dir_blocks = (size_to_blocks(sizeof(root_directory)));
+    if (log_active()) {         //Moved to the log by the next checkpoint
+        sfs->log_directory_dirty = 1;
+        return;
+    }
+    stats_cache(SFS_CACHE_DIRECTORY, 0, 0, 1);
+    int dir_blocks = (size_to_blocks(sizeof(sfs->root_directory)));
     for(int i = 0; i < dir_blocks; i++) {
-        write_blocks(root_i_node.pointers[i], 1, (char *) root_directory + (i*BLOCK_SIZE));
+        region_write(SFS_REGION_DIRECTORY, root_i_node.pointers[i], 1, (char *) sfs->root_directory + (i*BLOCK_SIZE));
     }
 }
 
-void read_directory() {         //reads directory from disk to memory using i-nodes
-    i_node root_i_node = i_node_table[0];
+int read_directory() {          //reads directory from disk to memory using i-nodes, -1 leaves the one in memory as it was
+    i_node root_i_node = sfs->i_node_table[0];
 
-    int dir_blocks = (size_to_blocks(sizeof(root_directory)));
+    stats_cache(SFS_CACHE_DIRECTORY, 0, 1, 0);
+    int dir_blocks = (size_to_blocks(sizeof(sfs->root_directory)));
+    char *buffer = disk_alloc(dir_blocks * BLOCK_SIZE);
     for(int i = 0; i < dir_blocks; i++) {
-        read_blocks(root_i_node.pointers[i], 1, (char *) root_directory + (i*BLOCK_SIZE));
+        if (region_read(SFS_REGION_DIRECTORY, root_i_node.pointers[i], 1, buffer + (i*BLOCK_SIZE)) < 0) {
+            free(buffer);
+            return -1;
+        }
     }
+    memcpy(sfs->root_directory, buffer, sizeof(sfs->root_directory));
+    free(buffer);
+    dir_index_load();
+    return 0;
 }
 
 /* ======================================================================== */                                                                                                                                      
@@ -121,82 +454,138 @@ void read_directory() {         //reads directory from disk to memory using i-no
 /*  Creates structure for the disk using the disk emulator.                 */                        
 /*  Has fresh flag to indicate whether or not the file system should be     */                     
 /*  created from scratch. Fresh = true, create from scratch.                */                        
+/*  If any table of an existing disk can't be read, none of what was read   */
+/*  is trusted: the file system is left with no files and read-only until   */
+/*  a mksfs works, and -1 is returned.                                      */
 /* ======================================================================== */
-void mksfs(int fresh) {
-    root_directory_position = -1;
+static int mount_failed() {
+    for (int i = 0; i < INODE_AMOUNT; i++) {
+        clear_i_node(i);
+    }
+    for (int i = 0; i < DIR_AMOUNT; i++) {
+        sfs->root_directory[i].i_node_num = -1;
+        strcpy(sfs->root_directory[i].file_name, "\0");
+    }
+    for (int i = 0; i < MAX_FD_AMOUNT; i++) {
+        sfs->open_fd_table[i].inode = 0;
+        sfs->open_fd_table[i].rwpointer = -1;
+    }
+    append_reset();
+    dir_index_load();
+    inode_map_load();
+    sfs->snapshot_root = -1;
+    sfs->read_only = 1;
+    printf("SFS_API: DISK COULD NOT BE LOADED; READ ERROR.\n");
+    return -1;
+}
+
+static int do_mksfs(int fresh) {
+    if (fresh == 1) {
+        append_reset();         //The image is started over, buffered appends with it
+    }
+    else {
+        append_sync();          //Remounting reloads the tables from disk
+    }
+    sfs_stats_reset();
+    chunk_cache_invalidate(-1);
+    map_reset();
+    sfs->root_directory_position = -1;
+    sfs->read_only = 0;
+    memset(sfs->discard_pending, 0, sizeof(sfs->discard_pending));
+    sfs->discards_queued = 0;
+    sfs->defrag_inode = 0;
+    log_reset();
     if (fresh == 1) {
-        init_fresh_disk("Tairov_sfs", BLOCK_SIZE, BLOCK_AMOUNT);  //initialise a fresh disk
+        init_fresh_disk(sfs->image, BLOCK_SIZE, BLOCK_AMOUNT);   //initialise a fresh disk
+        sfs->features = SFS_FEATURE_CHECKSUM;
+        sfs->snapshot_root = -1;
+        checksum_format();                              //Checksums start out matching the zeroed disk
+        refcount_format();
 
         for (int i = 0; i < (BLOCK_AMOUNT/8)-1; i++) {      //set every set of 8 blocks to 1 (255 = 11111111 in binary)
-            bitmap[i] = 255;
+            sfs->bitmap[i] = 255;
+        }
+        for (int i = REFCOUNT_START; i < CHECKSUM_START + CHECKSUM_BLOCKS; i++) {  //Refcount and checksum tables sit right before the bitmap
+            remove_bit(i);
         }
 
-        super_block superblock;                         //Initialise and set data for superblock
-        memcpy(superblock.magic,"0xABCD0005",9);
-        superblock.block_size = BLOCK_SIZE;
-        superblock.file_system_size = BLOCK_AMOUNT;
-        superblock.i_node_table_length = size_to_blocks(INODE_AMOUNT);
-        superblock.root_directory = 0;
-        write_blocks(0, 1, &superblock);                //Write superblock to block 0 in disk
+        sfs->inode_table_length = 0;
+        write_superblock();                             //Write superblock to block 0 in disk
         remove_bit(0);                                  //Mark block as taken in bitmap
         
         for (int i = 0; i < INODE_AMOUNT; i++) {        //Initialise i-Nodes, root directory, and fd table
 
-            i_node_table[i].mode = 0;                   //Initialising i-Nodes                                
-            i_node_table[i].link_cnt = 0;                                                  
-            i_node_table[i].size = -1;                                                  
-            for (int j = 0; j < 12; j++) {                                                 
-                i_node_table[i].pointers[j] = -1;                                                  
-            }                                                   
-            i_node_table[i].indirect_pointers = -1;                                               
+            clear_i_node(i);                            //Initialising i-Nodes
 
             if (i < DIR_AMOUNT) {
-                root_directory[i].i_node_num = -1;      //Initialising root directory entries
-                root_directory[i].file_name = malloc(MAXFILENAME * sizeof(char));
-                strcpy(root_directory[i].file_name, "\0");
+                sfs->root_directory[i].i_node_num = -1;      //Initialising root directory entries
+                strcpy(sfs->root_directory[i].file_name, "\0");
             }
 
             if (i < MAX_FD_AMOUNT) {
-                open_fd_table[i].inode = 0;             //Initialising open fd table entries
-                open_fd_table[i].rwpointer = -1;
+                sfs->open_fd_table[i].inode = 0;             //Initialising open fd table entries
+                sfs->open_fd_table[i].rwpointer = -1;
             }
         }
         
-        int i_node_blocks = size_to_blocks(sizeof(i_node_table));       //Find how many blocks i-Node table occupies
-        int dir_blocks = size_to_blocks(sizeof(root_directory));        //Find how many blocks root directory occupies
+        dir_index_load();                               //Every entry is free
+
+        int dir_blocks = size_to_blocks(sizeof(sfs->root_directory));        //Find how many blocks root directory occupies
         
-        int next_free_bit = get_free_block();
-        for (int i = next_free_bit; i < i_node_blocks + next_free_bit; i++) {   //Remove free bits from bitmap occupied by i-Node block
-            remove_bit(i);
-        }
+        grow_inode_table();                             //The i-Node table starts with the block holding the root i-Node
 
         for (int i = 0; i < dir_blocks; i++) {              //Remove free bits from bitmap occupied by directory      
-            next_free_bit = get_free_block();
-            i_node_table[0].pointers[i] = next_free_bit;        //Set root i-Node pointers to point at root directory blocks
+            int next_free_bit = get_free_block();
+            sfs->i_node_table[0].pointers[i] = next_free_bit;        //Set root i-Node pointers to point at root directory blocks
             remove_bit(next_free_bit);
         }
         
-        i_node_table[0].mode = 0;                   //Initialise i-Node associated with root directory             
-        i_node_table[0].link_cnt = dir_blocks;                  
-        i_node_table[0].size = 0;                   
-        i_node_table[0].indirect_pointers = -1;                 
+        sfs->i_node_table[0].mode = 0;                   //Initialise i-Node associated with root directory             
+        sfs->i_node_table[0].link_cnt = dir_blocks;                  
+        sfs->i_node_table[0].size = 0;                   
+        sfs->i_node_table[0].indirect_pointers = -1;                 
 
-        write_blocks(BLOCK_AMOUNT-(size_to_blocks(sizeof(bitmap))), size_to_blocks(sizeof(bitmap)), &bitmap);   //Write bitmap to end of disk
+        write_bitmap();   //Write bitmap to end of disk
             
-        write_blocks(1,i_node_blocks,&i_node_table);    //Write i-Node table to disk
+        write_inode(0);         //Write i-Node table to disk
+        inode_map_load();
         write_directory();      //Write directory to disk
         
         printf("SFS_API: DISK CREATED & LOADED SUCCESSFULLY.\n");
     }
     else {
-        init_disk("Tairov_sfs", BLOCK_SIZE, BLOCK_AMOUNT);    //Initialise premade disk
-        int i_node_blocks = size_to_blocks(sizeof(i_node_table));       //Find how many blocks i-Node table occupies
+        if (init_disk(sfs->image, BLOCK_SIZE, BLOCK_AMOUNT) < 0) {     //Initialise premade disk
+            return mount_failed();
+        }
+
+        super_block superblock;                         //Features are only known once the superblock is read
+        checksum_disable();
+        if (read_meta(SFS_REGION_SUPERBLOCK, 0, sizeof(superblock), &superblock) < 0) {
+            return mount_failed();
+        }
+        int known = memcmp(superblock.magic, SFS_MAGIC, strlen(SFS_MAGIC)) == 0;
+        sfs->features = known ? superblock.features : 0;
+        sfs->snapshot_root = known ? superblock.snapshot_root : -1;
+        if ((sfs->features & SFS_FEATURE_CHECKSUM) && checksum_load() < 0) {
+            return mount_failed();
+        }
+        if (refcount_load() < 0) {
+            return mount_failed();
+        }
         
-        read_blocks(1,i_node_blocks,&i_node_table);     //Read i-Nodes into memory
-        read_blocks(BLOCK_AMOUNT-(size_to_blocks(sizeof(bitmap))), size_to_blocks(sizeof(bitmap)), &bitmap);    //Read bitmap into memory
-        read_directory();   //Read directory into memory
+        sfs->inode_table_length = known ? superblock.i_node_table_length : INODE_TABLE_BLOCKS;
+        for (int i = 0; i < INODE_TABLE_BLOCKS; i++) {  //An unknown image is read as a table right after the superblock
+            sfs->inode_blocks[i] = known ? superblock.i_node_blocks[i] : 1 + i;
+        }
+        if (read_inode_table() < 0                      //Read i-Nodes, bitmap and directory into memory
+            || read_meta(SFS_REGION_BITMAP, BITMAP_START, sizeof(sfs->bitmap), &sfs->bitmap) < 0
+            || read_directory() < 0) {
+            return mount_failed();
+        }
+        inode_map_load();
         printf("SFS_API: DISK LOADED SUCCESSFULLY.\n");
     }
+    return 0;
 }
 
 /* ======================================================================== */                                                                                                                                      
@@ -205,28 +594,50 @@ void mksfs(int fresh) {
 /* the directory, similar to a linked list. When reach the end of the,      */                                                                
 /* directory return 0.                                                      */                                                            
 /* ======================================================================== */
-int sfs_getnextfilename(char* fname) {
-    while (root_directory_position < DIR_AMOUNT - 1) {      //Iterate through directories until end
-        root_directory_position++;      //Increment global variable
-        
-        if(strcmp(root_directory[root_directory_position].file_name,"\0") != 0) {   //If directory not empty
-            strcpy(fname, root_directory[root_directory_position].file_name);   //Copy name into buffer
-            return 1;
-        }
+static int do_getnextfilename(char* fname) {
+    int next = dir_next(sfs->root_directory_position + 1);     //Skip straight to the next entry in use
+    if (next >= 0) {
+        sfs->root_directory_position = next;
+        strcpy(fname, sfs->root_directory[next].file_name);   //Copy name into buffer
+        return 1;
     }
-    root_directory_position = -1;
+    sfs->root_directory_position = -1;
     return 0;
 }
 
+/* ======================================================================== */
+/* readdir:                                                                 */
+/* getnextfilename with the position kept by the caller, so any number of   */
+/* listings can run at once. A cursor starts at 0 and is the directory      */
+/* entry after the one returned last, so it stays valid across creates and  */
+/* removes and can be stored (as the FUSE readdir offset, for one) and      */
+/* resumed. Returns 1 and advances the cursor, 0 at the end.                */
+/* ======================================================================== */
+static int do_readdir(int *cursor, char *fname) {
+    if (cursor == NULL || *cursor < 0) {
+        printf("SFS_API: CANNOT READ DIRECTORY; INVALID CURSOR.\n");
+        return -1;
+    }
+    int next = *cursor < DIR_AMOUNT ? dir_next(*cursor) : -1;
+    if (next < 0) {
+        *cursor = DIR_AMOUNT;
+        return 0;
+    }
+    strcpy(fname, sfs->root_directory[next].file_name);
+    *cursor = next + 1;
+    return 1;
+}
+
 /* ======================================================================== */                                                                                                                                      
 /* getfilesize:                                                             */    
 /* Finds the size of a given file by looping through the directory and      */    
 /* returning the size of the i-Node associated with the file                */                                                                          
 /* ======================================================================== */
-int sfs_getfilesize(const char* path) {
+static int do_getfilesize(const char* path) {
     int i_node_index = scan_dir_name((char *)path);     //Get index of i-Node associated with file
     if (i_node_index > 0) {                             //If i-Node exist
-        return i_node_table[i_node_index].size;         //Return file size
+        i_node *file_i_node = &sfs->i_node_table[i_node_index];
+        return file_i_node->size + append_pending(file_i_node);     //Return file size, appends not committed yet included
     }
     return -1;
 }
@@ -244,35 +655,35 @@ int sfs_getfilesize(const char* path) {
 /*         - Needs a free i-Node to be allocated for the file               */                                        
 /*         - Needs a free space in the root directory                       */                                                                                                                                             
 /* ======================================================================== */
-int sfs_fopen(char* name) {
+static int do_fopen(char* name) {
     if (strlen(name) > MAXFILENAME) {       //Check if file name is within limit
         printf("SFS_API: FILE NAME TOO LONG.\n");
         return -1;
     }
 
     int index_of_inode = scan_dir_name(name); //Find index of i-Node associated with file
+    if (index_of_inode < 0 && sfs->read_only) {
+        printf("SFS_API: CANNOT CREATE FILE; SNAPSHOT IS READ-ONLY.\n");
+        return -1;
+    }
     if (index_of_inode < 0) {  //File doesn't exist - needs to be created:
 
-        index_of_inode = find_free_i_node();    //Find free i-Node for file
+        index_of_inode = alloc_i_node();        //Find free i-Node for file
         if (index_of_inode >= 0) {  //Free i-Node found:
 
-            int free_directory = -1;    
-            for (int i = 0; i < DIR_AMOUNT && free_directory == -1; i++) { //Find index of free space in directory
-                if (strcmp(root_directory[i].file_name, "\0")==0) {     
-                    free_directory = i;
-                }
-            }
+            int free_directory = dir_free_slot();   //Find index of free space in directory
             if (free_directory >= 0) {  //If free directory space found:
-                memcpy(root_directory[free_directory].file_name, name,strlen(name)); //Set name of the file in directory
-                root_directory[free_directory].i_node_num = index_of_inode;     //Assign i-Node to file in directory
+                memcpy(sfs->root_directory[free_directory].file_name, name,strlen(name)+1); //Set name of the file in directory
+                sfs->root_directory[free_directory].i_node_num = index_of_inode;     //Assign i-Node to file in directory
+                dir_index_set(free_directory, 1);
 
-                i_node_table[index_of_inode].size = 0;                       //set size of i-Node to 0   
-                int i_node_blocks = size_to_blocks(sizeof(i_node_table));                           
+                sfs->i_node_table[index_of_inode].size = 0;                       //set size of i-Node to 0   
 
-                write_blocks(1,i_node_blocks,&i_node_table);        //Write i-Node table to disk
+                write_inode(index_of_inode);    //Write i-Node to disk
                 write_directory();  //Write directory to disk
             }
             else {
+                free_i_node(index_of_inode);
                 printf("SFS_API: MAX FILE DIRECTORY SPACE REACHED");
                 return -1;
             }
@@ -284,7 +695,7 @@ int sfs_fopen(char* name) {
     }
 
     for (int i = 0; i < MAX_FD_AMOUNT; i++) { //Check if file is already open
-        if (open_fd_table[i].inode == &i_node_table[index_of_inode]) {
+        if (sfs->open_fd_table[i].inode == &sfs->i_node_table[index_of_inode]) {
             printf("SFS_API: FILE ALREADY OPEN\n");
             return i;
         }
@@ -292,14 +703,14 @@ int sfs_fopen(char* name) {
 
     int free_fd_found = -1;
     for (int i = 0; i < MAX_FD_AMOUNT && free_fd_found == -1; i++) { //Check if there is a free space in OFD table
-        if (!open_fd_table[i].inode) {
+        if (!sfs->open_fd_table[i].inode) {
             free_fd_found = i;
         }
     }
 
     if (free_fd_found >= 0) {
-        open_fd_table[free_fd_found].inode = &i_node_table[index_of_inode];             //Set pointer to i-Node associated with file
-        open_fd_table[free_fd_found].rwpointer = i_node_table[index_of_inode].size;     //Set pointer to the end of the file (append mode)
+        sfs->open_fd_table[free_fd_found].inode = &sfs->i_node_table[index_of_inode];             //Set pointer to i-Node associated with file
+        sfs->open_fd_table[free_fd_found].rwpointer = sfs->i_node_table[index_of_inode].size;     //Set pointer to the end of the file (append mode)
 
         return free_fd_found;
     }
@@ -313,171 +724,536 @@ int sfs_fopen(char* name) {
 /* Closes a file, that is, only if the file exists and if it is currently   */
 /* open. Sets file descriptor entry to defaults.                            */                                                                                                                                                                                                              
 /* ======================================================================== */
-int sfs_fclose(int fileID) {
-    if (!open_fd_table[fileID].inode) {     //Check that file is in fact open
+static int do_fclose(int fileID) {
+    if (!sfs->open_fd_table[fileID].inode) {     //Check that file is in fact open
         printf("SFS_API: CANNOT CLOSE FILE; FILE NOT OPEN\n");
         return -1;
     }
-    open_fd_table[fileID].inode = 0;        //Reset i-Node pointer in fd table
-    open_fd_table[fileID].rwpointer = -1;   //Set pointer to -1
-    return 0;
+    if (map_count(fileID) > 0) {            //Views are written back through the open file
+        printf("SFS_API: CANNOT CLOSE FILE; FILE HAS MAPPINGS\n");
+        return -1;
+    }
+    int result = append_flush(fileID);      //The file is closed even if this fails
+    append_release(fileID);
+    sfs->open_fd_table[fileID].inode = 0;        //Reset i-Node pointer in fd table
+    sfs->open_fd_table[fileID].rwpointer = -1;   //Set pointer to -1
+    return result;
 }
 
-/* ======================================================================== */                                                                                                                                      
-/* fwrite:                                                                  */                                                
-/* Writes to a file, given that it is currently open.                       */                                                        
-/* Procedures of writing to a file:                                         */                                    
-/*     - If file needs another block(s) allocated to it:                    */                                                                
-/*                                                                          */
-/*         - If an indirect pointer block needs to be allocated             */                                                                        
-/*                                                                          */                             
-/*             - Allocate an indirect pointer block to file i-Node          */                                                        
-/*                                                                          */    
-/*         - Allocate block(s) to the file i-Node/Indirect BLock            */                                                                
-/*                                                                          */        
-/*     - Bring all blocks associated with file into memory                  */                                                            
-/*     - Write to these blocks in memory                                    */                                            
-/*     - Write these blocks to the disk                                     */ 
-/*     - Set rw pointer to the end of file                                  */                                                                                                                                                                                                                                                      
 /* ======================================================================== */
-int sfs_fwrite(int fileID, const char* buf, int length) {
-    if (!open_fd_table[fileID].inode) { //Check that file is open
+/* promote_inline:                                                          */
+/* An inline file is about to grow past SFS_INLINE_MAX. As fseek can't go   */
+/* past the end, the write covers all inline bytes from rw pointer onwards, */
+/* so the file is rewritten from offset 0 as the inline bytes before the    */
+/* pointer followed by the new data. If not even the first block could be  */
+/* allocated the file stays inline and unchanged.                           */
+/* ======================================================================== */
+static int do_fwrite(int fileID, const char* buf, int length);
+
+static int promote_inline(int fileID, const char* buf, int length) {
+    i_node *file_i_node = sfs->open_fd_table[fileID].inode;
+    int start = sfs->open_fd_table[fileID].rwpointer;
+    int old_size = file_i_node->size;
+    char saved[SFS_INLINE_MAX];
+    char *merged = malloc(start + length);
+
+    memcpy(saved, file_i_node->inline_data, SFS_INLINE_MAX);
+    memcpy(merged, saved, start);
+    memcpy(merged + start, buf, length);
+    memset(file_i_node->inline_data, 0, SFS_INLINE_MAX);
+    file_i_node->size = 0;
+    sfs->open_fd_table[fileID].rwpointer = 0;
+
+    int result = do_fwrite(fileID, merged, start + length);
+    free(merged);
+    if (result >= 0) {
+        return length;
+    }
+    file_i_node->size = old_size;
+    sfs->open_fd_table[fileID].rwpointer = start;
+    if (file_i_node->link_cnt == 0) {
+        memcpy(file_i_node->inline_data, saved, SFS_INLINE_MAX);
+    }
+    write_inode(file_i_node - sfs->i_node_table);
+    return -1;
+}
+
+/* ======================================================================== */
+/* fwrite:                                                                  */
+/* Writes to a file, given that it is currently open.                       */
+/* Files of up to SFS_INLINE_MAX bytes are kept inside their i-Node and     */
+/* only move to data blocks once they grow past it.                         */
+/* The file is handled in chunks of CHUNK_BLOCKS logical blocks:            */
+/*     - Bring the file's block pointers (the slots) into memory            */
+/*     - For every chunk the write touches:                                 */
+/*         - Raw chunk, compression off: read-modify-write only the blocks  */
+/*           touched, allocating blocks the file doesn't have yet           */
+/*         - Otherwise: bring the whole chunk into memory (decompressing    */
+/*           it if needed), write to it, and store it back, compressed if   */
+/*           compression is on and it saves at least one block              */
+/*     - Write back the pointers, bitmap and i-Node table once              */
+/*     - Set rw pointer to the end of what was written                      */
+/* Blocks reserved by sfs_fallocate are written in place, as reads they    */
+/* count as zeros. Reserved blocks a write skips over are zeroed, so only  */
+/* the trailing run that was never reached stays unwritten.                */
+/* sfs_fwrite first offers the write to the append buffer (sfs_append.c),   */
+/* small appends only reach this when it commits them.                      */
+/* ======================================================================== */
+static int do_fwrite(int fileID, const char* buf, int length) {
+    if (fileID < 0 || fileID >= MAX_FD_AMOUNT || !sfs->open_fd_table[fileID].inode) { //Check that file is open
         printf("SFS_API: CANNOT WRITE TO FILE; FILE NOT OPEN.\n");
         return -1;
     }
+    if (sfs->read_only) {
+        printf("SFS_API: CANNOT WRITE TO FILE; SNAPSHOT IS READ-ONLY.\n");
+        return -1;
+    }
 
-    i_node *file_i_node = open_fd_table[fileID].inode;  
-    if (file_i_node->size >= (12*BLOCK_SIZE)+((BLOCK_SIZE/sizeof(int)*BLOCK_SIZE))) {   //Check that maximum file size isn't exceeded
+    i_node *file_i_node = sfs->open_fd_table[fileID].inode;
+    int start = sfs->open_fd_table[fileID].rwpointer;
+    if (start + length > MAX_FILE_SIZE) {   //Check that maximum file size isn't exceeded
         printf("SFS_API: CANNOT WRITE TO FILE; MAXIMUM FILE SIZE EXCEEDED.\n");
         return -1;
     }
+    if (length <= 0) {
+        return 0;
+    }
+
+    int i_node_index = file_i_node - sfs->i_node_table;
+    int end = start + length;
+    if (file_i_node->link_cnt == 0 && end <= SFS_INLINE_MAX) {     //Small file: the data stays in the i-Node
+        memcpy(file_i_node->inline_data + start, buf, length);
+        if (end > file_i_node->size) {
+            file_i_node->size = end;
+        }
+        sfs->open_fd_table[fileID].rwpointer = end;
+        write_inode(i_node_index);
+        return length;
+    }
+    if (file_i_node->link_cnt == 0 && file_i_node->size > 0) {     //Outgrows the i-Node: move everything to blocks
+        return promote_inline(fileID, buf, length);
+    }
 
-    int blocks_occupied = size_to_blocks(file_i_node->size);    //How many blocks are currently occupied
-    int blocks_required = size_to_blocks(open_fd_table[fileID].rwpointer+length) - blocks_occupied;     //How many blocks are required to be allocated for the write
+    int slots[MAX_FILE_BLOCKS], old_slots[MAX_FILE_BLOCKS], read_slots[MAX_FILE_BLOCKS];
+    int old_slot_count = load_slots(file_i_node, slots);
+    if (old_slot_count < 0) {
+        printf("SFS_API: CANNOT WRITE TO FILE; READ ERROR.\n");
+        return -1;
+    }
+    int old_blocks = size_to_blocks(file_i_node->size);    //Logical blocks, a compressed tail uses fewer slots
+    int unwritten_from = old_slot_count - file_i_node->unwritten;
+    memcpy(old_slots, slots, sizeof(slots));
+    memcpy(read_slots, slots, sizeof(slots));
+    mask_unwritten(file_i_node, read_slots);
+    unsigned char old_bitmap[BLOCK_AMOUNT/8];
+    memcpy(old_bitmap, sfs->bitmap, sizeof(old_bitmap));
+
+    int new_size = start + length > file_i_node->size ? start + length : file_i_node->size;
+    int new_blocks = size_to_blocks(new_size);
+    int compress = (sfs->features & SFS_FEATURE_COMPRESSION) != 0;
+    int first_block = start / BLOCK_SIZE;
+    int last_block = (start + length - 1) / BLOCK_SIZE;
+    int old_indirect = file_i_node->indirect_pointers;
+    int slot_count = new_blocks > old_slot_count ? new_blocks : old_slot_count;
+    int last_slot = (last_block / CHUNK_BLOCKS + 1) * CHUNK_BLOCKS - 1;    //A chunk stored whole can change all its slots
+    if (slot_count > 12 && last_slot >= 12 && own_indirect(file_i_node, old_indirect) < 0) {    //Before any slot changes
+        printf("SFS_API: CANNOT WRITE TO FILE; NO MORE FREE BLOCKS AVAILABLE.\n");
+        return -1;
+    }
 
-    if (blocks_required > 0) {      //If file requires a block or more to be allocated
+    char *chunk = disk_alloc(CHUNK_BLOCKS * BLOCK_SIZE);
+    int result = length;
+    int written_to = unwritten_from;    //Reserved slots before this one hold data now
 
-        int free_block;     
-        int *indirect_block = (int *) malloc(BLOCK_SIZE);   
-        if (blocks_occupied + blocks_required > 12) {   //If file has/needs an indirect pointer block
-            if (blocks_occupied <= 12) {  //If the file needs an indirect pointer block allocated for the first time
-                free_block = get_free_block();
-                remove_bit(free_block);
-                file_i_node->indirect_pointers = free_block;    //Set indirect pointer to point to block allocated
+    if (first_block > unwritten_from && last_block >= unwritten_from) {   //Reserved blocks skipped over become zeros
+        memset(chunk, 0, BLOCK_SIZE);
+        for (int b = unwritten_from; b < first_block && result >= 0; b++) {
+            if (dedup_write(&slots[b], chunk) < 0) {
+                printf("SFS_API: CANNOT WRITE TO FILE; NO MORE FREE BLOCKS AVAILABLE.\n");
+                result = -1;
             }
-            read_blocks(file_i_node->indirect_pointers, 1, indirect_block);     //Bring indirect pointer block into memory
-        }
-
-        for (int i = blocks_occupied; i-blocks_occupied < blocks_required; i++) {   //Allocate blocks needed to file
-            free_block = get_free_block();
-            if (free_block >= 0) {
-                remove_bit(free_block);
-                if (i < 12) {
-                    file_i_node->pointers[i] = free_block;
-                } 
-                else {
-                    indirect_block[i-12] = free_block;
-                }
-            } 
             else {
-                printf("SFS_API: CANNOT WRITE TO FILE; NO MORE FREE BLOCKS AVAILABLE.\n");
-                return -1;
+                written_to = b + 1;
             }
         }
+    }
 
-        if (blocks_occupied + blocks_required > 12) {
-            write_blocks(file_i_node->indirect_pointers, 1, indirect_block);  //Write indirect pointer block to disk (if needed)
-        }
-        free(indirect_block);
-    
-        file_i_node->link_cnt += blocks_required;
-        write_blocks(BLOCK_AMOUNT-(size_to_blocks(sizeof(bitmap))), size_to_blocks(sizeof(bitmap)), &bitmap);
-    } 
+    for (int c = first_block / CHUNK_BLOCKS; c <= last_block / CHUNK_BLOCKS && result >= 0; c++) {
+        int lo = c * CHUNK_BLOCKS;
+        int new_n = new_blocks - lo < CHUNK_BLOCKS ? new_blocks - lo : CHUNK_BLOCKS;
+        int old_n = old_blocks - lo < 0 ? 0 : (old_blocks - lo < CHUNK_BLOCKS ? old_blocks - lo : CHUNK_BLOCKS);
+        int first = (first_block > lo ? first_block : lo) - lo;
+        int last = (last_block < lo + new_n - 1 ? last_block : lo + new_n - 1) - lo;
+        int chunk_start = lo * BLOCK_SIZE;      //File offset of the chunk
+
+        if (!compress && !chunk_is_compressed(&slots[lo], old_n)) {    //Raw chunk: only touched blocks
+            for (int b = first; b <= last && result >= 0; b++) {
+                int block_start = chunk_start + b*BLOCK_SIZE;
+                int from = start > block_start ? start : block_start;
+                int to = start + length < block_start + BLOCK_SIZE ? start + length : block_start + BLOCK_SIZE;
+                char *block = chunk + b*BLOCK_SIZE;
+
+                if (to - from < BLOCK_SIZE) {       //Partial block: keep the bytes around the write
+                    if (b < old_n && read_slots[lo + b] >= 0) {
+                        if (chunk_read(i_node_index, c, &read_slots[lo], old_n, chunk, b, b) < 0) {
+                            printf("SFS_API: CANNOT WRITE TO FILE; READ ERROR.\n");
+                            result = -1;
+                            break;
+                        }
+                    }
+                    else {
+                        memset(block, 0, BLOCK_SIZE);
+                    }
+                }
+                memcpy(block + (from - block_start), buf + (from - start), to - from);
 
-    int *indirect_block  = (int *) malloc(BLOCK_SIZE);
-    if (blocks_occupied + blocks_required > 12) {
-        read_blocks(file_i_node->indirect_pointers, 1, indirect_block);   //Bring indirect pointer block into memory (if needed)
-    }
-    
-    void *file_blocks = malloc(BLOCK_SIZE * file_i_node->link_cnt);     
-    
-    for (int i = 0; i < file_i_node->link_cnt; i++) {   //Bring all blocks with file data into memory
-        if (i < 12) {
-            read_blocks(file_i_node->pointers[i], 1, (char *)file_blocks + (i*BLOCK_SIZE));
+                if (dedup_write(&slots[lo + b], block) < 0) {   //Allocates, copies shared blocks, deduplicates
+                    printf("SFS_API: CANNOT WRITE TO FILE; NO MORE FREE BLOCKS AVAILABLE.\n");
+                    result = -1;
+                }
+                else if (lo + b >= written_to) {
+                    written_to = lo + b + 1;
+                }
+            }
         }
-        else {
-            read_blocks(indirect_block[i-12], 1, (char *)file_blocks + (i*BLOCK_SIZE));
+        else {          //Whole chunk through memory
+            memset(chunk, 0, CHUNK_BLOCKS * BLOCK_SIZE);
+            if (old_n > 0 && chunk_read(i_node_index, c, &read_slots[lo], old_n, chunk, 0, old_n - 1) < 0) {
+                printf("SFS_API: CANNOT WRITE TO FILE; READ ERROR.\n");
+                result = -1;
+                break;
+            }
+            int from = start > chunk_start ? start : chunk_start;
+            int to = start + length < chunk_start + new_n*BLOCK_SIZE ? start + length : chunk_start + new_n*BLOCK_SIZE;
+            memcpy(chunk + (from - chunk_start), buf + (from - start), to - from);
+            if (chunk_store(i_node_index, c, &slots[lo], new_n, chunk, compress) < 0) {
+                printf("SFS_API: CANNOT WRITE TO FILE; NO MORE FREE BLOCKS AVAILABLE.\n");
+                result = -1;
+            }
+            else if (lo + new_n > written_to) {     //The whole chunk was stored
+                written_to = lo + new_n;
+            }
         }
     }
+    free(chunk);
 
-    memcpy((char *)file_blocks + open_fd_table[fileID].rwpointer, buf, length);   //Write to the file in memory from the buffer
-
-    for (int i = 0; i < file_i_node->link_cnt; i++) {       //Write the file in memory to the disk
-        if (i < 12) {
-            write_blocks(file_i_node->pointers[i], 1, (char *)file_blocks + (i*BLOCK_SIZE));
+    //Whatever got allocated stays attached to the file, so a failed write leaks nothing
+    int used_blocks = old_slot_count;
+    for (int i = old_slot_count; i < new_blocks; i++) {
+        if (slots[i] != -1) {
+            used_blocks = i + 1;
         }
-        else {
-            write_blocks(indirect_block[i-12], 1, (char *)file_blocks + (i*BLOCK_SIZE));
+    }
+    if (store_slots(file_i_node, slots, old_slots, used_blocks, old_indirect) < 0) {   //Can't run out: the indirect block was taken above
+        printf("SFS_API: CANNOT WRITE TO FILE; NO MORE FREE BLOCKS AVAILABLE.\n");
+        result = -1;
+    }
+    else {
+        file_i_node->link_cnt = used_blocks;
+        file_i_node->unwritten = used_blocks > written_to ? used_blocks - written_to : 0;
+        if (result >= 0) {
+            sfs->open_fd_table[fileID].rwpointer += length;      //Advance the pointer to the end of what was written
+            file_i_node->size = new_size;
         }
     }
 
-    free(file_blocks);
-
-    open_fd_table[fileID].rwpointer += length;      //Advance the pointer to the end of what was written
-    int extra_bytes_written = open_fd_table[fileID].rwpointer - file_i_node->size;  //Calculate how much new data written to file
-    if (extra_bytes_written > 0) {      //If size has increased
-        file_i_node->size += extra_bytes_written;   //Write by how much the data increased
-    }   
-
-    int i_node_blocks = size_to_blocks(sizeof(i_node_table));   
-    write_blocks(1,i_node_blocks,&i_node_table);    //Write updated i-Node table to disk
-    write_directory();  //Write directory to disk
-    return length;
+    if (memcmp(old_bitmap, sfs->bitmap, sizeof(sfs->bitmap)) != 0) {  //Writes into reserved space allocate nothing
+        write_bitmap();
+    }
+    write_inode(i_node_index);  //Write updated i-Node to disk
+    return result;
 }
 
-/* ======================================================================== */                                                                                                                                      
-/* fread:                                                                   */                                                
-/* Reads from a file, given that it is currently open.                      */                                                         
+/* ======================================================================== */
+/* fread:                                                                   */
+/* Reads from a file, given that it is currently open.                      */
 /* Procedures of reading from a file:                                       */
-/*     - Determine how many bytes will actually be read taking position of  */ 
-/*         of the pointer, size of file, and the length of bytes to read    */ 
-/*         into account                                                     */ 
-/*     - Bring all blocks associated with file into memory                  */                                                            
-/*     - Read from these blocks in memory to the buffer given               */ 
-/*     - Set rw pointer to the point at which stopped reading               */                                                                                                                                                                                                                                                                                                                    
+/*     - Determine how many bytes will actually be read taking position of  */
+/*         of the pointer, size of file, and the length of bytes to read    */
+/*         into account                                                     */
+/*     - Inline files are copied straight from their i-Node                 */
+/*     - Bring the blocks covering that range into memory, chunk by chunk   */
+/*       (compressed chunks come from the chunk cache when they're hot)     */
+/*     - Read from these blocks in memory to the buffer given               */
+/*     - Set rw pointer to the point at which stopped reading               */
 /* ======================================================================== */
-int sfs_fread(int fileID, char* buf, int length) {
-    if (!open_fd_table[fileID].inode) {     //Check that file is open
+static int do_fread(int fileID, char* buf, int length) {
+    if (fileID < 0 || fileID >= MAX_FD_AMOUNT || !sfs->open_fd_table[fileID].inode) {     //Check that file is open
         printf("SFS_API: CANNOT READ FROM FILE; FILE NOT OPEN.\n");
         return -1;
     }
-    i_node *file_i_node = open_fd_table[fileID].inode;  
-    int bytes_available_to_read = file_i_node->size - open_fd_table[fileID].rwpointer;  //Calculate how many bytes will actually be read taking file size into account
+    i_node *file_i_node = sfs->open_fd_table[fileID].inode;
+    int start = sfs->open_fd_table[fileID].rwpointer;
+    int bytes_available_to_read = file_i_node->size - start;  //Calculate how many bytes will actually be read taking file size into account
 
     if (bytes_available_to_read < length) {
         length = bytes_available_to_read;       //If reading past file size, reduce amount of bytes to read
     }
+    if (length <= 0) {
+        return 0;
+    }
 
-    int *indirect_block  = (int *) malloc(BLOCK_SIZE);
-    if (file_i_node->indirect_pointers > 0) {
-        read_blocks(file_i_node->indirect_pointers, 1, indirect_block);     //Bring indirect pointer block into memory where an indirect pointer block is available
+    if (file_i_node->link_cnt == 0) {   //Inline file, no blocks to read
+        memcpy(buf, file_i_node->inline_data + start, length);
+        sfs->open_fd_table[fileID].rwpointer += length;
+        return length;
     }
 
-    void *file_blocks = malloc(BLOCK_SIZE * file_i_node->link_cnt);
-    for (int i = 0; i < file_i_node->link_cnt; i++) {       //Bring blocks of file into memory
-        if (i < 12) { 
-            read_blocks(file_i_node->pointers[i], 1, (char *)file_blocks + (i*BLOCK_SIZE));     
+    int i_node_index = file_i_node - sfs->i_node_table;
+    int slots[MAX_FILE_BLOCKS];
+    if (load_slots(file_i_node, slots) < 0) {
+        printf("SFS_API: CANNOT READ FROM FILE; READ ERROR.\n");
+        return -1;
+    }
+    mask_unwritten(file_i_node, slots);
+    int blocks = size_to_blocks(file_i_node->size);
+    int first_block = start / BLOCK_SIZE;
+    int last_block = (start + length - 1) / BLOCK_SIZE;
+    char *chunk = disk_alloc(CHUNK_BLOCKS * BLOCK_SIZE);
+    int result = length;
+
+    for (int c = first_block / CHUNK_BLOCKS; c <= last_block / CHUNK_BLOCKS; c++) {
+        int lo = c * CHUNK_BLOCKS;
+        int n = blocks - lo < CHUNK_BLOCKS ? blocks - lo : CHUNK_BLOCKS;
+        int first = (first_block > lo ? first_block : lo) - lo;
+        int last = (last_block < lo + n - 1 ? last_block : lo + n - 1) - lo;
+        int chunk_start = lo * BLOCK_SIZE;
+
+        if (chunk_read(i_node_index, c, &slots[lo], n, chunk, first, last) < 0) {
+            result = -1;
+            break;
         }
-        else {
-            read_blocks(indirect_block[i-12], 1, (char *)file_blocks + (i*BLOCK_SIZE));     
+        int from = start > chunk_start ? start : chunk_start;
+        int to = start + length < chunk_start + n*BLOCK_SIZE ? start + length : chunk_start + n*BLOCK_SIZE;
+        memcpy(buf + (from - start), chunk + (from - chunk_start), to - from);     //Read data from memory blocks into buffer
+    }
+    free(chunk);
+
+    if (result >= 0) {
+        sfs->open_fd_table[fileID].rwpointer += length;      //Advance rw pointer to the end of data read
+    }
+    return result;
+}
+
+/* ======================================================================== */
+/* writev / readv:                                                          */
+/* Vectored versions of fwrite and fread. The buffers are gathered into     */
+/* (or scattered from) one contiguous range and handled by a single         */
+/* do_fwrite / do_fread, so the slots are loaded once, blocks are           */
+/* allocated in one pass and the pointers, bitmap and i-Node are written    */
+/* once for the whole batch instead of once per buffer.                     */
+/* ======================================================================== */
+static int iov_total(const struct iovec *iov, int iovcnt) {
+    long total = 0;
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+        if (total > MAX_FILE_SIZE) {
+            return -1;
         }
     }
-    memcpy(buf, (char *)file_blocks + open_fd_table[fileID].rwpointer, length);     //Read data from memory blocks into buffer
-    open_fd_table[fileID].rwpointer += length;      //Advance rw pointer to the end of data read
+    return (int) total;
+}
 
-    free(indirect_block);
-    free(file_blocks);
-    return length;
+static int do_writev(int fileID, const struct iovec *iov, int iovcnt) {
+    int length = iov_total(iov, iovcnt);
+    if (length < 0) {
+        printf("SFS_API: CANNOT WRITE TO FILE; MAXIMUM FILE SIZE EXCEEDED.\n");
+        return -1;
+    }
+    if (iovcnt == 1) {
+        return do_fwrite(fileID, iov[0].iov_base, length);
+    }
+
+    char *gathered = malloc(length > 0 ? length : 1);
+    int offset = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(gathered + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    int result = do_fwrite(fileID, gathered, length);
+    free(gathered);
+    return result;
+}
+
+static int do_readv(int fileID, const struct iovec *iov, int iovcnt) {
+    int length = iov_total(iov, iovcnt);
+    if (length < 0) {
+        printf("SFS_API: CANNOT READ FROM FILE; MAXIMUM FILE SIZE EXCEEDED.\n");
+        return -1;
+    }
+    if (iovcnt == 1) {
+        return do_fread(fileID, iov[0].iov_base, length);
+    }
+
+    char *gathered = malloc(length > 0 ? length : 1);
+    int result = do_fread(fileID, gathered, length);
+    int offset = 0;
+    for (int i = 0; i < iovcnt && offset < result; i++) {   //Only what was read, short at the end of the file
+        int n = result - offset < (int) iov[i].iov_len ? result - offset : (int) iov[i].iov_len;
+        memcpy(iov[i].iov_base, gathered + offset, n);
+        offset += n;
+    }
+    free(gathered);
+    return result;
+}
+
+/* ======================================================================== */
+/* read_at / write_at:                                                      */
+/* fread and fwrite at a given offset that leave the rw pointer where it    */
+/* was, for callers that aren't reading or writing on behalf of the file's  */
+/* user (sfs_map, sfs_pread/sfs_pwrite). Like fseek, the offset can't be   */
+/* past the end of the file.                                                */
+/* ======================================================================== */
+static int check_offset(int fileID, int offset) {
+    if (fileID < 0 || fileID >= MAX_FD_AMOUNT || !sfs->open_fd_table[fileID].inode) {
+        printf("SFS_API: FILE NOT OPEN.\n");
+        return -1;
+    }
+    if (offset < 0 || offset > sfs->open_fd_table[fileID].inode->size) {
+        printf("Location out of bounds for file.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int read_at(int fileID, int offset, int length, char *buf) {
+    if (check_offset(fileID, offset) < 0) {
+        return -1;
+    }
+    int pointer = sfs->open_fd_table[fileID].rwpointer;
+    sfs->open_fd_table[fileID].rwpointer = offset;
+    int result = do_fread(fileID, buf, length);
+    sfs->open_fd_table[fileID].rwpointer = pointer;
+    return result;
+}
+
+int write_at(int fileID, int offset, int length, const char *buf) {
+    if (check_offset(fileID, offset) < 0) {
+        return -1;
+    }
+    int pointer = sfs->open_fd_table[fileID].rwpointer;
+    sfs->open_fd_table[fileID].rwpointer = offset;
+    int result = do_fwrite(fileID, buf, length);
+    sfs->open_fd_table[fileID].rwpointer = pointer;
+    return result;
+}
+
+/* ======================================================================== */
+/* fallocate:                                                               */
+/* Reserves the blocks the file needs to reach offset + length and grows    */
+/* the file to that size. The blocks are taken as one run of consecutive    */
+/* blocks when the disk has one, scattered otherwise. They are not written: */
+/* they read as zeros until fwrite fills them in place, without allocating  */
+/* or touching the bitmap. The rest of an inline file or of a compressed    */
+/* last chunk is first filled with zeros through fwrite, so the reserved    */
+/* blocks start on a raw chunk. Space the file already has is left alone.   */
+/* ======================================================================== */
+static int do_fallocate(int fileID, int offset, int length) {
+    if (fileID < 0 || fileID >= MAX_FD_AMOUNT || !sfs->open_fd_table[fileID].inode) {
+        printf("SFS_API: CANNOT ALLOCATE FILE SPACE; FILE NOT OPEN.\n");
+        return -1;
+    }
+    if (sfs->read_only) {
+        printf("SFS_API: CANNOT ALLOCATE FILE SPACE; SNAPSHOT IS READ-ONLY.\n");
+        return -1;
+    }
+    if (offset < 0 || length <= 0 || offset > MAX_FILE_SIZE - length) {
+        printf("SFS_API: CANNOT ALLOCATE FILE SPACE; MAXIMUM FILE SIZE EXCEEDED.\n");
+        return -1;
+    }
+
+    i_node *inode = sfs->open_fd_table[fileID].inode;
+    int i_node_index = inode - sfs->i_node_table;
+    int end = offset + length;
+    if (end <= inode->size) {
+        return 0;
+    }
+    if (inode->link_cnt == 0 && end <= SFS_INLINE_MAX) {   //Still fits in the i-Node, its spare bytes are zeros
+        inode->size = end;
+        write_inode(i_node_index);
+        return 0;
+    }
+
+    int slots[MAX_FILE_BLOCKS], old_slots[MAX_FILE_BLOCKS];
+    if (load_slots(inode, slots) < 0) {
+        printf("SFS_API: CANNOT ALLOCATE FILE SPACE; READ ERROR.\n");
+        return -1;
+    }
+    int blocks = size_to_blocks(inode->size);
+    int lo = blocks > 0 ? (blocks - 1) / CHUNK_BLOCKS * CHUNK_BLOCKS : 0;
+    if ((inode->link_cnt == 0 && inode->size > 0) || (blocks > 0 && chunk_is_compressed(&slots[lo], blocks - lo))) {
+        int fill_end = (lo + CHUNK_BLOCKS) * BLOCK_SIZE < end ? (lo + CHUNK_BLOCKS) * BLOCK_SIZE : end;
+        char *zeros = calloc(1, CHUNK_BYTES);
+        int filled = write_at(fileID, inode->size, fill_end - inode->size, zeros);
+        free(zeros);
+        if (filled < 0) {
+            return -1;
+        }
+        if (end <= inode->size) {
+            return 0;
+        }
+        if (load_slots(inode, slots) < 0) {
+            printf("SFS_API: CANNOT ALLOCATE FILE SPACE; READ ERROR.\n");
+            return -1;
+        }
+        blocks = size_to_blocks(inode->size);
+    }
+    memcpy(old_slots, slots, sizeof(slots));
+
+    int new_blocks = size_to_blocks(end);
+    int slot_count = inode->link_cnt > new_blocks ? inode->link_cnt : new_blocks;
+    int unwritten_from = inode->unwritten > 0 ? inode->link_cnt - inode->unwritten : blocks;
+    int old_indirect = inode->indirect_pointers;
+    if (new_blocks > 12 && own_indirect(inode, old_indirect) < 0) {    //Taken first so it doesn't split the run
+        printf("SFS_API: CANNOT ALLOCATE FILE SPACE; NO MORE FREE BLOCKS AVAILABLE.\n");
+        return -1;
+    }
+
+    int needed = 0;
+    for (int i = blocks; i < new_blocks; i++) {
+        needed += slots[i] < 0;     //Blocks left past the end by an interrupted write are kept
+    }
+    int run = get_free_run(needed);
+    int result = 0;
+    for (int i = blocks, taken = 0; i < new_blocks && result == 0; i++) {
+        if (slots[i] >= 0) {
+            continue;
+        }
+        slots[i] = run >= 0 ? run + taken : get_free_block();
+        if (slots[i] < 0) {
+            result = -1;
+            break;
+        }
+        remove_bit(slots[i]);
+        taken++;
+    }
+    if (result == 0 && store_slots(inode, slots, old_slots, slot_count, old_indirect) < 0) {
+        result = -1;
+    }
+    if (result < 0) {       //Give back everything taken, the file stays as it was
+        for (int i = blocks; i < new_blocks; i++) {
+            if (old_slots[i] < 0 && slots[i] >= 0) {
+                set_bit(slots[i]);
+            }
+        }
+        if (inode->indirect_pointers != old_indirect) {
+            set_bit(inode->indirect_pointers);
+            inode->indirect_pointers = old_indirect;
+        }
+        printf("SFS_API: CANNOT ALLOCATE FILE SPACE; NO MORE FREE BLOCKS AVAILABLE.\n");
+    }
+    else {
+        inode->link_cnt = slot_count;
+        inode->unwritten = slot_count - unwritten_from;
+        inode->size = end;
+    }
+
+    write_bitmap();
+    write_inode(i_node_index);
+    return result;
 }
 
 /* ======================================================================== */                                                                                                                                      
@@ -485,10 +1261,13 @@ int sfs_fread(int fileID, char* buf, int length) {
 /* Sets rw pointer of a file to the given location, only if file is open    */
 /* and the location is within the file                                      */                                                                                                                                                                                                                                                                       
 /* ======================================================================== */
-int sfs_fseek(int fileID, int loc) {
-    if (open_fd_table[fileID].inode) {  //Check that file exists
-        if (open_fd_table[fileID].inode->size >= loc && loc >= 0) {     //Check that pointer is within file size boundaries
-            open_fd_table[fileID].rwpointer = loc;  //Set pointer of file
+static int do_fseek(int fileID, int loc) {
+    if (append_flush(fileID) < 0) {
+        return -1;
+    }
+    if (sfs->open_fd_table[fileID].inode) {  //Check that file exists
+        if (sfs->open_fd_table[fileID].inode->size >= loc && loc >= 0) {     //Check that pointer is within file size boundaries
+            sfs->open_fd_table[fileID].rwpointer = loc;  //Set pointer of file
             return 0;
         }
         else {
@@ -500,62 +1279,388 @@ int sfs_fseek(int fileID, int loc) {
     return -1;
 }
 
+/* ======================================================================== */
+/* fflush:                                                                  */
+/* Commits the appends buffered for an open file, then waits for a disk     */
+/* barrier, so the file and the metadata written with it are durable.       */
+/* ======================================================================== */
+static int do_fflush(int fileID) {
+    if (fileID < 0 || fileID >= MAX_FD_AMOUNT || !sfs->open_fd_table[fileID].inode) {
+        printf("SFS_API: CANNOT FLUSH FILE; FILE NOT OPEN.\n");
+        return -1;
+    }
+    if (append_flush(fileID) < 0) {
+        return -1;
+    }
+    log_checkpoint();       //In log mode the metadata held back is written first
+    discard_flush();        //The tables end_call would write, before the barrier
+    refcount_flush();
+    checksum_flush();
+    return disk_barrier();
+}
+
 /* ======================================================================== */                                                                                                                                      
 /* remove:                                                                  */                                                
 /* Removes file from directory, provided it exists                          */    
 /* Properties assoiciate with file's i-Node entry and directory entry are   */                            
 /* set to default (removing them).                                          */                                                                                                                                                                                                                                                         
 /* ======================================================================== */
-int sfs_remove(char* file) {
+static int do_remove(char* file) {
     int i_node_index = scan_dir_name(file);     //Get index of i-Node associated with file
     if (i_node_index == -1) {   //Check that file exists
         printf("SFS_API: COULD NOT REMOVE FILE; FILE DOES NOT EXIST");
         return -1;
     }
-    i_node *file_i_node = &i_node_table[i_node_index];
+    if (sfs->read_only) {
+        printf("SFS_API: COULD NOT REMOVE FILE; SNAPSHOT IS READ-ONLY.\n");
+        return -1;
+    }
+    i_node *file_i_node = &sfs->i_node_table[i_node_index];
 
     for (int i = 0; i < MAX_FD_AMOUNT; i++) {       //Make sure that file is not open
-        if (file_i_node == open_fd_table[i].inode) {        
+        if (file_i_node == sfs->open_fd_table[i].inode) {        
             printf("SFS_API: COULD NOT REMOVE FILE; FILE IS OPEN");
             return -1;        //If it is, return error
         }
     }
 
-    int *indirect_block = (int *) malloc(BLOCK_SIZE);
-    if (file_i_node->link_cnt > 12) {
-        read_blocks(file_i_node->indirect_pointers, 1, indirect_block);     //Bring indirect pointer block into memory if applicable
+    int slots[MAX_FILE_BLOCKS];
+    int blocks = load_slots(file_i_node, slots);     //Bring pointers into memory, indirect ones included
+    if (blocks < 0) {
+        printf("SFS_API: COULD NOT REMOVE FILE; READ ERROR.\n");
+        return -1;
     }
-
-    for (int i = 0; i < file_i_node->link_cnt; i++) {   //Set free bits in bitmap
-        if (i < 12) {
-            set_bit(file_i_node->pointers[i]);
-        }
-        else {
-            set_bit(indirect_block[i-12]);
+    for (int i = 0; i < blocks; i++) {   //Set free bits in bitmap, shared blocks only lose a reference
+        if (slots[i] >= 0) {
+            block_release(slots[i]);
         }
     }
-
-    write_blocks(BLOCK_AMOUNT-(size_to_blocks(sizeof(bitmap))), size_to_blocks(sizeof(bitmap)), &bitmap);   //Write updated bitmap to memory
-
-    i_node_table[i_node_index].mode = 0;        //Set i-Node back to default values
-    i_node_table[i_node_index].link_cnt = 0;
-    i_node_table[i_node_index].size = -1;
-    for (int i = 0; i < 12; i++) {
-        i_node_table[i_node_index].pointers[i] = -1;
+    if (file_i_node->indirect_pointers >= 0) {
+        block_release(file_i_node->indirect_pointers);
     }
-    i_node_table[i_node_index].indirect_pointers = -1;
+    chunk_cache_invalidate(i_node_index);
+
+    write_bitmap();   //Write updated bitmap to memory
 
-    int i_node_blocks = size_to_blocks(sizeof(i_node_table));   
+    free_i_node(i_node_index);      //Set i-Node back to default values
 
-    write_blocks(1,i_node_blocks,&i_node_table);    //Write updated i-Node table to disk
+    write_inode(i_node_index);  //Write updated i-Node to disk
 
     for (int i = 0; i < DIR_AMOUNT; i++) {
-        if (strcmp(root_directory[i].file_name, file) == 0) {   //Set file directory entry values back to default
-            strcpy(root_directory[i].file_name, "\0");
-            root_directory[i].i_node_num = -1;
+        if (strcmp(sfs->root_directory[i].file_name, file) == 0) {   //Set file directory entry values back to default
+            strcpy(sfs->root_directory[i].file_name, "\0");
+            sfs->root_directory[i].i_node_num = -1;
+            dir_index_set(i, 0);
         }
     }    
     write_directory();  //Update directory on disk
 
     return 0;
-}
\ No newline at end of file
+}
+
+/* ======================================================================== */
+/* clone:                                                                   */
+/* Creates dst as a copy of src that shares every block with it: the blocks */
+/* get one more reference and the i-Node is copied, so no data is read or   */
+/* written whatever the size. The two files part block by block as they    */
+/* are written, copy on write gives the writer blocks of its own (see       */
+/* dedup_write, chunk_store and store_slots). Appends buffered for src are  */
+/* committed first, so the clone has what the file reads as.                */
+/* ======================================================================== */
+static int do_clone(const char* src, const char* dst) {
+    int source = scan_dir_name((char *) src);
+    if (source < 0) {
+        printf("SFS_API: CANNOT CLONE FILE; FILE DOES NOT EXIST.\n");
+        return -1;
+    }
+    if (sfs->read_only) {
+        printf("SFS_API: CANNOT CLONE FILE; SNAPSHOT IS READ-ONLY.\n");
+        return -1;
+    }
+    if (strlen(dst) > MAXFILENAME) {
+        printf("SFS_API: FILE NAME TOO LONG.\n");
+        return -1;
+    }
+    if (scan_dir_name((char *) dst) >= 0) {
+        printf("SFS_API: CANNOT CLONE FILE; %s ALREADY EXISTS.\n", dst);
+        return -1;
+    }
+    for (int i = 0; i < MAX_FD_AMOUNT; i++) {
+        if (sfs->open_fd_table[i].inode == &sfs->i_node_table[source] && append_flush(i) < 0) {
+            return -1;
+        }
+    }
+
+    i_node *inode = &sfs->i_node_table[source];
+    int slots[MAX_FILE_BLOCKS];
+    int count = load_slots(inode, slots);
+    if (count < 0) {
+        printf("SFS_API: CANNOT CLONE FILE; READ ERROR.\n");
+        return -1;
+    }
+    int target = alloc_i_node();
+    if (target < 0) {
+        printf("SFS_API: NO FREE I-NODES LEFT.\n");
+        return -1;
+    }
+    int entry = dir_free_slot();
+    if (entry < 0) {
+        free_i_node(target);
+        printf("SFS_API: MAX FILE DIRECTORY SPACE REACHED");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {       //The clone becomes an owner of every block, the indirect one too
+        if (slots[i] >= 0) {
+            block_share(slots[i]);
+        }
+    }
+    if (inode->indirect_pointers >= 0) {
+        block_share(inode->indirect_pointers);
+    }
+    sfs->i_node_table[target] = *inode;
+
+    memcpy(sfs->root_directory[entry].file_name, dst, strlen(dst) + 1);
+    sfs->root_directory[entry].i_node_num = target;
+    dir_index_set(entry, 1);
+
+    write_inode(target);
+    write_directory();
+    return 0;
+}
+
+static int set_feature(int flag, int enabled) {     //Feature choices are kept in the superblock
+    if (sfs->read_only) {
+        printf("SFS_API: CANNOT CHANGE FEATURE; SNAPSHOT IS READ-ONLY.\n");
+        return -1;
+    }
+    if (enabled) {
+        sfs->features |= flag;
+    }
+    else {
+        sfs->features &= ~flag;
+    }
+    write_superblock();
+    checksum_flush();
+    return 0;
+}
+
+/* ======================================================================== */
+/* set_compression:                                                         */
+/* Turns compression of newly written data on or off for the mounted disk.  */
+/* Data already on disk stays as it is, both layouts are always readable.   */
+/* ======================================================================== */
+int sfs_set_compression(int enabled) {
+    return set_feature(SFS_FEATURE_COMPRESSION, enabled);
+}
+
+/* ======================================================================== */
+/* set_dedup:                                                               */
+/* Turns deduplication of newly written blocks on or off. Blocks already    */
+/* shared stay shared either way, they are copied when written to.          */
+/* ======================================================================== */
+int sfs_set_dedup(int enabled) {
+    return set_feature(SFS_FEATURE_DEDUP, enabled);
+}
+
+/* ======================================================================== */
+/* set_log:                                                                 */
+/* Turns log-structured writing on or off (see sfs_log.c). Either way the   */
+/* switch happens at a checkpoint, so the disk is consistent on both sides. */
+/* ======================================================================== */
+int sfs_set_log(int enabled) {
+    if (!enabled && !sfs->read_only) {
+        log_checkpoint();       //Everything the log holds back, before writes go in place again
+    }
+    if (set_feature(SFS_FEATURE_LOG, enabled) < 0) {
+        return -1;
+    }
+    if (enabled) {
+        log_reset();
+        log_checkpoint();       //The superblock is held back from here on
+    }
+    return 0;
+}
+
+/* ======================================================================== */
+/* Public entry points:                                                     */
+/* Each sfs_* call is timed and has its block requests charged to it by     */
+/* sfs_stats.c, the work itself is done by the do_* function above.         */
+/* end_call is where deferred metadata (refcounts, checksums) reaches disk  */
+/* and freed blocks are discarded. In log mode it only does at checkpoints. */
+/* ======================================================================== */
+static int end_call(int op, int result) {
+    if (log_active()) {
+        log_end_call();
+    }
+    else {
+        refcount_flush();
+        checksum_flush();
+    }
+    discard_flush();
+    return stats_end(op, result);
+}
+
+int mksfs(int fresh) {
+    stats_begin(SFS_OP_MKSFS);
+    trace_args(fresh, -1, -1, 0, NULL);
+    return end_call(SFS_OP_MKSFS, do_mksfs(fresh));
+}
+
+int sfs_getnextfilename(char* fname) {
+    stats_begin(SFS_OP_GETNEXTFILENAME);
+    return end_call(SFS_OP_GETNEXTFILENAME, do_getnextfilename(fname));
+}
+
+int sfs_readdir(int *cursor, char* fname) {
+    stats_begin(SFS_OP_READDIR);
+    trace_args(-1, cursor ? *cursor : -1, -1, 0, NULL);
+    return end_call(SFS_OP_READDIR, do_readdir(cursor, fname));
+}
+
+int sfs_getfilesize(const char* path) {
+    stats_begin(SFS_OP_GETFILESIZE);
+    trace_args(-1, -1, -1, 0, path);
+    return end_call(SFS_OP_GETFILESIZE, do_getfilesize(path));
+}
+
+int sfs_fopen(char* name) {
+    stats_begin(SFS_OP_FOPEN);
+    trace_args(-1, -1, -1, 0, name);
+    return end_call(SFS_OP_FOPEN, do_fopen(name));
+}
+
+int sfs_fclose(int fileID) {
+    stats_begin(SFS_OP_FCLOSE);
+    trace_args(fileID, -1, -1, 0, NULL);
+    return end_call(SFS_OP_FCLOSE, do_fclose(fileID));
+}
+
+int sfs_fwrite(int fileID, const char* buf, int length) {
+    stats_begin(SFS_OP_FWRITE);
+    trace_args(fileID, -1, length, 0, NULL);
+    int result = append_write(fileID, buf, length);    //Small appends stop in the fd's buffer
+    if (result == APPEND_DIRECT) {
+        result = do_fwrite(fileID, buf, length);
+    }
+    return end_call(SFS_OP_FWRITE, result);
+}
+
+//Calls reading or writing the file at a position commit its buffered appends first
+
+int sfs_fread(int fileID, char* buf, int length) {
+    stats_begin(SFS_OP_FREAD);
+    trace_args(fileID, -1, length, 0, NULL);
+    return end_call(SFS_OP_FREAD, append_flush(fileID) < 0 ? -1 : do_fread(fileID, buf, length));
+}
+
+int sfs_writev(int fileID, const struct iovec* iov, int iovcnt) {
+    stats_begin(SFS_OP_WRITEV);
+    trace_args(fileID, iovcnt, iov_total(iov, iovcnt), 0, NULL);
+    return end_call(SFS_OP_WRITEV, append_flush(fileID) < 0 ? -1 : do_writev(fileID, iov, iovcnt));
+}
+
+int sfs_readv(int fileID, const struct iovec* iov, int iovcnt) {
+    stats_begin(SFS_OP_READV);
+    trace_args(fileID, iovcnt, iov_total(iov, iovcnt), 0, NULL);
+    return end_call(SFS_OP_READV, append_flush(fileID) < 0 ? -1 : do_readv(fileID, iov, iovcnt));
+}
+
+void *sfs_map(int fileID, int offset, int length, int writable) {
+    stats_begin(SFS_OP_MAP);
+    trace_args(fileID, offset, length, writable ? SFS_TRACE_WRITABLE : 0, NULL);
+    void *view = append_flush(fileID) < 0 ? NULL : map_create(fileID, offset, length, writable);
+    end_call(SFS_OP_MAP, view ? trace_view(view) : -1);     //The trace pairs the view with its sfs_unmap
+    return view;
+}
+
+int sfs_unmap(void *view) {
+    stats_begin(SFS_OP_UNMAP);
+    trace_args(trace_view(view), -1, -1, 0, NULL);
+    return end_call(SFS_OP_UNMAP, map_release(view));
+}
+
+int sfs_pread(int fileID, int offset, char* buf, int length) {
+    stats_begin(SFS_OP_FREAD);
+    trace_args(fileID, offset, length, 0, NULL);
+    return end_call(SFS_OP_FREAD, append_flush(fileID) < 0 ? -1 : read_at(fileID, offset, length, buf));
+}
+
+int sfs_pwrite(int fileID, int offset, const char* buf, int length) {
+    stats_begin(SFS_OP_FWRITE);
+    trace_args(fileID, offset, length, 0, NULL);
+    return end_call(SFS_OP_FWRITE, append_flush(fileID) < 0 ? -1 : write_at(fileID, offset, length, buf));
+}
+
+int sfs_fallocate(int fileID, int offset, int length) {
+    stats_begin(SFS_OP_FALLOCATE);
+    trace_args(fileID, offset, length, 0, NULL);
+    return end_call(SFS_OP_FALLOCATE, append_flush(fileID) < 0 ? -1 : do_fallocate(fileID, offset, length));
+}
+
+int sfs_fseek(int fileID, int loc) {
+    stats_begin(SFS_OP_FSEEK);
+    trace_args(fileID, loc, -1, 0, NULL);
+    return end_call(SFS_OP_FSEEK, do_fseek(fileID, loc));
+}
+
+int sfs_fflush(int fileID) {
+    stats_begin(SFS_OP_FFLUSH);
+    trace_args(fileID, -1, -1, 0, NULL);
+    return end_call(SFS_OP_FFLUSH, do_fflush(fileID));
+}
+
+int sfs_remove(char* file) {
+    stats_begin(SFS_OP_REMOVE);
+    trace_args(-1, -1, -1, 0, file);
+    return end_call(SFS_OP_REMOVE, do_remove(file));
+}
+
+int sfs_clone(const char* src, const char* dst) {
+    char names[2 * MAXFILENAME + 2];        //Both names go to the trace, see sfs_replay
+    snprintf(names, sizeof(names), "%s/%s", src, dst);
+    stats_begin(SFS_OP_CLONE);
+    trace_args(-1, -1, -1, 0, names);
+    return end_call(SFS_OP_CLONE, do_clone(src, dst));
+}
+
+int sfs_snapshot_create() {
+    stats_begin(SFS_OP_SNAPSHOT_CREATE);
+    return end_call(SFS_OP_SNAPSHOT_CREATE, snapshot_create());
+}
+
+int sfs_snapshot_mount(int id) {
+    stats_begin(SFS_OP_SNAPSHOT_MOUNT);
+    trace_args(id, -1, -1, 0, NULL);
+    return end_call(SFS_OP_SNAPSHOT_MOUNT, snapshot_mount(id));
+}
+
+void sfs_frag_stats(sfs_frag_info *out) {
+    stats_begin(SFS_OP_FRAG_REPORT);
+    frag_stats(out);
+    end_call(SFS_OP_FRAG_REPORT, 0);
+}
+
+int sfs_frag_report(char *buf, int size) {
+    stats_begin(SFS_OP_FRAG_REPORT);
+    trace_args(-1, -1, size, 0, NULL);
+    return end_call(SFS_OP_FRAG_REPORT, frag_report(buf, size));
+}
+
+int sfs_defrag_step(int budget) {
+    stats_begin(SFS_OP_DEFRAG);
+    trace_args(-1, -1, budget, 0, NULL);
+    return end_call(SFS_OP_DEFRAG, defrag_step(budget));
+}
+
+int sfs_log_clean(int budget) {
+    stats_begin(SFS_OP_LOG_CLEAN);
+    trace_args(-1, -1, budget, 0, NULL);
+    return end_call(SFS_OP_LOG_CLEAN, log_clean(budget));
+}
+
+int sfs_snapshot_delete(int id) {
+    stats_begin(SFS_OP_SNAPSHOT_DELETE);
+    trace_args(id, -1, -1, 0, NULL);
+    return end_call(SFS_OP_SNAPSHOT_DELETE, snapshot_delete(id));
+}
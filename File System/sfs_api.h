@@ -1,6 +1,11 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/uio.h>
+
 //Defining some constants for the file system
 #define BLOCK_SIZE 1024
 #define BLOCK_AMOUNT 2000
@@ -9,24 +14,471 @@
 #define INODE_AMOUNT 129        //129 because since maximum directory files is 128, and first i-Node is for the directory
 #define MAXFILENAME 32
 
-void mksfs(int);
+//On-disk layout at the end of the disk: refcount table, checksum table, then the bitmap
+#define BITMAP_BLOCKS ((BLOCK_AMOUNT/8 + BLOCK_SIZE - 1)/BLOCK_SIZE)
+#define BITMAP_START (BLOCK_AMOUNT - BITMAP_BLOCKS)
+#define CHECKSUM_BLOCKS ((BLOCK_AMOUNT*4 + BLOCK_SIZE - 1)/BLOCK_SIZE)     //One CRC32C per block
+#define CHECKSUM_START (BITMAP_START - CHECKSUM_BLOCKS)
+#define CHECKSUM_OPEN 0         //Table entry of a block rewritten in place by a call that never finished, not verified
+#define BLOCK_CHECKSUM(crc) ((crc) == CHECKSUM_OPEN ? 1u : (crc))       //What the table stores, never CHECKSUM_OPEN
+#define REFCOUNT_BLOCKS ((BLOCK_AMOUNT*2 + BLOCK_SIZE - 1)/BLOCK_SIZE)     //One 16-bit count per block
+#define REFCOUNT_START (CHECKSUM_START - REFCOUNT_BLOCKS)
+
+#define MAX_FILE_BLOCKS (12 + BLOCK_SIZE/(int)sizeof(int))     //Direct pointers plus one indirect block
+#define MAX_FILE_SIZE (MAX_FILE_BLOCKS*BLOCK_SIZE)
+#define CHUNK_BLOCKS 4          //Logical blocks compressed together
+#define SFS_INLINE_MAX 64       //Files up to this size are stored in their i-Node
+#define SFS_MAX_SNAPSHOTS 8
+#define SFS_MAX_MAPS 32         //Views handed out by sfs_map at once
+#define CHUNK_BYTES (CHUNK_BLOCKS * BLOCK_SIZE)
+#define CHUNK_CACHE_ENTRIES 64
+#define INDEX_BUCKETS 1024      //Buckets of the dedup fingerprint index
+#define DIR_WORDS ((DIR_AMOUNT + 63)/64)     //64-bit words of the directory index
+#define SFS_INODE_CACHE 16      //Free i-Node numbers kept at hand for file creation
+#define SFS_APPEND_BUFFER CHUNK_BYTES  //Small appends are gathered per open file up to this size
+#define APPEND_DIRECT (-2)      //append_write: not buffered, fwrite writes it
+#define SFS_SEGMENT_BLOCKS 32   //Log mode appends to the disk a segment of this many blocks at a time
+#define SFS_SEGMENTS ((BLOCK_AMOUNT + SFS_SEGMENT_BLOCKS - 1)/SFS_SEGMENT_BLOCKS)
+#define SFS_LOG_CHECKPOINT 128  //Blocks appended to the log between checkpoints
+#define SFS_LOG_CLEAN_LOW 4     //Clean segments under which a checkpoint runs the cleaner first
+#define SFS_LOG_CLEAN_BUDGET 64 //Block reads and writes the cleaner spends then
+#define SFS_LOG_CLEAN_LIVE (SFS_SEGMENT_BLOCKS/2)   //Fuller segments are not worth cleaning
+#define SFS_LOG_RESERVE (MAX_FILE_BLOCKS + 1)       //Free blocks under which held-back ones are checkpointed: a whole file
+
+#define SFS_MAGIC "0xABCD000B"  //Images with names stored in the directory, snapshots, preallocation and a growable i-Node table
+
+//Superblock feature flags
+#define SFS_FEATURE_CHECKSUM 1
+#define SFS_FEATURE_COMPRESSION 2
+#define SFS_FEATURE_DEDUP 4
+#define SFS_FEATURE_LOG 8       //Blocks are never overwritten in place, see sfs_log.c
+
+//i-Node structure
+typedef struct {
+    int mode;               //File permissions          
+    int link_cnt;           //Count of pointer slots in use (compressed chunks use fewer than size needs)
+    int size;               //Size of file
+    int pointers[12];       //Pointers to data blocks      
+    int indirect_pointers;  //Indirect pointer to block containing pointers
+    char inline_data[SFS_INLINE_MAX];   //Contents of a file with no data blocks (link_cnt == 0)
+    int unwritten;          //Trailing slots reserved by sfs_fallocate and not written yet, they read as zeros
+} i_node;
+
+#define INODES_PER_BLOCK (BLOCK_SIZE/(int)sizeof(i_node))     //An i-Node never straddles two table blocks
+#define INODE_TABLE_BLOCKS ((INODE_AMOUNT + INODES_PER_BLOCK - 1)/INODES_PER_BLOCK)
+
+//Superblock structure
+typedef struct {
+    char magic[16];             //            
+    int block_size;             //Set to 1024 bytes            
+    int file_system_size;       //Amount of blocks   
+    int i_node_table_length;    //Blocks the i-Node table has grown to
+    int i_node_blocks[INODE_TABLE_BLOCKS];  //Where they are, INODES_PER_BLOCK i-Nodes each
+    int root_directory;         //Pointer to i-Node associated with root directory
+    int features;               //SFS_FEATURE_* flags the disk was created with
+    int snapshot_root;          //Block listing the snapshots, -1 if none was ever taken
+} super_block;
+
+//Directory entry structure
+typedef struct {
+    int i_node_num;     //Pointer to i-Node given to file               
+    char file_name[MAXFILENAME + 1];    //Name of the file, stored on disk with the entry
+} dir_entry;
+
+//Open File Descriptor entry structure
+typedef struct {
+    i_node* inode;      //Pointer to i-Node associated will opened file
+    int rwpointer;      //Location of where to start reading from/writing to
+    char *pending;      //Appends not committed yet, they go at the end of the file (sfs_append.c)
+    int pending_length;
+} file_descriptor;
+
+#define DIRECTORY_BLOCKS ((DIR_AMOUNT*(int)sizeof(dir_entry) + BLOCK_SIZE - 1)/BLOCK_SIZE)
+#define SNAPSHOT_INODE_BLOCKS ((INODE_AMOUNT*(int)sizeof(i_node) + BLOCK_SIZE - 1)/BLOCK_SIZE)     //A snapshot keeps the table packed
+#define SNAPSHOT_META_BLOCKS (SNAPSHOT_INODE_BLOCKS + DIRECTORY_BLOCKS)
+
+//Snapshot list entry, SFS_MAX_SNAPSHOTS of them fill the snapshot root block
+typedef struct {
+    int in_use;
+    int created;                //time() when the snapshot was taken
+    int blocks[SNAPSHOT_META_BLOCKS];   //Copy of the i-Node table, then copy of the directory
+} snapshot_record;
+
+#define SFS_STATS_PATH "/.sfs_stats"  //Virtual file exposing sfs_stats_format() in the FUSE mount
+
+//API functions and on-disk regions tracked by sfs_stats()
+enum { SFS_OP_MKSFS, SFS_OP_GETNEXTFILENAME, SFS_OP_GETFILESIZE, SFS_OP_FOPEN, SFS_OP_FCLOSE,
+       SFS_OP_FWRITE, SFS_OP_FREAD, SFS_OP_FSEEK, SFS_OP_REMOVE, SFS_OP_SNAPSHOT_CREATE,
+       SFS_OP_SNAPSHOT_MOUNT, SFS_OP_SNAPSHOT_DELETE, SFS_OP_WRITEV, SFS_OP_READV,
+       SFS_OP_MAP, SFS_OP_UNMAP, SFS_OP_FRAG_REPORT, SFS_OP_DEFRAG, SFS_OP_FALLOCATE,
+       SFS_OP_FFLUSH, SFS_OP_READDIR, SFS_OP_LOG_CLEAN, SFS_OP_CLONE, SFS_OP_COUNT };
+enum { SFS_REGION_SUPERBLOCK, SFS_REGION_INODE_TABLE, SFS_REGION_BITMAP, SFS_REGION_DIRECTORY,
+       SFS_REGION_INDIRECT, SFS_REGION_DATA, SFS_REGION_CHECKSUM, SFS_REGION_REFCOUNT, SFS_REGION_SNAPSHOT, SFS_REGION_COUNT };
+enum { SFS_CACHE_INODE_TABLE, SFS_CACHE_BITMAP, SFS_CACHE_DIRECTORY, SFS_CACHE_CHUNK, SFS_CACHE_COUNT };
+
+#define SFS_HIST_BUCKETS 24     //Bucket i counts calls taking [2^i, 2^(i+1)) microseconds
+
+typedef struct {
+    long calls;
+    long errors;                //Calls that returned a negative value
+    long reads, writes;         //Block requests issued on behalf of the call
+    long blocks_read, blocks_written;
+    double total_us;
+    long latency_hist[SFS_HIST_BUCKETS];
+} sfs_op_stats;
+
+typedef struct {
+    long reads, writes;
+    long blocks_read, blocks_written;
+} sfs_region_stats;
+
+typedef struct {
+    long hits;                  //Lookups answered from the in-memory copy
+    long misses;                //Loads of the structure from disk
+    long flushes;               //Write-throughs of the structure to disk
+    long evictions;             //Entries pushed out to make room
+} sfs_cache_stats;
+
+typedef struct {
+    long verified;              //Blocks checked against their checksum on read
+    long mismatches;            //Blocks whose checksum did not match
+    long blocks_flushed;        //Checksum blocks written
+} sfs_checksum_stats;
+
+typedef struct {
+    long hits;                  //Blocks written as a reference to an identical block
+    long misses;                //Blocks looked up and not found in the index
+    long cow_copies;            //Shared blocks copied before being written
+} sfs_dedup_stats;
+
+typedef struct {
+    long checkpoints;
+    long blocks_appended;       //Blocks allocated at the head of the log
+    long segments_opened;       //Segments the log moved on to
+    long blocks_cleaned;        //Live blocks the cleaner copied to the head of the log
+    long low_space_checkpoints; //Checkpoints brought forward to free the blocks held back
+} sfs_log_stats;
+
+#define SFS_FRAG_BUCKETS 12     //Bucket i counts free runs of [2^i, 2^(i+1)) blocks
+
+typedef struct {
+    int files;                  //Files with data blocks
+    int blocks;                 //Data blocks they use
+    int extents;                //Runs of consecutive blocks, over all files
+    int fragmented_files;       //Files in more than one extent
+    int free_blocks;
+    int free_extents;
+    int largest_free_extent;
+    int free_hist[SFS_FRAG_BUCKETS];
+} sfs_frag_info;
+
+typedef struct {
+    sfs_op_stats ops[SFS_OP_COUNT];
+    sfs_region_stats regions[SFS_REGION_COUNT];
+    sfs_cache_stats caches[SFS_CACHE_COUNT];
+    sfs_checksum_stats checksum;
+    sfs_dedup_stats dedup;
+    sfs_log_stats log;
+} sfs_statistics;
+
+//Trace file (sfs_trace.c): SFS_TRACE_MAGIC, version, record size, then one record per
+//outermost API call, each followed by name_length bytes of the file name it was given
+//(sfs_clone's source and destination, joined by a '/')
+#define SFS_TRACE_MAGIC "SFSTRACE"
+#define SFS_TRACE_VERSION 1
+#define SFS_TRACE_WRITABLE 1    //sfs_map asked for a writable view
+
+typedef struct {
+    uint64_t start_ns;      //Since the trace started
+    uint32_t latency_ns;    //Saturates at about 4 s
+    uint8_t op;             //SFS_OP_*
+    uint8_t flags;
+    uint16_t name_length;
+    int32_t fd;             //File descriptor, snapshot id, view id (sfs_unmap) or mksfs' fresh
+    int32_t offset;         //-1 at the rw pointer; iovec count for writev/readv, cursor for readdir
+    int32_t length;         //Bytes asked for, defrag budget or frag_report buffer size
+    int32_t result;         //View id for sfs_map
+} sfs_trace_record;
+
+//Chunk cache entry (sfs_compress.c)
+typedef struct {
+    int inode;              //-1 when the entry is free
+    int chunk;
+    int size;               //Bytes of plaintext held
+    unsigned long last_use;
+    char data[CHUNK_BYTES];
+} chunk_entry;
+
+//Fingerprint of a block's content (sfs_dedup.c)
+typedef struct {
+    uint64_t hash;
+    uint32_t crc;
+} fingerprint;
+
+//Mapping table entry (sfs_map.c)
+typedef struct {
+    int fileID;             //-1 when the entry is free
+    int offset;
+    int length;
+    int writable;
+    char *buffer;           //Block aligned, the view starts offset % BLOCK_SIZE into it
+    char *view;
+} mapping;
+
+//A file system instance: the image it lives on and everything kept in memory
+//while it is mounted. Each thread works on its current instance, see sfs_select.
+typedef struct sfs {
+    char image[256];                                //Disk image file name
+    struct disk_device *device;                     //NULL for the default device
+
+    //sfs_api.c
+    unsigned char bitmap[BLOCK_AMOUNT/8];           //Bitmap using a character array, covers max amount of blocks implemented
+    i_node i_node_table[INODE_AMOUNT];              //i-Node table cache - capped at 129 entries
+    int inode_blocks[INODE_TABLE_BLOCKS];           //Blocks of the on-disk i-Node table, it grows a block at a time
+    int inode_table_length;                         //Blocks it has now
+    unsigned char inode_bitmap[(INODE_AMOUNT + 7)/8];   //i-Nodes free and not in the cache below (1 = free)
+    int free_inodes[SFS_INODE_CACHE];               //Free i-Nodes taken without looking at the bitmap
+    int free_inode_count;
+    int inode_scan;                                 //Where the bitmap is looked at next
+    dir_entry root_directory[DIR_AMOUNT];           //Root directory cache - capped at 128 entries
+    uint64_t dir_live[DIR_WORDS];                   //Directory entries in use, one bit each
+    file_descriptor open_fd_table[MAX_FD_AMOUNT];   //Open File Descriptor Table - capped at 128 entries
+    int root_directory_position;                    //Used to capture the current position of the getnextfilename() method
+    int features;                                   //SFS_FEATURE_* flags of the mounted disk
+    int snapshot_root;                              //Block listing the snapshots, -1 if none
+    int read_only;                                  //Set while a snapshot is mounted
+    unsigned char discard_pending[BLOCK_AMOUNT/8];  //Blocks freed during the call, discarded when it ends
+    int discards_queued;
+
+    //sfs_stats.c
+    sfs_statistics stats;                           //Counters since mount or the last reset
+    int current_op;                                 //API call the running block requests belong to
+    int op_depth;                                   //Nesting depth of API calls
+    struct timespec op_start;
+
+    //sfs_trace.c
+    FILE *trace;                                    //NULL unless tracing
+    struct timespec trace_start;
+    sfs_trace_record trace_call;                    //Arguments of the running call
+    const char *trace_name;
+
+    //sfs_checksum.c
+    uint32_t checksums[CHECKSUM_BLOCKS * (BLOCK_SIZE/4)];  //Checksum of every block, cached
+    unsigned char checksum_dirty[CHECKSUM_BLOCKS];         //Checksum blocks changed since the last flush
+    unsigned char checksum_opened[BLOCK_AMOUNT/8];         //Blocks whose entry on disk is CHECKSUM_OPEN until the next flush
+    int checksums_enabled;
+
+    //sfs_compress.c
+    chunk_entry chunk_cache[CHUNK_CACHE_ENTRIES];
+    unsigned long chunk_clock;
+    int chunk_cache_ready;
+
+    //sfs_dedup.c
+    uint16_t refcounts[REFCOUNT_BLOCKS * (BLOCK_SIZE/2)];  //References to every block, cached
+    unsigned char refcount_dirty[REFCOUNT_BLOCKS];         //Refcount blocks changed since the last flush
+    fingerprint block_fp[BLOCK_AMOUNT];             //Fingerprint of every indexed block
+    unsigned char block_indexed[BLOCK_AMOUNT];
+    int index_next[BLOCK_AMOUNT];                   //Next block in the same bucket, -1 at the end
+    int index_head[INDEX_BUCKETS];                  //First block of every bucket, -1 if empty
+
+    //sfs_map.c
+    mapping map_table[SFS_MAX_MAPS];
+    int map_table_ready;
+
+    //sfs_defrag.c
+    int defrag_inode;                               //File being moved, 0 if none
+    int defrag_target;                              //First block of the run it moves to
+    int defrag_blocks;                              //Its data blocks when the move started
+    int defrag_scan;                                //Last i-Node looked at
+
+    //sfs_log.c
+    int log_segment;                                //Segment the log appends to, -1 until one is opened
+    int log_next;                                   //Block of it looked at next
+    int log_cleaning;                               //Segment the cleaner empties, -1 if none
+    int log_appended;                               //Blocks appended since the last checkpoint
+    unsigned char log_freed[BLOCK_AMOUNT/8];        //Freed since the last checkpoint, which still uses them
+    int log_freed_count;
+    unsigned char log_table_dirty[INODE_TABLE_BLOCKS];  //i-Node table blocks changed since the last checkpoint
+    int log_directory_dirty;
+    int log_checkpointing;                          //Set while the tables held back are written out
+
+    //sfs_async.c
+    struct sfs_async *async;                        //Request queues and worker, NULL until first used
+} sfs_t;
+
+extern __thread sfs_t *sfs;     //Instance the calling thread works on
+extern sfs_t sfs_default;       //Instance on "Tairov_sfs" used until sfs_select
+
+int mksfs(int);                 //Remounting frees every sfs_map view, unmap them first; -1 if the disk can't be read
 int sfs_getnextfilename(char*);
+int sfs_readdir(int*, char*);
 int sfs_getfilesize(const char*);
 int sfs_fopen(char*);
 int sfs_fclose(int);
 int sfs_fwrite(int, const char*, int);
 int sfs_fread(int, char*, int);
 int sfs_fseek(int, int);
+int sfs_fflush(int);
+int sfs_pread(int, int, char*, int);
+int sfs_pwrite(int, int, const char*, int);
+int sfs_fallocate(int, int, int);
+int sfs_writev(int, const struct iovec*, int);
+int sfs_readv(int, const struct iovec*, int);
+void *sfs_map(int, int, int, int);
+int sfs_unmap(void*);
 int sfs_remove(char*);
+int sfs_clone(const char*, const char*);
+void sfs_stats(sfs_statistics*);
+void sfs_stats_reset();
+int sfs_stats_format(char*, int);
+int sfs_set_compression(int);
+int sfs_set_dedup(int);
+int sfs_snapshot_create();
+int sfs_snapshot_mount(int);
+int sfs_snapshot_delete(int);
+void sfs_frag_stats(sfs_frag_info*);
+int sfs_frag_report(char*, int);
+int sfs_defrag_step(int);
+int sfs_set_log(int);
+int sfs_log_clean(int);
+int sfs_trace_start(const char*);
+int sfs_trace_stop();
+const char *sfs_op_name(int);
+
+//Instances (sfs_instance.c) and the API taking one explicitly
+sfs_t *sfs_create(const char*);
+void sfs_destroy(sfs_t*);
+sfs_t *sfs_select(sfs_t*);
+int mksfs_r(sfs_t*, int);
+int sfs_getnextfilename_r(sfs_t*, char*);
+int sfs_readdir_r(sfs_t*, int*, char*);
+int sfs_getfilesize_r(sfs_t*, const char*);
+int sfs_fopen_r(sfs_t*, char*);
+int sfs_fclose_r(sfs_t*, int);
+int sfs_fwrite_r(sfs_t*, int, const char*, int);
+int sfs_fread_r(sfs_t*, int, char*, int);
+int sfs_fseek_r(sfs_t*, int, int);
+int sfs_fflush_r(sfs_t*, int);
+int sfs_fallocate_r(sfs_t*, int, int, int);
+int sfs_writev_r(sfs_t*, int, const struct iovec*, int);
+int sfs_readv_r(sfs_t*, int, const struct iovec*, int);
+void *sfs_map_r(sfs_t*, int, int, int, int);
+int sfs_unmap_r(sfs_t*, void*);
+int sfs_remove_r(sfs_t*, char*);
+int sfs_clone_r(sfs_t*, const char*, const char*);
+void sfs_stats_r(sfs_t*, sfs_statistics*);
+void sfs_stats_reset_r(sfs_t*);
+int sfs_stats_format_r(sfs_t*, char*, int);
+int sfs_set_compression_r(sfs_t*, int);
+int sfs_set_dedup_r(sfs_t*, int);
+int sfs_snapshot_create_r(sfs_t*);
+int sfs_snapshot_mount_r(sfs_t*, int);
+int sfs_snapshot_delete_r(sfs_t*, int);
+void sfs_frag_stats_r(sfs_t*, sfs_frag_info*);
+int sfs_frag_report_r(sfs_t*, char*, int);
+int sfs_defrag_step_r(sfs_t*, int);
+int sfs_set_log_r(sfs_t*, int);
+int sfs_log_clean_r(sfs_t*, int);
+int sfs_trace_start_r(sfs_t*, const char*);
+int sfs_trace_stop_r(sfs_t*);
+
+//Asynchronous requests (sfs_async.c), a submit returns NULL if the request can't be queued
+typedef struct sfs_request sfs_request;
+typedef void (*sfs_callback)(sfs_request*, void*);
+sfs_request *sfs_open_async(sfs_t*, const char*, sfs_callback, void*);
+sfs_request *sfs_close_async(sfs_t*, int, sfs_callback, void*);
+sfs_request *sfs_read_async(sfs_t*, int, int, char*, int, sfs_callback, void*);
+sfs_request *sfs_write_async(sfs_t*, int, int, const char*, int, sfs_callback, void*);
+sfs_request *sfs_defrag_async(sfs_t*, int, sfs_callback, void*);
+sfs_request *sfs_log_clean_async(sfs_t*, int, sfs_callback, void*);
+int sfs_async_result(sfs_request*);
+sfs_request *sfs_async_poll(sfs_t*);
+sfs_request *sfs_async_wait(sfs_t*);
+void sfs_async_free(sfs_request*);
+
 
 //Added functions
 int get_free_block();
+int get_free_run(int n);
 void set_bit(int);
 void remove_bit(int);
+void discard_flush();
+void write_superblock();
+void write_bitmap();
 int size_to_blocks(int);
 int scan_dir_name(char* fname);
-int find_free_i_node();
+int alloc_i_node();
+void free_i_node(int index);
+void inode_map_load();
+void write_meta(int region, int start, int size, void *data);
+int read_meta(int region, int start, int size, void *data);
+int region_cache(int region);
 void write_directory();
-void read_directory();
+void write_inode(int index);
+void stats_begin(int op);
+int stats_end(int op, int result);
+void stats_io(int region, int is_write, int nblocks);
+void stats_cache(int cache, int hits, int misses, int flushes);
+void stats_checksum(int verified, int mismatches, int blocks_flushed);
+void stats_cache_evict(int cache);
+int region_read(int region, int start, int nblocks, void *buffer);
+int region_write(int region, int start, int nblocks, void *buffer);
+void region_discard(int start, int nblocks);
+void checksum_format();
+int checksum_load();
+void checksum_disable();
+int checksum_verify(int start, int nblocks, void *buffer);
+void checksum_open(int start, int nblocks);
+void checksum_update(int start, int nblocks, void *buffer);
+void checksum_flush();
+int chunk_is_compressed(int *slots, int n);
+int chunk_read(int inode, int chunk, int *slots, int n, char *out, int first, int last);
+int chunk_store(int inode, int chunk, int *slots, int new_n, char *plain, int compress);
+void chunk_cache_invalidate(int inode);
+int read_directory();
+void stats_dedup(int hits, int misses, int cow_copies);
+void refcount_format();
+int refcount_load();
+void refcount_flush();
+void dedup_reset();
+void dedup_forget(int start, int nblocks);
+int block_is_shared(int block);
+void block_share(int block);
+void block_release(int block);
+int dedup_write(int *slot, char *block);
+int load_slots(i_node *inode, int *slots);
+void mask_unwritten(i_node *inode, int *slots);
+int snapshot_create();
+int snapshot_mount(int id);
+int snapshot_delete(int id);
+int read_at(int fileID, int offset, int length, char *buf);
+int write_at(int fileID, int offset, int length, const char *buf);
+void map_reset();
+int map_count(int fileID);
+void *map_create(int fileID, int offset, int length, int writable);
+int map_release(void *view);
+void async_shutdown(sfs_t *fs);
+int own_indirect(i_node *inode, int old_indirect);
+int store_slots(i_node *inode, int *slots, int *old_slots, int count, int old_indirect);
+void frag_stats(sfs_frag_info *out);
+int frag_report(char *buf, int size);
+int defrag_step(int budget);
+int append_write(int fileID, const char *buf, int length);
+int append_flush(int fileID);
+int append_flush_all();
+int append_sync();
+void append_release(int fileID);
+void append_reset();
+int append_pending(i_node *inode);
+void trace_args(int fd, int offset, int length, int flags, const char *name);
+void trace_end(int op, int result, struct timespec *now);
+int trace_view(void *view);
+int log_active();
+int log_alloc();
+int log_defer_free(int block);
+void log_reset();
+void log_checkpoint();
+void log_end_call();
+int log_clean(int budget);
 
 #endif
@@ -0,0 +1,115 @@
+/* ======================================================================== */
+/* sfs_append:                                                              */
+/* Write combining for small appends. An fwrite of less than                */
+/* SFS_APPEND_BUFFER bytes at the end of an open file is copied into a      */
+/* buffer the file descriptor owns and nothing else happens. The buffer is  */
+/* committed through fwrite when it fills up, as whole blocks (the partial  */
+/* last block stays buffered), and in full on sfs_fflush, sfs_fclose and    */
+/* sfs_fseek. Every other call on the file (reads, positional writes,       */
+/* views, fallocate) commits it first, and snapshots and mounts commit      */
+/* every file's, so buffered bytes are only ever missing from the disk,     */
+/* never from what the API returns; sfs_getfilesize counts them. Until      */
+/* committed, they are lost if the process ends. A failed commit drops the  */
+/* buffer and the rw pointer falls back to the end of the file.             */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+
+static int commit(int fileID, int keep) {      //Writes all but the last keep bytes buffered
+    file_descriptor *fd = &sfs->open_fd_table[fileID];
+    int n = fd->pending_length - keep;
+
+    if (n > 0 && write_at(fileID, fd->inode->size, n, fd->pending) != n) {
+        fd->pending_length = 0;
+        fd->rwpointer = fd->inode->size;
+        return -1;
+    }
+    memmove(fd->pending, fd->pending + n, keep);
+    fd->pending_length = keep;
+    return 0;
+}
+
+int append_flush(int fileID) {      //Nothing to do for a file that isn't open, the caller reports that
+    if (fileID < 0 || fileID >= MAX_FD_AMOUNT || !sfs->open_fd_table[fileID].inode
+        || sfs->open_fd_table[fileID].pending_length == 0) {
+        return 0;
+    }
+    return commit(fileID, 0);
+}
+
+int append_flush_all() {
+    int result = 0;
+    for (int i = 0; i < MAX_FD_AMOUNT; i++) {
+        if (append_flush(i) < 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int append_sync() {     //Outside an API call: the tables the commits changed are written too
+    int result = append_flush_all();
+    log_checkpoint();
+    discard_flush();
+    refcount_flush();
+    checksum_flush();
+    return result;
+}
+
+void append_release(int fileID) {   //The descriptor goes away, whatever is buffered with it
+    free(sfs->open_fd_table[fileID].pending);
+    sfs->open_fd_table[fileID].pending = NULL;
+    sfs->open_fd_table[fileID].pending_length = 0;
+}
+
+void append_reset() {
+    for (int i = 0; i < MAX_FD_AMOUNT; i++) {
+        append_release(i);
+    }
+}
+
+int append_pending(i_node *inode) { //Bytes of the file not committed yet
+    for (int i = 0; i < MAX_FD_AMOUNT; i++) {
+        if (sfs->open_fd_table[i].inode == inode) {
+            return sfs->open_fd_table[i].pending_length;
+        }
+    }
+    return 0;
+}
+
+/* ======================================================================== */
+/* append_write:                                                            */
+/* Buffers a small append and returns length, or -1 if committing a full    */
+/* buffer failed. Any other write returns APPEND_DIRECT once what is        */
+/* buffered is committed, so fwrite does it itself, in order.               */
+/* ======================================================================== */
+int append_write(int fileID, const char *buf, int length) {
+    if (fileID < 0 || fileID >= MAX_FD_AMOUNT || !sfs->open_fd_table[fileID].inode || sfs->read_only) {
+        return APPEND_DIRECT;       //fwrite refuses it
+    }
+    file_descriptor *fd = &sfs->open_fd_table[fileID];
+    int end = fd->inode->size + fd->pending_length;
+    if (length <= 0 || length >= SFS_APPEND_BUFFER || fd->rwpointer != end || end + length > MAX_FILE_SIZE) {
+        return append_flush(fileID) < 0 ? -1 : APPEND_DIRECT;
+    }
+    if (fd->pending == NULL && (fd->pending = malloc(SFS_APPEND_BUFFER)) == NULL) {
+        return APPEND_DIRECT;
+    }
+
+    for (int copied = 0; copied < length; ) {
+        int n = SFS_APPEND_BUFFER - fd->pending_length;
+        n = length - copied < n ? length - copied : n;
+        memcpy(fd->pending + fd->pending_length, buf + copied, n);
+        fd->pending_length += n;
+        copied += n;
+        if (fd->pending_length == SFS_APPEND_BUFFER
+            && commit(fileID, (fd->inode->size + fd->pending_length) % BLOCK_SIZE) < 0) {
+            return -1;
+        }
+    }
+    fd->rwpointer = end + length;
+    return length;
+}
@@ -0,0 +1,301 @@
+/* ======================================================================== */
+/* sfs_async:                                                               */
+/* Asynchronous requests. sfs_*_async queues the operation on the instance  */
+/* and returns a request handle at once, so one thread can keep many file   */
+/* operations in flight. Every instance that gets a request has one worker  */
+/* thread serving its queue in submission order, through the same code as   */
+/* the synchronous calls (which also fan block requests out over the        */
+/* striped device). A finished request is either handed to its callback,    */
+/* on the worker thread, and freed once the callback returns, or, without   */
+/* a callback, put on the instance's completion queue for sfs_async_poll /  */
+/* sfs_async_wait, and freed by the caller with sfs_async_free.             */
+/* Reads and writes take an explicit offset (see sfs_pread/sfs_pwrite) as   */
+/* the order they run in relative to the caller's other work is unknown.    */
+/* The synchronous API must not be used on an instance while it has         */
+/* requests outstanding.                                                    */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sfs_api.h"
+
+enum { ASYNC_OPEN, ASYNC_CLOSE, ASYNC_READ, ASYNC_WRITE, ASYNC_DEFRAG, ASYNC_LOG_CLEAN };
+
+struct sfs_request {
+    int op;
+    int fileID;
+    int offset;
+    int length;
+    char *buf;                  //Read destination or write source, owned by the caller
+    char name[MAXFILENAME + 1];
+    sfs_callback callback;
+    void *arg;
+    int result;
+    sfs_request *next;
+};
+
+//Queues and worker of one instance
+struct sfs_async {
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        //Signaled when a request is queued or on shutdown
+    pthread_cond_t done;        //Signaled when a request completes
+    sfs_request *queue_head, *queue_tail;
+    sfs_request *done_head, *done_tail;
+    int outstanding;            //Queued or running, plus completed and not yet collected
+    int stopping;
+};
+
+static pthread_mutex_t async_setup = PTHREAD_MUTEX_INITIALIZER;
+
+static void run(sfs_request *r) {
+    switch (r->op) {
+        case ASYNC_OPEN:  r->result = sfs_fopen(r->name); break;
+        case ASYNC_CLOSE: r->result = sfs_fclose(r->fileID); break;
+        case ASYNC_READ:  r->result = sfs_pread(r->fileID, r->offset, r->buf, r->length); break;
+        case ASYNC_WRITE: r->result = sfs_pwrite(r->fileID, r->offset, r->buf, r->length); break;
+        case ASYNC_DEFRAG: r->result = sfs_defrag_step(r->length); break;
+        case ASYNC_LOG_CLEAN: r->result = sfs_log_clean(r->length); break;
+    }
+}
+
+static void *async_worker(void *arg) {
+    sfs_t *fs = arg;
+    struct sfs_async *a = fs->async;
+
+    sfs_select(fs);
+    pthread_mutex_lock(&a->lock);
+    for (;;) {
+        while (a->queue_head == NULL && !a->stopping) {
+            pthread_cond_wait(&a->work, &a->lock);
+        }
+        if (a->queue_head == NULL) {      //Stopping and drained
+            break;
+        }
+        sfs_request *r = a->queue_head;
+        a->queue_head = r->next;
+        if (a->queue_head == NULL) {
+            a->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&a->lock);
+
+        run(r);
+        int handed_off = r->callback != NULL;
+        if (handed_off) {
+            r->callback(r, r->arg);
+            free(r);
+        }
+
+        pthread_mutex_lock(&a->lock);
+        if (handed_off) {
+            a->outstanding--;
+        }
+        else {
+            r->next = NULL;
+            if (a->done_tail) {
+                a->done_tail->next = r;
+            }
+            else {
+                a->done_head = r;
+            }
+            a->done_tail = r;
+        }
+        pthread_cond_broadcast(&a->done);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+static struct sfs_async *async_of(sfs_t *fs) {     //Starts the worker the first time, NULL if it can't be started
+    pthread_mutex_lock(&async_setup);
+    if (fs->async == NULL) {
+        struct sfs_async *a = calloc(1, sizeof(struct sfs_async));
+        if (a == NULL) {
+            pthread_mutex_unlock(&async_setup);
+            return NULL;
+        }
+        pthread_mutex_init(&a->lock, NULL);
+        pthread_cond_init(&a->work, NULL);
+        pthread_cond_init(&a->done, NULL);
+        fs->async = a;
+        if (pthread_create(&a->worker, NULL, async_worker, fs) != 0) {
+            pthread_mutex_destroy(&a->lock);
+            pthread_cond_destroy(&a->work);
+            pthread_cond_destroy(&a->done);
+            free(a);
+            fs->async = NULL;
+        }
+    }
+    pthread_mutex_unlock(&async_setup);
+    return fs->async;
+}
+
+static sfs_request *new_request(int op) {
+    sfs_request *r = calloc(1, sizeof(sfs_request));
+    if (r == NULL) {
+        printf("SFS_API: CANNOT QUEUE REQUEST; OUT OF MEMORY.\n");
+        return NULL;
+    }
+    r->op = op;
+    return r;
+}
+
+static sfs_request *submit(sfs_t *fs, sfs_request *r, sfs_callback callback, void *arg) {     //NULL, and r freed, if it can't be queued
+    struct sfs_async *a = async_of(fs ? fs : &sfs_default);
+    if (a == NULL) {
+        printf("SFS_API: CANNOT QUEUE REQUEST; NO WORKER.\n");
+        free(r);
+        return NULL;
+    }
+    r->callback = callback;
+    r->arg = arg;
+    r->next = NULL;
+    pthread_mutex_lock(&a->lock);
+    if (a->queue_tail) {
+        a->queue_tail->next = r;
+    }
+    else {
+        a->queue_head = r;
+    }
+    a->queue_tail = r;
+    a->outstanding++;
+    pthread_cond_signal(&a->work);
+    pthread_mutex_unlock(&a->lock);
+    return r;
+}
+
+sfs_request *sfs_open_async(sfs_t *fs, const char *name, sfs_callback callback, void *arg) {
+    if (name == NULL || strlen(name) > MAXFILENAME) {
+        printf("SFS_API: CANNOT OPEN FILE; INVALID NAME.\n");
+        return NULL;
+    }
+    sfs_request *r = new_request(ASYNC_OPEN);
+    if (r == NULL) {
+        return NULL;
+    }
+    strcpy(r->name, name);
+    return submit(fs, r, callback, arg);
+}
+
+sfs_request *sfs_close_async(sfs_t *fs, int fileID, sfs_callback callback, void *arg) {
+    sfs_request *r = new_request(ASYNC_CLOSE);
+    if (r == NULL) {
+        return NULL;
+    }
+    r->fileID = fileID;
+    return submit(fs, r, callback, arg);
+}
+
+sfs_request *sfs_read_async(sfs_t *fs, int fileID, int offset, char *buf, int length,
+                            sfs_callback callback, void *arg) {
+    sfs_request *r = new_request(ASYNC_READ);
+    if (r == NULL) {
+        return NULL;
+    }
+    r->fileID = fileID;
+    r->offset = offset;
+    r->buf = buf;
+    r->length = length;
+    return submit(fs, r, callback, arg);
+}
+
+sfs_request *sfs_write_async(sfs_t *fs, int fileID, int offset, const char *buf, int length,
+                             sfs_callback callback, void *arg) {
+    sfs_request *r = new_request(ASYNC_WRITE);
+    if (r == NULL) {
+        return NULL;
+    }
+    r->fileID = fileID;
+    r->offset = offset;
+    r->buf = (char *) buf;
+    r->length = length;
+    return submit(fs, r, callback, arg);
+}
+
+sfs_request *sfs_defrag_async(sfs_t *fs, int budget, sfs_callback callback, void *arg) {
+    sfs_request *r = new_request(ASYNC_DEFRAG);     //Background defragmenting between requests
+    if (r == NULL) {
+        return NULL;
+    }
+    r->length = budget;
+    return submit(fs, r, callback, arg);
+}
+
+sfs_request *sfs_log_clean_async(sfs_t *fs, int budget, sfs_callback callback, void *arg) {
+    sfs_request *r = new_request(ASYNC_LOG_CLEAN);     //Segment cleaning in the background, between requests
+    if (r == NULL) {
+        return NULL;
+    }
+    r->length = budget;
+    return submit(fs, r, callback, arg);
+}
+
+int sfs_async_result(sfs_request *r) {     //What the synchronous call would have returned
+    return r->result;
+}
+
+/* ======================================================================== */
+/* async_poll / async_wait:                                                 */
+/* Take the oldest completed request off the completion queue. poll         */
+/* returns NULL when none has completed yet, wait blocks until one does     */
+/* and returns NULL only if nothing is outstanding.                         */
+/* ======================================================================== */
+static sfs_request *collect(sfs_t *fs, int block) {
+    struct sfs_async *a = async_of(fs ? fs : &sfs_default);
+    sfs_request *r = NULL;
+
+    if (a == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&a->lock);
+    while (block && a->done_head == NULL && a->outstanding > 0) {
+        pthread_cond_wait(&a->done, &a->lock);
+    }
+    if (a->done_head) {
+        r = a->done_head;
+        a->done_head = r->next;
+        if (a->done_head == NULL) {
+            a->done_tail = NULL;
+        }
+        a->outstanding--;
+    }
+    pthread_mutex_unlock(&a->lock);
+    return r;
+}
+
+sfs_request *sfs_async_poll(sfs_t *fs) {
+    return collect(fs, 0);
+}
+
+sfs_request *sfs_async_wait(sfs_t *fs) {
+    return collect(fs, 1);
+}
+
+void sfs_async_free(sfs_request *r) {
+    free(r);
+}
+
+void async_shutdown(sfs_t *fs) {            //Runs what is queued, stops the worker, drops uncollected completions
+    struct sfs_async *a = fs->async;
+    if (a == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&a->lock);
+    a->stopping = 1;
+    pthread_cond_signal(&a->work);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->worker, NULL);
+
+    while (a->done_head) {
+        sfs_request *r = a->done_head;
+        a->done_head = r->next;
+        free(r);
+    }
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->work);
+    pthread_cond_destroy(&a->done);
+    free(a);
+    fs->async = NULL;
+}
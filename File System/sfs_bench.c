@@ -0,0 +1,347 @@
+/* ======================================================================== */
+/* sfs_bench:                                                               */
+/* Throughput and latency benchmark for the SFS API. Every workload runs    */
+/* on a freshly made image with a fixed seed so runs can be compared        */
+/* across builds. Usage:                                                    */
+/*     sfs_bench [-p none|hdd|ssd] [-s seed] [-f text|json|csv]             */
+/*               [-S images[:unit]] [-t] [-d] [-l]                          */
+/* Latency of an operation is wall time plus the device time charged by     */
+/* the disk_emu model (unless the model really sleeps).                     */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#define FILE_BYTES (256*1024)   //Large file size, just under the 268 block limit
+#define CHUNK 4096              //Sequential request size
+#define RAND_IO 1024            //Random request size
+#define RAND_OPS 256
+#define SMALL_FILES 100         //Stays below DIR_AMOUNT
+#define SMALL_BYTES 64
+#define APPENDS 1000
+#define APPEND_BYTES 128
+
+//Results of one workload
+typedef struct {
+    const char *name;
+    long ops;
+    long bytes;
+    double *lat;            //Latency of every operation, in microseconds
+    double total_us;
+    disk_counters io;       //Device requests issued during the timed operations
+    disk_counters io_start;
+    double op_start;
+    double dev_start;
+} bench_result;
+
+FILE *report;               //Where results go, SFS chatter goes to /dev/null
+char *format = "text";
+char *profile = "none";
+unsigned int seed = 1;
+disk_model bench_model;
+int log_mode = 0;           //-l: images written log-structured
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void fresh_image() {        //Every workload starts from the same empty image
+    close_disk();
+    set_disk_model(&bench_model);
+    srand(seed);
+    mksfs(1);
+    if (log_mode) {
+        sfs_set_log(1);
+    }
+}
+
+void bench_init(bench_result *r, const char *name, int max_ops) {
+    memset(r, 0, sizeof(bench_result));
+    r->name = name;
+    r->lat = malloc(max_ops * sizeof(double));
+}
+
+void op_begin(bench_result *r) {
+    get_disk_counters(&r->io_start);
+    r->dev_start = disk_elapsed_us();
+    r->op_start = now_us();
+}
+
+void op_end(bench_result *r, int bytes) {
+    double t = now_us() - r->op_start;
+    disk_counters c;
+
+    if (!bench_model.sleep) {       //Add the modeled device time that was not slept
+        t += disk_elapsed_us() - r->dev_start;
+    }
+    get_disk_counters(&c);
+    r->io.reads += c.reads - r->io_start.reads;
+    r->io.writes += c.writes - r->io_start.writes;
+    r->io.blocks_read += c.blocks_read - r->io_start.blocks_read;
+    r->io.blocks_written += c.blocks_written - r->io_start.blocks_written;
+    r->io.errors += c.errors - r->io_start.errors;
+
+    r->lat[r->ops++] = t;
+    r->total_us += t;
+    r->bytes += bytes;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(bench_result *r, double pct) {   //lat must already be sorted
+    int i = (int)(pct / 100.0 * (r->ops - 1) + 0.5);
+    return r->ops ? r->lat[i] : 0;
+}
+
+void print_result(bench_result *r) {
+    qsort(r->lat, r->ops, sizeof(double), compare_double);
+
+    double n = r->ops ? r->ops : 1;
+    double mb_s = r->total_us > 0 ? r->bytes / r->total_us : 0;    //bytes/us == MB/s
+    double ops_s = r->total_us > 0 ? r->ops * 1e6 / r->total_us : 0;
+
+    if (strcmp(format, "json") == 0) {
+        fprintf(report, "{\"workload\":\"%s\",\"profile\":\"%s\",\"seed\":%u,\"ops\":%ld,\"bytes\":%ld,"
+                "\"mb_s\":%.3f,\"ops_s\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,"
+                "\"reads_per_op\":%.2f,\"writes_per_op\":%.2f,\"blocks_read_per_op\":%.2f,"
+                "\"blocks_written_per_op\":%.2f,\"io_errors\":%ld}\n",
+                r->name, profile, seed, r->ops, r->bytes, mb_s, ops_s,
+                percentile(r, 50), percentile(r, 90), percentile(r, 99), percentile(r, 100),
+                r->io.reads / n, r->io.writes / n, r->io.blocks_read / n, r->io.blocks_written / n,
+                r->io.errors);
+    }
+    else if (strcmp(format, "csv") == 0) {
+        fprintf(report, "%s,%s,%u,%ld,%ld,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f,%.2f,%.2f,%.2f,%ld\n",
+                r->name, profile, seed, r->ops, r->bytes, mb_s, ops_s,
+                percentile(r, 50), percentile(r, 90), percentile(r, 99), percentile(r, 100),
+                r->io.reads / n, r->io.writes / n, r->io.blocks_read / n, r->io.blocks_written / n,
+                r->io.errors);
+    }
+    else {
+        fprintf(report, "%-12s %6ld ops %9.3f MB/s %10.1f ops/s  p50 %9.1f  p99 %9.1f  max %9.1f us"
+                "  blk r/w per op %7.2f/%-7.2f\n",
+                r->name, r->ops, mb_s, ops_s, percentile(r, 50), percentile(r, 99), percentile(r, 100),
+                r->io.blocks_read / n, r->io.blocks_written / n);
+    }
+    free(r->lat);
+}
+
+void fill(char *buf, int len, int salt) {
+    for (int i = 0; i < len; i++) {
+        buf[i] = (char)('a' + (i + salt) % 26);
+    }
+}
+
+int prefill(char *name) {           //Untimed: writes FILE_BYTES to a new file
+    char buf[CHUNK];
+    int fd = sfs_fopen(name);
+    for (int off = 0; off < FILE_BYTES; off += CHUNK) {
+        fill(buf, CHUNK, off);
+        sfs_fwrite(fd, buf, CHUNK);
+    }
+    return fd;
+}
+
+void bench_sequential() {
+    bench_result w, r;
+    char buf[CHUNK];
+
+    fresh_image();
+    bench_init(&w, "seq_write", FILE_BYTES / CHUNK);
+    int fd = sfs_fopen("seq");
+    for (int off = 0; off < FILE_BYTES; off += CHUNK) {
+        fill(buf, CHUNK, off);
+        op_begin(&w);
+        sfs_fwrite(fd, buf, CHUNK);
+        op_end(&w, CHUNK);
+    }
+    print_result(&w);
+
+    bench_init(&r, "seq_read", FILE_BYTES / CHUNK);
+    sfs_fseek(fd, 0);
+    for (int off = 0; off < FILE_BYTES; off += CHUNK) {
+        op_begin(&r);
+        int n = sfs_fread(fd, buf, CHUNK);
+        op_end(&r, n > 0 ? n : 0);
+    }
+    sfs_fclose(fd);
+    print_result(&r);
+}
+
+void bench_random() {
+    bench_result w, r;
+    char buf[RAND_IO];
+
+    fresh_image();
+    int fd = prefill("rand");
+
+    bench_init(&w, "rand_write", RAND_OPS);
+    for (int i = 0; i < RAND_OPS; i++) {
+        int off = rand() % (FILE_BYTES - RAND_IO);
+        fill(buf, RAND_IO, i);
+        op_begin(&w);
+        sfs_fseek(fd, off);
+        sfs_fwrite(fd, buf, RAND_IO);
+        op_end(&w, RAND_IO);
+    }
+    print_result(&w);
+
+    bench_init(&r, "rand_read", RAND_OPS);
+    for (int i = 0; i < RAND_OPS; i++) {
+        int off = rand() % (FILE_BYTES - RAND_IO);
+        op_begin(&r);
+        sfs_fseek(fd, off);
+        int n = sfs_fread(fd, buf, RAND_IO);
+        op_end(&r, n > 0 ? n : 0);
+    }
+    sfs_fclose(fd);
+    print_result(&r);
+}
+
+void bench_small_files() {
+    bench_result c, s, d;
+    char name[MAXFILENAME];
+    char buf[SMALL_BYTES];
+
+    fresh_image();
+    fill(buf, SMALL_BYTES, 0);
+
+    bench_init(&c, "create", SMALL_FILES);
+    for (int i = 0; i < SMALL_FILES; i++) {
+        sprintf(name, "small%03d", i);
+        op_begin(&c);
+        int fd = sfs_fopen(name);
+        sfs_fwrite(fd, buf, SMALL_BYTES);
+        sfs_fclose(fd);
+        op_end(&c, SMALL_BYTES);
+    }
+    print_result(&c);
+
+    bench_init(&s, "stat", SMALL_FILES);
+    for (int i = 0; i < SMALL_FILES; i++) {
+        sprintf(name, "small%03d", i);
+        op_begin(&s);
+        sfs_getfilesize(name);
+        op_end(&s, 0);
+    }
+    print_result(&s);
+
+    bench_init(&d, "delete", SMALL_FILES);
+    for (int i = 0; i < SMALL_FILES; i++) {
+        sprintf(name, "small%03d", i);
+        op_begin(&d);
+        sfs_remove(name);
+        op_end(&d, 0);
+    }
+    print_result(&d);
+}
+
+void bench_append() {
+    bench_result a;
+    char buf[APPEND_BYTES];
+
+    fresh_image();
+    bench_init(&a, "append", APPENDS);
+    int fd = sfs_fopen("log");
+    for (int i = 0; i < APPENDS; i++) {
+        fill(buf, APPEND_BYTES, i);
+        op_begin(&a);
+        sfs_fwrite(fd, buf, APPEND_BYTES);
+        op_end(&a, APPEND_BYTES);
+    }
+    sfs_fclose(fd);
+    print_result(&a);
+}
+
+/* ======================================================================== */
+/* The FUSE workloads replay the exact call sequence fuse_wrap_*.c issues   */
+/* per request (open, seek, read/write, close) without needing a mount.     */
+/* ======================================================================== */
+void bench_fuse_path() {
+    bench_result w, r;
+    char buf[CHUNK];
+    char path[MAXFILENAME];
+
+    fresh_image();
+    strcpy(path, "/fuse");
+    sfs_fclose(sfs_fopen(path));        //fuse_create
+
+    bench_init(&w, "fuse_write", FILE_BYTES / CHUNK);
+    for (int off = 0; off < FILE_BYTES; off += CHUNK) {
+        fill(buf, CHUNK, off);
+        op_begin(&w);
+        int fd = sfs_fopen(path);
+        sfs_fseek(fd, off);
+        sfs_fwrite(fd, buf, CHUNK);
+        sfs_fclose(fd);
+        op_end(&w, CHUNK);
+    }
+    print_result(&w);
+
+    bench_init(&r, "fuse_read", FILE_BYTES / CHUNK);
+    for (int off = 0; off < FILE_BYTES; off += CHUNK) {
+        op_begin(&r);
+        int fd = sfs_fopen(path);
+        sfs_fseek(fd, off);
+        int n = sfs_fread(fd, buf, CHUNK);
+        sfs_fclose(fd);
+        op_end(&r, n > 0 ? n : 0);
+    }
+    print_result(&r);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:s:f:S:tdl")) != -1) {
+        switch (opt) {
+            case 'p': profile = optarg; break;
+            case 's': seed = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'f': format = optarg; break;
+            case 'S':       //Stripe the image over several files, RAID-0
+                if (set_disk_stripes(atoi(optarg), strchr(optarg, ':') ? atoi(strchr(optarg, ':') + 1) : 1) != 0) {
+                    return 1;
+                }
+                break;
+            case 't': set_disk_sparse(1); break;    //Thin-provisioned (sparse) images
+            case 'd': set_disk_direct(1); break;    //O_DIRECT images, past the host page cache
+            case 'l': log_mode = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-p none|hdd|ssd] [-s seed] [-f text|json|csv] [-S images[:unit]] [-t] [-d] [-l]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (disk_model_preset(profile, &bench_model) != 0) {
+        return 1;
+    }
+    bench_model.seed = seed;
+
+    report = fdopen(dup(fileno(stdout)), "w");      //Keep the report clean of SFS messages
+    freopen("/dev/null", "w", stdout);
+
+    if (strcmp(format, "csv") == 0) {
+        fprintf(report, "workload,profile,seed,ops,bytes,mb_s,ops_s,p50_us,p90_us,p99_us,max_us,"
+                "reads_per_op,writes_per_op,blocks_read_per_op,blocks_written_per_op,io_errors\n");
+    }
+
+    bench_sequential();
+    bench_random();
+    bench_small_files();
+    bench_append();
+    bench_fuse_path();
+
+    close_disk();
+    fclose(report);
+    return 0;
+}
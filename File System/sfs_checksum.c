@@ -0,0 +1,151 @@
+/* ======================================================================== */
+/* sfs_checksum:                                                            */
+/* Per-block CRC32C checksums. The table covering every block of the disk   */
+/* lives in the checksum blocks just before the bitmap and is cached in     */
+/* memory. Writes only update the cached entry and mark its checksum block  */
+/* dirty, the dirty blocks are written once at the end of each API call,    */
+/* so a call writing many data blocks rewrites each checksum block once.    */
+/* Reads are verified against the cached table.                             */
+/* Blocks rewritten in place (metadata, shared by every file) first get     */
+/* their entry on disk set to CHECKSUM_OPEN: after a crash mid-call the     */
+/* table can't vouch for them, so the first read takes what it finds.      */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+#include "crc32c.h"
+
+#define ENTRIES_PER_BLOCK (BLOCK_SIZE/sizeof(uint32_t))
+
+static int is_covered(int block) {      //The table covers every block of the disk except itself
+    return block >= 0 && block < BLOCK_AMOUNT &&
+           (block < CHECKSUM_START || block >= CHECKSUM_START + CHECKSUM_BLOCKS);
+}
+
+static uint32_t block_checksum(void *block) {
+    return BLOCK_CHECKSUM(crc32c(0, block, BLOCK_SIZE));
+}
+
+static int is_opened(int block) {
+    return (sfs->checksum_opened[block/8] >> (block % 8)) & 1;
+}
+
+void checksum_format() {        //Fresh disk: every block holds zeros
+    char *zero = calloc(1, BLOCK_SIZE);
+    uint32_t crc = block_checksum(zero);
+    free(zero);
+
+    for (int i = 0; i < BLOCK_AMOUNT; i++) {
+        sfs->checksums[i] = crc;
+    }
+    memset(sfs->checksum_dirty, 1, sizeof(sfs->checksum_dirty));
+    memset(sfs->checksum_opened, 0, sizeof(sfs->checksum_opened));
+    sfs->checksums_enabled = 1;
+}
+
+int checksum_load() {           //Existing disk: bring the table into memory, -1 if it can't be read
+    memset(sfs->checksum_dirty, 0, sizeof(sfs->checksum_dirty));
+    memset(sfs->checksum_opened, 0, sizeof(sfs->checksum_opened));
+    if (region_read(SFS_REGION_CHECKSUM, CHECKSUM_START, CHECKSUM_BLOCKS, sfs->checksums) < 0) {
+        sfs->checksums_enabled = 0;
+        return -1;
+    }
+    sfs->checksums_enabled = 1;
+    return 0;
+}
+
+void checksum_disable() {       //Disk created without checksums
+    sfs->checksums_enabled = 0;
+}
+
+int checksum_verify(int start, int nblocks, void *buffer) {     //Returns how many blocks failed verification
+    int bad = 0;
+
+    if (!sfs->checksums_enabled) {
+        return 0;
+    }
+    for (int i = 0; i < nblocks; i++) {
+        int block = start + i;
+        if (!is_covered(block)) {
+            continue;
+        }
+        uint32_t crc = block_checksum((char *)buffer + i*BLOCK_SIZE);
+        if (sfs->checksums[block] == CHECKSUM_OPEN) {  //Its call never finished, whatever it left is current
+            sfs->checksums[block] = crc;
+            sfs->checksum_dirty[block / ENTRIES_PER_BLOCK] = 1;
+        }
+        else if (crc != sfs->checksums[block]) {
+            printf("SFS_API: CHECKSUM MISMATCH ON BLOCK %d\n", block);
+            bad++;
+        }
+    }
+    stats_checksum(nblocks, bad, 0);
+    return bad;
+}
+
+void checksum_open(int start, int nblocks) {    //Puts CHECKSUM_OPEN on disk for blocks about to be rewritten in place
+    unsigned char touched[CHECKSUM_BLOCKS] = {0};
+
+    if (!sfs->checksums_enabled) {
+        return;
+    }
+    for (int i = 0; i < nblocks; i++) {
+        int block = start + i;
+        if (!is_covered(block) || is_opened(block)) {
+            continue;                       //Already open since the last flush
+        }
+        sfs->checksum_opened[block/8] |= 1 << (block % 8);
+        touched[block / ENTRIES_PER_BLOCK] = 1;
+    }
+    for (int i = 0; i < CHECKSUM_BLOCKS; i++) {
+        if (!touched[i]) {
+            continue;
+        }
+        uint32_t *entries = disk_alloc(BLOCK_SIZE);
+        for (int j = 0; j < (int) ENTRIES_PER_BLOCK; j++) {
+            int block = i * ENTRIES_PER_BLOCK + j;
+            entries[j] = block < BLOCK_AMOUNT && is_opened(block) ? CHECKSUM_OPEN : sfs->checksums[block];
+        }
+        region_write(SFS_REGION_CHECKSUM, CHECKSUM_START + i, 1, entries);
+        free(entries);
+        stats_checksum(0, 0, 1);
+    }
+}
+
+void checksum_update(int start, int nblocks, void *buffer) {
+    if (!sfs->checksums_enabled) {
+        return;
+    }
+    for (int i = 0; i < nblocks; i++) {
+        int block = start + i;
+        if (!is_covered(block)) {
+            continue;
+        }
+        sfs->checksums[block] = block_checksum((char *)buffer + i*BLOCK_SIZE);
+        sfs->checksum_dirty[block / ENTRIES_PER_BLOCK] = 1;
+    }
+}
+
+void checksum_flush() {         //Writes dirty checksum blocks, adjacent ones in a single request
+    if (!sfs->checksums_enabled) {
+        return;
+    }
+    for (int i = 0; i < CHECKSUM_BLOCKS; i++) {
+        if (!sfs->checksum_dirty[i]) {
+            continue;
+        }
+        int run = 1;
+        while (i + run < CHECKSUM_BLOCKS && sfs->checksum_dirty[i + run]) {
+            run++;
+        }
+        region_write(SFS_REGION_CHECKSUM, CHECKSUM_START + i, run, &sfs->checksums[i * ENTRIES_PER_BLOCK]);
+        memset(&sfs->checksum_dirty[i], 0, run);
+        stats_checksum(0, 0, run);
+        i += run - 1;
+    }
+    memset(sfs->checksum_opened, 0, sizeof(sfs->checksum_opened));   //Every open entry was in a dirty block
+}
@@ -0,0 +1,214 @@
+/* ======================================================================== */
+/* sfs_compress:                                                            */
+/* File data is handled in chunks of CHUNK_BLOCKS logical blocks. A chunk   */
+/* is either raw (one block per logical block) or compressed with lz into   */
+/* fewer blocks. A compressed chunk keeps its blocks in the first slots of  */
+/* its pointer group, and the slot right after them holds the compressed    */
+/* length encoded as -(2 + length), so no extra metadata is needed and      */
+/* files written without compression read back unchanged.                   */
+/* Decompressed chunks are kept in a small LRU cache, so hot data is only   */
+/* decompressed once.                                                       */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "lz.h"
+#include "disk_emu.h"
+
+int chunk_is_compressed(int *slots, int n) {       //Returns the compressed length, 0 for a raw chunk
+    int p = 0;
+    while (p < n && slots[p] >= 0) {
+        p++;
+    }
+    if (p < n && slots[p] <= -2) {
+        return -slots[p] - 2;
+    }
+    return 0;
+}
+
+static chunk_entry *cache_find(int inode, int chunk) {
+    if (!sfs->chunk_cache_ready) {
+        chunk_cache_invalidate(-1);
+    }
+    for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++) {
+        if (sfs->chunk_cache[i].inode == inode && sfs->chunk_cache[i].chunk == chunk) {
+            sfs->chunk_cache[i].last_use = ++sfs->chunk_clock;
+            return &sfs->chunk_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static void cache_insert(int inode, int chunk, char *data, int size) {
+    chunk_entry *e = cache_find(inode, chunk);
+    if (!e) {
+        e = &sfs->chunk_cache[0];
+        for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++) {    //Free entry, or else the least recently used
+            if (sfs->chunk_cache[i].inode < 0) {
+                e = &sfs->chunk_cache[i];
+                break;
+            }
+            if (sfs->chunk_cache[i].last_use < e->last_use) {
+                e = &sfs->chunk_cache[i];
+            }
+        }
+        if (e->inode >= 0) {
+            stats_cache_evict(SFS_CACHE_CHUNK);
+        }
+    }
+    e->inode = inode;
+    e->chunk = chunk;
+    e->size = size;
+    e->last_use = ++sfs->chunk_clock;
+    memcpy(e->data, data, size);
+}
+
+static void cache_drop(int inode, int chunk) {
+    chunk_entry *e = cache_find(inode, chunk);
+    if (e) {
+        e->inode = -1;
+    }
+}
+
+void chunk_cache_invalidate(int inode) {       //-1 drops everything
+    for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++) {
+        if (inode < 0 || sfs->chunk_cache[i].inode == inode) {
+            sfs->chunk_cache[i].inode = -1;
+        }
+    }
+    sfs->chunk_cache_ready = 1;
+}
+
+/* ======================================================================== */
+/* chunk_read:                                                              */
+/* Brings logical blocks first..last of a chunk with n logical blocks into  */
+/* out (block b at out + b*BLOCK_SIZE). Raw chunks only read the blocks     */
+/* asked for, compressed ones are decompressed whole through the cache.     */
+/* ======================================================================== */
+int chunk_read(int inode, int chunk, int *slots, int n, char *out, int first, int last) {
+    int clen = chunk_is_compressed(slots, n);
+
+    if (clen == 0) {
+        for (int b = first; b <= last; b++) {
+            if (slots[b] < 0) {
+                memset(out + b*BLOCK_SIZE, 0, BLOCK_SIZE);
+                continue;
+            }
+            int run = 1;        //Blocks that follow each other on disk go in one request
+            while (b + run <= last && slots[b + run] == slots[b] + run) {
+                run++;
+            }
+            if (region_read(SFS_REGION_DATA, slots[b], run, out + b*BLOCK_SIZE) < 0) {
+                return -1;
+            }
+            b += run - 1;
+        }
+        return 0;
+    }
+
+    chunk_entry *e = cache_find(inode, chunk);
+    if (e && e->size >= n*BLOCK_SIZE) {
+        stats_cache(SFS_CACHE_CHUNK, 1, 0, 0);
+        memcpy(out + first*BLOCK_SIZE, e->data + first*BLOCK_SIZE, (last - first + 1) * BLOCK_SIZE);
+        return 0;
+    }
+    stats_cache(SFS_CACHE_CHUNK, 0, 1, 0);
+
+    int stored = size_to_blocks(clen);
+    char *packed = disk_alloc(stored * BLOCK_SIZE);
+    char *plain = disk_alloc(CHUNK_BYTES);
+    int result = 0;
+    for (int b = 0; b < stored && result == 0; b++) {
+        if (region_read(SFS_REGION_DATA, slots[b], 1, packed + b*BLOCK_SIZE) < 0) {
+            result = -1;
+        }
+    }
+    if (result == 0 && lz_decompress(packed, clen, plain, CHUNK_BYTES) != n*BLOCK_SIZE) {
+        printf("SFS_API: CORRUPT COMPRESSED CHUNK %d OF I-NODE %d\n", chunk, inode);
+        result = -1;
+    }
+    if (result == 0) {
+        cache_insert(inode, chunk, plain, n*BLOCK_SIZE);
+        memcpy(out + first*BLOCK_SIZE, plain + first*BLOCK_SIZE, (last - first + 1) * BLOCK_SIZE);
+    }
+    free(packed);
+    free(plain);
+    return result;
+}
+
+/* ======================================================================== */
+/* chunk_store:                                                             */
+/* Writes the whole plaintext of a chunk (new_n logical blocks). With       */
+/* compress set it is stored compressed when that saves at least a block.   */
+/* Blocks the chunk already owns are reused, extra ones are freed, missing  */
+/* ones allocated. Shared blocks are never reused, the chunk only drops its */
+/* reference, and in log mode no block is reused at all. The slots are     */
+/* only changed if every allocation worked.                                 */
+/* ======================================================================== */
+int chunk_store(int inode, int chunk, int *slots, int new_n, char *plain, int compress) {
+    char *packed = disk_alloc(CHUNK_BYTES);
+    memset(packed, 0, CHUNK_BYTES);
+    int clen = 0;
+
+    if (compress && new_n > 1) {
+        clen = lz_compress(plain, new_n*BLOCK_SIZE, packed, (new_n - 1)*BLOCK_SIZE);
+    }
+    int need = clen ? size_to_blocks(clen) : new_n;
+
+    int owned[CHUNK_BLOCKS], n_owned = 0;
+    int shared[CHUNK_BLOCKS], n_shared = 0;
+    for (int i = 0; i < CHUNK_BLOCKS; i++) {
+        if (slots[i] >= 0 && (block_is_shared(slots[i]) || log_active())) {  //Other files keep these, or the log moves the chunk
+            shared[n_shared++] = slots[i];
+        }
+        else if (slots[i] >= 0) {
+            owned[n_owned++] = slots[i];
+        }
+    }
+
+    int blocks[CHUNK_BLOCKS];
+    for (int i = 0; i < need; i++) {
+        if (i < n_owned) {
+            blocks[i] = owned[i];
+            continue;
+        }
+        blocks[i] = get_free_block();
+        if (blocks[i] < 0) {
+            for (int j = n_owned; j < i; j++) {     //Give back what was taken so far
+                set_bit(blocks[j]);
+            }
+            free(packed);
+            return -1;
+        }
+        remove_bit(blocks[i]);
+    }
+    for (int i = need; i < n_owned; i++) {
+        block_release(owned[i]);
+    }
+    for (int i = 0; i < n_shared; i++) {
+        block_release(shared[i]);
+    }
+
+    for (int i = 0; i < CHUNK_BLOCKS; i++) {
+        slots[i] = i < need ? blocks[i] : -1;
+    }
+    if (clen) {
+        slots[need] = -(2 + clen);
+    }
+
+    char *source = clen ? packed : plain;
+    for (int i = 0; i < need; i++) {
+        region_write(SFS_REGION_DATA, blocks[i], 1, source + i*BLOCK_SIZE);
+    }
+
+    if (clen) {
+        cache_insert(inode, chunk, plain, new_n*BLOCK_SIZE);
+    }
+    else {
+        cache_drop(inode, chunk);
+    }
+    free(packed);
+    return 0;
+}
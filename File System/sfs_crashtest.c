@@ -0,0 +1,416 @@
+/* ======================================================================== */
+/* sfs_crashtest:                                                           */
+/* Crash-consistency driver built on the disk_emu fault layer. A seeded     */
+/* workload of writes, appends, preallocations and removes (each one opens, */
+/* works on and closes a file) is run once to count its write requests,     */
+/* then again for every crash point K: power is lost at write K, the        */
+/* instance is thrown away like a process that died, and a new one mounts   */
+/* the image with mksfs(0) and checks it. Usage:                            */
+/*     sfs_crashtest [-s seed] [-n ops] [-e every] [-t] [-c] [-d] [-l]      */
+/*                   [-r read_error_rate] [-o prefix] [-v]                  */
+/* -t tears the write power is lost during, -c, -d and -l turn on           */
+/* compression, dedup and log mode, -o saves the image of every corrupt     */
+/* crash point as prefix.K for sfs_fsck. With -r no power is lost: reads    */
+/* fail at random, files an operation failed on are left out and the rest   */
+/* are checked. A crash point is:                                           */
+/*     - clean:   every file is as the finished operations left it and the  */
+/*                one the crash interrupted is either before or after it    */
+/*     - torn:    the interrupted operation left its file in neither state  */
+/*     - corrupt: any other file differs or can't be read, the mount fails, */
+/*                the directory has an unknown name, or a block a file uses */
+/*                is free or used twice without being shared                */
+/* In log mode the image is as the last checkpoint left it, which can be    */
+/* any number of operations back, so "the finished operations" are the      */
+/* first j of them for some j, and the interrupted one is operation j.      */
+/* Exits with 1 if any crash point is corrupt.                              */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#define FILES 6
+#define FILE_MAX (48*1024)      //Keeps every file well inside the disk
+#define IMAGE "Tairov_crash"
+
+enum { OP_WRITE, OP_APPEND, OP_FALLOCATE, OP_REMOVE };
+
+typedef struct {
+    int type;
+    int file;
+    int offset;
+    int length;
+    int pieces;                 //Appends: fwrite calls the length is split into
+    unsigned int data;          //Seed of the bytes written
+} crash_op;
+
+typedef struct {
+    int exists;
+    int size;
+    char data[FILE_MAX];
+} model_file;
+
+FILE *report;                   //Where results go, SFS chatter goes to /dev/null
+unsigned int seed = 1;
+int op_count = 60;
+int verbose = 0;
+int log_mode = 0;
+crash_op *ops;
+model_file before[FILES], after[FILES];
+
+static char *file_name(int f) {
+    static char names[FILES][8];
+    sprintf(names[f], "/c%d", f);
+    return names[f];
+}
+
+static char data_byte(const crash_op *op, int i) {
+    return (char) (((op->data + i) * 2654435761u) >> 24);
+}
+
+static void apply(model_file *files, const crash_op *op) {     //What an operation does to the model
+    model_file *m = &files[op->file];
+    int end = op->offset + op->length;
+
+    if (op->type == OP_REMOVE) {
+        m->exists = 0;
+        m->size = 0;
+        return;
+    }
+    if (!m->exists) {
+        m->exists = 1;
+        m->size = 0;
+    }
+    if (end > m->size) {
+        memset(m->data + m->size, 0, end - m->size);
+        m->size = end;
+    }
+    if (op->type != OP_FALLOCATE) {
+        for (int i = 0; i < op->length; i++) {
+            m->data[op->offset + i] = data_byte(op, i);
+        }
+    }
+}
+
+static void make_workload() {
+    static model_file files[FILES];
+    srand(seed);
+    memset(files, 0, sizeof(files));
+    ops = calloc(op_count, sizeof(crash_op));
+    for (int i = 0; i < op_count; i++) {
+        crash_op *op = &ops[i];
+        model_file *m = &files[op->file = rand() % FILES];
+        int kind = rand() % 100;
+        op->data = (unsigned int) rand();
+        op->offset = m->size;
+        if (kind < 20 && m->exists) {
+            op->type = OP_REMOVE;
+        }
+        else if (kind < 45 && m->size < FILE_MAX - 4096) {
+            op->type = OP_APPEND;
+            op->pieces = 1 + rand() % 40;
+            op->length = op->pieces * (1 + rand() % 100);
+        }
+        else if (kind < 55 && m->size < FILE_MAX - 8192) {
+            op->type = OP_FALLOCATE;
+            op->offset = rand() % (m->size + 1);
+            op->length = 1 + rand() % 8192;
+        }
+        else {
+            op->type = OP_WRITE;
+            op->offset = rand() % (m->size < FILE_MAX ? m->size + 1 : FILE_MAX);
+            op->length = 1 + rand() % (FILE_MAX - op->offset < 8000 ? FILE_MAX - op->offset : 8000);
+        }
+        apply(files, op);
+    }
+}
+
+static int run_op(const crash_op *op) {        //-1 if any call of it failed
+    char buf[FILE_MAX];
+    int failed = 0;
+
+    if (op->type == OP_REMOVE) {
+        return sfs_remove(file_name(op->file)) < 0 ? -1 : 0;
+    }
+    for (int i = 0; i < op->length; i++) {
+        buf[i] = data_byte(op, i);
+    }
+    int fd = sfs_fopen(file_name(op->file));
+    if (fd < 0) {
+        return -1;
+    }
+    if (op->type == OP_FALLOCATE) {
+        failed |= sfs_fallocate(fd, op->offset, op->length) < 0;
+    }
+    else if (op->type == OP_APPEND) {
+        int piece = op->length / op->pieces;
+        for (int p = 0; p < op->pieces; p++) {
+            failed |= sfs_fwrite(fd, buf + p * piece, piece) != piece;
+        }
+    }
+    else {
+        failed |= sfs_fseek(fd, op->offset) < 0;
+        failed |= sfs_fwrite(fd, buf, op->length) != op->length;
+    }
+    failed |= sfs_fclose(fd) < 0;
+    return failed ? -1 : 0;
+}
+
+static int read_file(int f, char *buf) {        //Size, -1 if missing, -2 if it can't be read
+    int size = sfs_getfilesize(file_name(f));
+    if (size < 0) {
+        return -1;
+    }
+    int fd = sfs_fopen(file_name(f));
+    if (fd < 0) {
+        return -2;
+    }
+    int result = sfs_fseek(fd, 0) == 0 && sfs_fread(fd, buf, size) == size ? size : -2;
+    sfs_fclose(fd);
+    return result;
+}
+
+static int matches(const model_file *m, const char *buf, int size) {
+    return m->exists ? size == m->size && memcmp(buf, m->data, size) == 0 : size == -1;
+}
+
+/* ======================================================================== */
+/* check_structure:                                                         */
+/* Every block a file uses is marked in use and, unless its reference count */
+/* says it is shared, used only once. Blocks leaked by a crash (in use with */
+/* no owner) are allowed.                                                   */
+/* ======================================================================== */
+static int check_structure(char *why) {
+    static unsigned char owner[BLOCK_AMOUNT];
+    int slots[MAX_FILE_BLOCKS];
+
+    memset(owner, 0, sizeof(owner));
+    for (int i = 1; i < INODE_AMOUNT; i++) {
+        i_node *inode = &sfs->i_node_table[i];
+        if (inode->size < 0) {
+            continue;
+        }
+        int count = load_slots(inode, slots);
+        if (count < 0) {
+            sprintf(why, "i-Node %d's indirect block can't be read", i);
+            return -1;
+        }
+        slots[count] = inode->indirect_pointers;
+        for (int s = 0; s <= count; s++) {
+            int b = slots[s];
+            if (b < 0) {
+                continue;
+            }
+            if (b >= BLOCK_AMOUNT || (sfs->bitmap[b/8] >> (b % 8)) & 1) {
+                sprintf(why, "i-Node %d uses block %d, which is free", i, b);
+                return -1;
+            }
+            if (owner[b]++ && !block_is_shared(b)) {
+                sprintf(why, "block %d is used twice", b);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* ======================================================================== */
+/* compare:                                                                 */
+/* Compares the files read back to the model after the first done           */
+/* operations, allowing the file of operation done (if it was interrupted)  */
+/* to be before or after it. Returns 0 clean, 1 torn, 2 corrupt.            */
+/* ======================================================================== */
+static int compare(int done, int interrupted, int skip[FILES], int *sizes, char (*contents)[FILE_MAX], char *why) {
+    int result = 0;
+
+    memset(before, 0, sizeof(before));
+    for (int i = 0; i < done; i++) {
+        apply(before, &ops[i]);
+    }
+    memcpy(after, before, sizeof(after));
+    if (interrupted) {
+        apply(after, &ops[done]);
+    }
+    for (int f = 0; f < FILES && result < 2; f++) {
+        if (skip[f]) {
+            continue;
+        }
+        int size = sizes[f];
+        int in_flight = interrupted && ops[done].file == f;
+        if (size != -2 && (matches(&before[f], contents[f], size) || (in_flight && matches(&after[f], contents[f], size)))) {
+            continue;
+        }
+        if (in_flight) {
+            sprintf(why, "%s was torn by operation %d%s", file_name(f), done, size == -2 ? " and can't be read" : "");
+            result = 1;
+        }
+        else {
+            sprintf(why, "%s %s", file_name(f), size == -2 ? "can't be read" : "differs from what finished operations left");
+            result = 2;
+        }
+    }
+    return result;
+}
+
+/* ======================================================================== */
+/* verify:                                                                  */
+/* Mounts the image in a new instance and compares it to the model after    */
+/* the first done operations, allowing file skip to be anything and the     */
+/* file of operation done (if it was interrupted) to be before or after it. */
+/* In log mode the model is the best match after any of the first j         */
+/* operations, with operation j interrupted. Returns 0 clean, 1 torn, 2     */
+/* corrupt (a disk that can't be mounted is corrupt).                       */
+/* ======================================================================== */
+static int verify(int done, int interrupted, int skip[FILES], char *why) {
+    static char contents[FILES][FILE_MAX];
+    int sizes[FILES];
+    char name[MAXFILENAME + 1], other[256];
+    int result, cursor = 0;
+
+    sfs_t *fs = sfs_create(IMAGE);
+    sfs_select(fs);
+    if (mksfs(0) < 0) {
+        strcpy(why, "the mount failed");
+        sfs_destroy(fs);
+        return 2;
+    }
+    for (int f = 0; f < FILES; f++) {
+        sizes[f] = skip[f] ? -1 : read_file(f, contents[f]);
+    }
+    result = compare(done, interrupted, skip, sizes, contents, why);
+    for (int j = done + interrupted - 1; log_mode && j >= 0 && result > 0; j--) {   //Checkpoints further back
+        int r = compare(j, 1, skip, sizes, contents, other);
+        if (r < result) {
+            result = r;
+            strcpy(why, other);
+        }
+    }
+    while (result < 2 && sfs_readdir(&cursor, name) > 0) {
+        if (strncmp(name, "/c", 2) != 0 || atoi(name + 2) >= FILES) {
+            sprintf(why, "unknown file %s in the directory", name);
+            result = 2;
+        }
+    }
+    if (result < 2 && check_structure(why) < 0) {
+        result = 2;
+    }
+    sfs_destroy(fs);
+    return result;
+}
+
+static void start_instance(sfs_t **fs, int compress, int dedup) {
+    *fs = sfs_create(IMAGE);
+    sfs_select(*fs);
+    mksfs(1);
+    sfs_set_compression(compress);
+    sfs_set_dedup(dedup);
+    sfs_set_log(log_mode);
+}
+
+int main(int argc, char **argv) {
+    int opt, every = 1, torn = 0, compress = 0, dedup = 0;
+    double read_errors = 0;
+    char *prefix = NULL;
+    char why[256], saved[4096];
+    int skip[FILES] = { 0 };
+    disk_counters c;
+    disk_faults faults;
+    sfs_t *fs;
+
+    while ((opt = getopt(argc, argv, "s:n:e:tcdlr:o:v")) != -1) {
+        switch (opt) {
+            case 's': seed = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'n': op_count = atoi(optarg); break;
+            case 'e': every = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 't': torn = 1; break;
+            case 'c': compress = 1; break;
+            case 'd': dedup = 1; break;
+            case 'l': log_mode = 1; break;
+            case 'r': read_errors = atof(optarg); break;
+            case 'o': prefix = optarg; break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-s seed] [-n ops] [-e every] [-t] [-c] [-d] [-l] [-r read_error_rate] "
+                        "[-o prefix] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+    report = fdopen(dup(fileno(stdout)), "w");      //Keep the report clean of SFS messages
+    freopen("/dev/null", "w", stdout);
+    make_workload();
+
+    if (read_errors > 0) {          //One run with failing reads
+        memset(&faults, 0, sizeof(faults));
+        faults.seed = seed;
+        faults.read_error_rate = read_errors;
+        start_instance(&fs, compress, dedup);
+        set_disk_faults(&faults);
+        int failed = 0;
+        for (int i = 0; i < op_count; i++) {
+            if (run_op(&ops[i]) < 0) {
+                skip[ops[i].file] = 1;      //Its state is unknown from here on
+                failed++;
+            }
+        }
+        get_disk_counters(&c);
+        sfs_destroy(fs);
+        int result = verify(op_count, 0, skip, why);
+        fprintf(report, "read errors: %d operations, %d failed, %ld faults injected: %s%s\n", op_count, failed,
+                c.faults, result ? "corrupt, " : "clean", result ? why : "");
+        fclose(report);
+        unlink(IMAGE);
+        return result == 2;
+    }
+
+    start_instance(&fs, compress, dedup);   //Dry run: how many writes the workload issues
+    reset_disk_counters();
+    for (int i = 0; i < op_count; i++) {
+        run_op(&ops[i]);
+    }
+    get_disk_counters(&c);
+    sfs_destroy(fs);
+    long writes = c.writes;
+
+    int clean = 0, torn_points = 0, corrupt = 0;
+    for (long k = 1; k <= writes; k += every) {
+        memset(&faults, 0, sizeof(faults));
+        faults.seed = seed + (unsigned int) k;
+        faults.crash_after_writes = k;
+        faults.torn_writes = torn;
+        start_instance(&fs, compress, dedup);
+        set_disk_faults(&faults);
+        int done = 0;
+        while (done < op_count) {
+            run_op(&ops[done]);
+            if (disk_crashed()) {
+                break;
+            }
+            done++;
+        }
+        if (prefix) {
+            snprintf(saved, sizeof(saved), "%s.%ld", prefix, k);
+            disk_save_image(saved);
+        }
+        sfs_destroy(fs);        //Whatever it still writes is lost
+
+        int result = verify(done, done < op_count, skip, why);
+        clean += result == 0;
+        torn_points += result == 1;
+        corrupt += result == 2;
+        if (result == 2 || (result == 1 && verbose)) {
+            fprintf(report, "crash at write %ld (operation %d): %s: %s\n", k, done,
+                    result == 2 ? "corrupt" : "torn", why);
+        }
+        if (prefix && result < 2) {
+            unlink(saved);
+        }
+    }
+    fprintf(report, "%ld writes, %d crash points: %d clean, %d torn, %d corrupt\n", writes,
+            clean + torn_points + corrupt, clean, torn_points, corrupt);
+    fclose(report);
+    unlink(IMAGE);
+    return corrupt > 0;
+}
@@ -0,0 +1,191 @@
+/* ======================================================================== */
+/* sfs_dedup:                                                               */
+/* Block reference counts and content-addressed deduplication.              */
+/* The reference count table lives in the refcount blocks just before the   */
+/* checksum table and is cached in memory. A count of 0 or 1 means the      */
+/* block has a single owner and the bitmap alone decides whether it is      */
+/* free. A block with a count above 1 is shared: releasing it only drops    */
+/* the count, and writing to it first copies it (see dedup_write).          */
+/* With SFS_FEATURE_DEDUP on, every full data block written is looked up in */
+/* a fingerprint index (64-bit hash plus CRC32C of the content). A match    */
+/* makes the file point at the existing block, so writing duplicate data   */
+/* costs a metadata update and no data block. The index is kept in memory   */
+/* only and starts empty at mount, blocks written before the mount are not  */
+/* matched again but stay correctly shared through their counts.            */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "crc32c.h"
+
+#define ENTRIES_PER_BLOCK (BLOCK_SIZE/sizeof(uint16_t))
+
+static uint64_t block_hash(const char *block) {     //Multiply-rotate over 8-byte words
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < BLOCK_SIZE; i += 8) {
+        uint64_t w;
+        memcpy(&w, block + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static void mark_dirty(int block) {
+    sfs->refcount_dirty[block / ENTRIES_PER_BLOCK] = 1;
+}
+
+void dedup_reset() {            //Empties the fingerprint index
+    memset(sfs->block_indexed, 0, sizeof(sfs->block_indexed));
+    for (int i = 0; i < INDEX_BUCKETS; i++) {
+        sfs->index_head[i] = -1;
+    }
+}
+
+void refcount_format() {        //Fresh disk: no block is shared, the zeroed table is already on disk
+    memset(sfs->refcounts, 0, sizeof(sfs->refcounts));
+    memset(sfs->refcount_dirty, 0, sizeof(sfs->refcount_dirty));
+    dedup_reset();
+}
+
+int refcount_load() {           //Existing disk: bring the table into memory, -1 if it can't be read
+    memset(sfs->refcount_dirty, 0, sizeof(sfs->refcount_dirty));
+    dedup_reset();
+    if (region_read(SFS_REGION_REFCOUNT, REFCOUNT_START, REFCOUNT_BLOCKS, sfs->refcounts) < 0) {
+        memset(sfs->refcounts, 0, sizeof(sfs->refcounts));
+        return -1;
+    }
+    return 0;
+}
+
+void refcount_flush() {         //Writes dirty refcount blocks, adjacent ones in a single request
+    for (int i = 0; i < REFCOUNT_BLOCKS; i++) {
+        if (!sfs->refcount_dirty[i]) {
+            continue;
+        }
+        int run = 1;
+        while (i + run < REFCOUNT_BLOCKS && sfs->refcount_dirty[i + run]) {
+            run++;
+        }
+        region_write(SFS_REGION_REFCOUNT, REFCOUNT_START + i, run, &sfs->refcounts[i * ENTRIES_PER_BLOCK]);
+        memset(&sfs->refcount_dirty[i], 0, run);
+        i += run - 1;
+    }
+}
+
+void dedup_forget(int start, int nblocks) {     //Content of these blocks changes, drop them from the index
+    for (int block = start; block < start + nblocks; block++) {
+        if (block < 0 || block >= BLOCK_AMOUNT || !sfs->block_indexed[block]) {
+            continue;
+        }
+        int *link = &sfs->index_head[sfs->block_fp[block].hash % INDEX_BUCKETS];
+        while (*link != block) {
+            link = &sfs->index_next[*link];
+        }
+        *link = sfs->index_next[block];
+        sfs->block_indexed[block] = 0;
+    }
+}
+
+static void index_insert(int block, fingerprint *fp) {
+    int bucket = fp->hash % INDEX_BUCKETS;
+    sfs->block_fp[block] = *fp;
+    sfs->block_indexed[block] = 1;
+    sfs->index_next[block] = sfs->index_head[bucket];
+    sfs->index_head[bucket] = block;
+}
+
+static int index_find(fingerprint *fp) {
+    for (int b = sfs->index_head[fp->hash % INDEX_BUCKETS]; b >= 0; b = sfs->index_next[b]) {
+        if (sfs->block_fp[b].hash == fp->hash && sfs->block_fp[b].crc == fp->crc) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+int block_is_shared(int block) {
+    return sfs->refcounts[block] > 1;
+}
+
+void block_share(int block) {   //One more owner for the block
+    sfs->refcounts[block] = sfs->refcounts[block] ? sfs->refcounts[block] + 1 : 2;
+    mark_dirty(block);
+}
+
+void block_release(int block) { //One owner less, the block is freed with its last owner
+    if (sfs->refcounts[block] > 1) {
+        sfs->refcounts[block]--;
+        mark_dirty(block);
+        return;
+    }
+    if (sfs->refcounts[block]) {
+        sfs->refcounts[block] = 0;
+        mark_dirty(block);
+    }
+    dedup_forget(block, 1);
+    set_bit(block);
+}
+
+/* ======================================================================== */
+/* dedup_write:                                                             */
+/* Stores one full block of file data for the slot it belongs to.           */
+/*     - With dedup on and an identical block indexed, point the slot at    */
+/*       it and release the block the slot had                              */
+/*     - A slot pointing at a shared block gets a block of its own first,   */
+/*       so the other owners keep their data                                */
+/*     - Otherwise write in place, allocating if the slot has no block      */
+/*       (log mode never writes in place, the block always moves)           */
+/* Returns -1 if no block could be allocated, the slot is then unchanged.   */
+/* ======================================================================== */
+int dedup_write(int *slot, char *block) {
+    fingerprint fp;
+    int dedup = (sfs->features & SFS_FEATURE_DEDUP) != 0;
+
+    if (dedup) {
+        fp.hash = block_hash(block);
+        fp.crc = crc32c(0, block, BLOCK_SIZE);
+        int match = index_find(&fp);
+        if (match >= 0) {
+            stats_dedup(1, 0, 0);
+            if (match != *slot) {
+                block_share(match);
+                if (*slot >= 0) {
+                    block_release(*slot);
+                }
+                *slot = match;
+            }
+            return 0;
+        }
+        stats_dedup(0, 1, 0);
+    }
+
+    int shared = *slot >= 0 && block_is_shared(*slot);
+    if (shared || (*slot >= 0 && log_active())) {   //Copy on write, in log mode for every block
+        int copy = get_free_block();
+        if (copy < 0) {
+            return -1;
+        }
+        remove_bit(copy);
+        block_release(*slot);
+        *slot = copy;
+        stats_dedup(0, 0, shared);
+    }
+    else if (*slot < 0) {
+        int fresh = get_free_block();
+        if (fresh < 0) {
+            return -1;
+        }
+        remove_bit(fresh);
+        *slot = fresh;
+    }
+
+    region_write(SFS_REGION_DATA, *slot, 1, block);
+    if (dedup) {
+        index_insert(*slot, &fp);
+    }
+    return 0;
+}
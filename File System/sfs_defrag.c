@@ -0,0 +1,245 @@
+/* ======================================================================== */
+/* sfs_defrag:                                                              */
+/* Fragmentation reporting and an incremental online defragmenter.          */
+/* A file's extents are the runs of consecutive disk blocks its data        */
+/* blocks form in file order (the indirect block is not counted).           */
+/* sfs_defrag_step picks a fragmented file, finds a free run big enough     */
+/* for all its data blocks and copies the blocks there in file order,       */
+/* spending at most the given number of block reads and writes per call.    */
+/* A file being moved is continued on the next call; every call checks      */
+/* again that the file and the rest of its target run are as they were and */
+/* gives the move up otherwise, so writes, removes and allocations may      */
+/* happen in between. Each block is copied before its pointer is switched   */
+/* and released after, so the file reads the same at every point. Open      */
+/* files take part: descriptors and the chunk cache refer to i-Nodes, not   */
+/* blocks. Blocks shared with a snapshot or through dedup are never moved.  */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+static int is_free(int block) {
+    return (sfs->bitmap[block/8] >> (block % 8)) & 1;
+}
+
+static int file_blocks(i_node *inode, int *slots, int *blocks) {    //Data blocks in file order, -1 if they can't be read
+    int n = 0;
+    if (inode->size <= 0 || inode->link_cnt == 0) {
+        return 0;
+    }
+    int count = load_slots(inode, slots);
+    if (count < 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (slots[i] >= 0) {
+            blocks[n++] = slots[i];
+        }
+    }
+    return n;
+}
+
+static int count_extents(int *blocks, int n) {
+    int extents = n > 0;
+    for (int i = 1; i < n; i++) {
+        extents += blocks[i] != blocks[i-1] + 1;
+    }
+    return extents;
+}
+
+static const char *file_name(int inode) {
+    for (int i = 0; i < DIR_AMOUNT; i++) {
+        if (sfs->root_directory[i].i_node_num == inode) {
+            return sfs->root_directory[i].file_name;
+        }
+    }
+    return "?";
+}
+
+/* ======================================================================== */
+/* frag_stats / frag_report:                                                */
+/* Extents of every file and the histogram of free runs. The report is     */
+/* text, one line per file with data blocks and then the summary; it       */
+/* behaves like snprintf (returns the full length).                         */
+/* ======================================================================== */
+void frag_stats(sfs_frag_info *out) {
+    int slots[MAX_FILE_BLOCKS], blocks[MAX_FILE_BLOCKS];
+
+    memset(out, 0, sizeof(sfs_frag_info));
+    for (int i = 1; i < INODE_AMOUNT; i++) {
+        int n = file_blocks(&sfs->i_node_table[i], slots, blocks);
+        if (n <= 0) {
+            continue;
+        }
+        int extents = count_extents(blocks, n);
+        out->files++;
+        out->blocks += n;
+        out->extents += extents;
+        out->fragmented_files += extents > 1;
+    }
+    for (int b = 0; b < BLOCK_AMOUNT; ) {
+        if (!is_free(b)) {
+            b++;
+            continue;
+        }
+        int run = 1;
+        while (b + run < BLOCK_AMOUNT && is_free(b + run)) {
+            run++;
+        }
+        int bucket = 0;
+        for (int r = run; r > 1 && bucket < SFS_FRAG_BUCKETS - 1; r >>= 1) {   //floor(log2(run))
+            bucket++;
+        }
+        out->free_blocks += run;
+        out->free_extents++;
+        out->free_hist[bucket]++;
+        if (run > out->largest_free_extent) {
+            out->largest_free_extent = run;
+        }
+        b += run;
+    }
+}
+
+int frag_report(char *buf, int size) {
+    int slots[MAX_FILE_BLOCKS], blocks[MAX_FILE_BLOCKS];
+    char line[512];
+    int len = 0;
+    sfs_frag_info info;
+
+    #define EMIT(...) do {                                                  \
+        int emitted = snprintf(line, sizeof(line), __VA_ARGS__);            \
+        if (buf && len < size) {                                            \
+            snprintf(buf + len, size - len, "%s", line);                    \
+        }                                                                   \
+        len += emitted;                                                     \
+    } while (0)
+
+    EMIT("# file blocks extents\n");
+    for (int i = 1; i < INODE_AMOUNT; i++) {
+        int n = file_blocks(&sfs->i_node_table[i], slots, blocks);
+        if (n > 0) {
+            EMIT("file %s %d %d\n", file_name(i), n, count_extents(blocks, n));
+        }
+    }
+    frag_stats(&info);
+    EMIT("# files blocks extents fragmented_files\n");
+    EMIT("files %d %d %d %d\n", info.files, info.blocks, info.extents, info.fragmented_files);
+    EMIT("# free_blocks free_extents largest_free_extent hist_log2_blocks\n");
+    EMIT("free %d %d %d", info.free_blocks, info.free_extents, info.largest_free_extent);
+    int last = SFS_FRAG_BUCKETS - 1;
+    while (last > 0 && info.free_hist[last] == 0) {
+        last--;
+    }
+    for (int b = 0; b <= last; b++) {
+        EMIT(" %d", info.free_hist[b]);
+    }
+    EMIT("\n");
+    #undef EMIT
+    return len;
+}
+
+/* ======================================================================== */
+/* move_blocks:                                                             */
+/* Continues the move of the current file: copies up to budget/2 blocks     */
+/* to their place in the target run. Returns the blocks copied, -1 if the   */
+/* move has to be given up.                                                 */
+/* ======================================================================== */
+static int move_blocks(int budget) {
+    int inode_index = sfs->defrag_inode;
+    i_node *inode = &sfs->i_node_table[inode_index];
+    int slots[MAX_FILE_BLOCKS], old_slots[MAX_FILE_BLOCKS], blocks[MAX_FILE_BLOCKS];
+
+    int n = file_blocks(inode, slots, blocks);
+    if (n != sfs->defrag_blocks) {          //Written or removed since the move started
+        return -1;
+    }
+    memcpy(old_slots, slots, sizeof(slots));
+
+    int moved = 0, old_indirect = inode->indirect_pointers;
+    char *block = disk_alloc(BLOCK_SIZE);
+    for (int i = 0, rank = 0; i < inode->link_cnt && moved < budget / 2; i++) {
+        if (slots[i] < 0) {
+            continue;
+        }
+        int target = sfs->defrag_target + rank++;
+        if (slots[i] == target) {
+            continue;
+        }
+        if (!is_free(target) || block_is_shared(slots[i])) {
+            moved = moved ? moved : -1;     //Keep what was done, give the rest up
+            break;
+        }
+        if (region_read(SFS_REGION_DATA, slots[i], 1, block) < 0 || (i >= 12 && own_indirect(inode, old_indirect) < 0)) {
+            moved = moved ? moved : -1;
+            break;
+        }
+        remove_bit(target);
+        region_write(SFS_REGION_DATA, target, 1, block);
+        block_release(slots[i]);
+        slots[i] = target;
+        moved++;
+    }
+    free(block);
+
+    if (moved > 0 || inode->indirect_pointers != old_indirect) {
+        store_slots(inode, slots, old_slots, inode->link_cnt, old_indirect);
+        write_inode(inode_index);
+        write_bitmap();
+    }
+    return moved;
+}
+
+/* ======================================================================== */
+/* defrag_step:                                                             */
+/* Spends up to budget block reads and writes on defragmenting. Returns the */
+/* blocks moved, 0 once no file can be improved any more.                   */
+/* ======================================================================== */
+int defrag_step(int budget) {
+    int slots[MAX_FILE_BLOCKS], blocks[MAX_FILE_BLOCKS];
+    int moved = 0;
+
+    if (sfs->read_only) {
+        printf("SFS_API: CANNOT DEFRAGMENT; SNAPSHOT IS READ-ONLY.\n");
+        return -1;
+    }
+    if (budget < 2) {
+        printf("SFS_API: CANNOT DEFRAGMENT; BUDGET TOO SMALL.\n");
+        return -1;
+    }
+
+    for (int looked = 0; moved * 2 + 2 <= budget && looked < INODE_AMOUNT; ) {
+        if (sfs->defrag_inode > 0) {        //A move in progress
+            int done = move_blocks(budget - moved * 2);
+            if (done > 0) {
+                moved += done;
+            }
+            int n = file_blocks(&sfs->i_node_table[sfs->defrag_inode], slots, blocks);
+            if (done <= 0 || (n > 0 && blocks[0] == sfs->defrag_target && count_extents(blocks, n) == 1)) {
+                sfs->defrag_inode = 0;      //Finished or given up
+            }
+            continue;
+        }
+
+        int i = sfs->defrag_scan = sfs->defrag_scan % (INODE_AMOUNT - 1) + 1;
+        looked++;
+        int n = file_blocks(&sfs->i_node_table[i], slots, blocks);
+        if (n < 2 || count_extents(blocks, n) == 1) {
+            continue;
+        }
+        int shared = 0;
+        for (int b = 0; b < n; b++) {
+            shared |= block_is_shared(blocks[b]);
+        }
+        int target = shared ? -1 : get_free_run(n);
+        if (target < 0) {
+            continue;
+        }
+        sfs->defrag_inode = i;
+        sfs->defrag_target = target;
+        sfs->defrag_blocks = n;
+    }
+    return moved;
+}
@@ -0,0 +1,525 @@
+/* ======================================================================== */
+/* sfs_fsck:                                                                */
+/* Offline consistency checker for SFS images. Usage:                       */
+/*     sfs_fsck [-j threads] [-r] [-v] [image]                              */
+/* The image (Tairov_sfs by default) is mapped read-only and checked for:   */
+/*     - every i-Node (live and in snapshots) having block pointers that    */
+/*       match its size and point into the data area                        */
+/*     - every block being claimed once, or by as many owners as its        */
+/*       reference count says                                               */
+/*     - the bitmap marking exactly the claimed blocks as used              */
+/*     - directory entries naming allocated i-Nodes, each in-use i-Node     */
+/*       named once                                                         */
+/*     - data matching the block checksums                                  */
+/* I-Nodes are split across threads, and so are the checksummed blocks.    */
+/* With -r the bitmap and reference count table are rebuilt from the       */
+/* claims found. Exit status follows fsck: 0 clean, 1 errors corrected,     */
+/* 4 errors left, 8 the image could not be checked.                         */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sfs_api.h"
+#include "crc32c.h"
+
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_FAILED 8
+
+#define DATA_START 1            //First block after the superblock, the i-Node table blocks are allocated among data
+
+//An i-Node table to check, the live one or a snapshot's
+typedef struct {
+    i_node *inodes;
+    dir_entry *directory;
+    char name[32];
+} table_view;
+
+//Share of the work given to one thread
+typedef struct {
+    int first, last;        //Work items [first, last)
+} work_range;
+
+char *image;                            //The whole image, mapped
+super_block superblock;
+table_view views[1 + SFS_MAX_SNAPSHOTS];
+int n_views = 0;
+int refs[BLOCK_AMOUNT];                 //File references (data and indirect) to every block
+int meta_claims[BLOCK_AMOUNT];          //Metadata structures claiming every block
+int threads = 0;
+int repair = 0;
+int verbose = 0;
+int errors = 0;                         //Problems found, fixable ones included
+int fixable = 0;                        //Problems -r repairs
+int warnings = 0;
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *block_at(int block) {
+    return image + (long) block * BLOCK_SIZE;
+}
+
+static int blocks_for(int size) {
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static void report(int *counter, const char *kind, const char *fmt, ...) {
+    va_list args;
+    pthread_mutex_lock(&report_lock);
+    (*counter)++;
+    printf("%s: ", kind);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    pthread_mutex_unlock(&report_lock);
+}
+
+#define ERROR(...) report(&errors, "ERROR", __VA_ARGS__)
+#define WARNING(...) report(&warnings, "WARNING", __VA_ARGS__)
+
+static void copy_blocks(int *blocks, char *out, int size) {    //Gathers a structure spread over listed blocks
+    for (int i = 0; i * BLOCK_SIZE < size; i++) {
+        int n = size - i*BLOCK_SIZE < BLOCK_SIZE ? size - i*BLOCK_SIZE : BLOCK_SIZE;
+        memcpy(out + i*BLOCK_SIZE, block_at(blocks[i]), n);
+    }
+}
+
+static int claim_meta(int block, const char *what) {
+    if (block < 0 || block >= BLOCK_AMOUNT) {
+        ERROR("%s points at block %d, outside the disk", what, block);
+        return -1;
+    }
+    meta_claims[block]++;
+    return 0;
+}
+
+/* ======================================================================== */
+/* load_views:                                                              */
+/* Checks the superblock, claims the fixed metadata and brings the live     */
+/* tables and those of every snapshot into memory.                          */
+/* ======================================================================== */
+static int load_views() {
+    int table_blocks[DIRECTORY_BLOCKS];
+
+    memcpy(&superblock, block_at(0), sizeof(superblock));
+    if (memcmp(superblock.magic, SFS_MAGIC, strlen(SFS_MAGIC)) != 0) {
+        printf("sfs_fsck: not an SFS image of this version (magic %.16s)\n", superblock.magic);
+        return -1;
+    }
+    if (superblock.block_size != BLOCK_SIZE || superblock.file_system_size != BLOCK_AMOUNT ||
+        superblock.i_node_table_length < 1 || superblock.i_node_table_length > INODE_TABLE_BLOCKS) {
+        printf("sfs_fsck: geometry %d x %d blocks, %d i-Node blocks does not match this build\n",
+               superblock.file_system_size, superblock.block_size, superblock.i_node_table_length);
+        return -1;
+    }
+
+    claim_meta(0, "superblock");
+    for (int i = REFCOUNT_START; i < BLOCK_AMOUNT; i++) {
+        claim_meta(i, "refcount, checksum and bitmap tables");
+    }
+
+    views[0].inodes = malloc(INODE_AMOUNT * sizeof(i_node));
+    views[0].directory = malloc(DIR_AMOUNT * sizeof(dir_entry));
+    strcpy(views[0].name, "live");
+    for (int i = 0; i < INODE_AMOUNT; i++) {    //Past the table's blocks every i-Node is free
+        views[0].inodes[i].size = -1;
+    }
+    for (int i = 0; i < superblock.i_node_table_length; i++) {     //INODES_PER_BLOCK i-Nodes in each block
+        int first = i * INODES_PER_BLOCK;
+        int count = INODE_AMOUNT - first < INODES_PER_BLOCK ? INODE_AMOUNT - first : INODES_PER_BLOCK;
+        if (claim_meta(superblock.i_node_blocks[i], "i-Node table") < 0) {
+            return -1;
+        }
+        memcpy(&views[0].inodes[first], block_at(superblock.i_node_blocks[i]), count * sizeof(i_node));
+    }
+    for (int i = 0; i < DIRECTORY_BLOCKS; i++) {
+        table_blocks[i] = views[0].inodes[0].pointers[i];
+        if (claim_meta(table_blocks[i], "root directory") < 0) {
+            return -1;
+        }
+    }
+    copy_blocks(table_blocks, (char *) views[0].directory, DIR_AMOUNT * sizeof(dir_entry));
+    n_views = 1;
+
+    if (superblock.snapshot_root < 0) {
+        return 0;
+    }
+    if (claim_meta(superblock.snapshot_root, "snapshot list") < 0) {
+        return -1;
+    }
+    snapshot_record records[SFS_MAX_SNAPSHOTS];
+    memcpy(records, block_at(superblock.snapshot_root), sizeof(records));
+    for (int s = 0; s < SFS_MAX_SNAPSHOTS; s++) {
+        if (!records[s].in_use) {
+            continue;
+        }
+        table_view *v = &views[n_views];
+        sprintf(v->name, "snapshot %d", s);
+        int valid = 1;
+        for (int i = 0; i < SNAPSHOT_META_BLOCKS; i++) {
+            if (claim_meta(records[s].blocks[i], v->name) < 0) {
+                valid = 0;
+            }
+        }
+        if (!valid) {
+            continue;
+        }
+        v->inodes = malloc(INODE_AMOUNT * sizeof(i_node));
+        v->directory = malloc(DIR_AMOUNT * sizeof(dir_entry));
+        copy_blocks(records[s].blocks, (char *) v->inodes, INODE_AMOUNT * sizeof(i_node));
+        copy_blocks(records[s].blocks + SNAPSHOT_INODE_BLOCKS, (char *) v->directory, DIR_AMOUNT * sizeof(dir_entry));
+        n_views++;
+    }
+    return 0;
+}
+
+static int claim_file_block(table_view *v, int inode, int block, const char *what) {
+    if (block < DATA_START || block >= REFCOUNT_START) {
+        ERROR("%s i-Node %d: %s block %d is outside the data area", v->name, inode, what, block);
+        return -1;
+    }
+    __atomic_fetch_add(&refs[block], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* ======================================================================== */
+/* check_inode:                                                             */
+/* Pointers of one i-Node against its size. Inline files have none. Block  */
+/* files have one slot per logical block, except that a compressed chunk    */
+/* keeps fewer blocks followed by its length marker.                        */
+/* ======================================================================== */
+static void check_inode(table_view *v, int n) {
+    i_node *ino = &v->inodes[n];
+    int slots[MAX_FILE_BLOCKS];
+
+    if (ino->size == -1) {
+        return;
+    }
+    if (ino->size < 0 || ino->size > MAX_FILE_SIZE) {
+        ERROR("%s i-Node %d: size %d out of range", v->name, n, ino->size);
+        return;
+    }
+    if (ino->link_cnt == 0) {
+        if (ino->size > SFS_INLINE_MAX) {
+            ERROR("%s i-Node %d: %d bytes but no data blocks", v->name, n, ino->size);
+        }
+        for (int i = 0; i < 12; i++) {
+            if (ino->pointers[i] != -1) {
+                ERROR("%s i-Node %d: inline file with block pointer %d", v->name, n, ino->pointers[i]);
+                break;
+            }
+        }
+        if (ino->indirect_pointers != -1) {
+            ERROR("%s i-Node %d: inline file with an indirect block", v->name, n);
+        }
+        if (ino->unwritten != 0) {
+            ERROR("%s i-Node %d: inline file with %d unwritten slots", v->name, n, ino->unwritten);
+        }
+        return;
+    }
+    if (ino->link_cnt < 0 || ino->link_cnt > MAX_FILE_BLOCKS) {
+        ERROR("%s i-Node %d: link_cnt %d out of range", v->name, n, ino->link_cnt);
+        return;
+    }
+    if (ino->unwritten < 0 || ino->unwritten > ino->link_cnt) {
+        ERROR("%s i-Node %d: %d unwritten slots out of range", v->name, n, ino->unwritten);
+        return;
+    }
+
+    for (int i = 0; i < MAX_FILE_BLOCKS; i++) {
+        slots[i] = -1;
+    }
+    memcpy(slots, ino->pointers, sizeof(ino->pointers));
+    if (ino->indirect_pointers >= 0 &&
+        claim_file_block(v, n, ino->indirect_pointers, "indirect") == 0 && ino->link_cnt > 12) {
+        memcpy(slots + 12, block_at(ino->indirect_pointers), (ino->link_cnt - 12) * sizeof(int));
+    }
+    else if (ino->link_cnt > 12) {
+        ERROR("%s i-Node %d: %d slots but no valid indirect block", v->name, n, ino->link_cnt);
+        return;
+    }
+
+    int logical = blocks_for(ino->size);
+    if (ino->link_cnt > logical) {
+        WARNING("%s i-Node %d: %d blocks past the end of the file (interrupted write)", v->name, n,
+                ino->link_cnt - logical);
+    }
+
+    for (int i = ino->link_cnt - ino->unwritten; i < ino->link_cnt; i++) {
+        if (slots[i] < 0) {
+            ERROR("%s i-Node %d: reserved slot %d has no block", v->name, n, i);
+            break;
+        }
+    }
+
+    for (int lo = 0; lo < logical; lo += CHUNK_BLOCKS) {
+        int count = logical - lo < CHUNK_BLOCKS ? logical - lo : CHUNK_BLOCKS;
+        int p = 0;
+        while (p < count && slots[lo + p] >= 0) {
+            p++;
+        }
+        if (p < count && slots[lo + p] <= -2) {     //Compressed chunk
+            int clen = -slots[lo + p] - 2;
+            if (clen <= 0 || clen > count * BLOCK_SIZE || blocks_for(clen) != p) {
+                ERROR("%s i-Node %d: chunk at block %d has a bad compressed length %d", v->name, n, lo, clen);
+            }
+            for (int i = p + 1; i < CHUNK_BLOCKS && lo + i < MAX_FILE_BLOCKS; i++) {
+                if (slots[lo + i] != -1) {
+                    ERROR("%s i-Node %d: compressed chunk at block %d has stray slot %d", v->name, n, lo, i);
+                }
+            }
+        }
+        else if (p < count) {
+            ERROR("%s i-Node %d: logical block %d has no data block", v->name, n, lo + p);
+        }
+    }
+
+    int max_slot = ino->link_cnt > logical ? ino->link_cnt : logical;
+    for (int i = 0; i < max_slot; i++) {
+        if (slots[i] >= 0) {
+            claim_file_block(v, n, slots[i], "data");
+        }
+    }
+}
+
+static void *inode_worker(void *arg) {      //Work item k is i-Node k % INODE_AMOUNT of view k / INODE_AMOUNT
+    work_range *r = arg;
+    for (int k = r->first; k < r->last; k++) {
+        if (k % INODE_AMOUNT != 0) {        //i-Node 0 is the root directory
+            check_inode(&views[k / INODE_AMOUNT], k % INODE_AMOUNT);
+        }
+    }
+    return NULL;
+}
+
+static void *checksum_worker(void *arg) {
+    work_range *r = arg;
+    uint32_t *table = (uint32_t *) block_at(CHECKSUM_START);
+    unsigned char *bitmap = (unsigned char *) block_at(BITMAP_START);
+    for (int b = r->first; b < r->last; b++) {
+        if (b >= CHECKSUM_START && b < CHECKSUM_START + CHECKSUM_BLOCKS) {
+            continue;
+        }
+        if ((superblock.features & SFS_FEATURE_LOG) && (bitmap[b/8] >> (b % 8)) & 1) {
+            continue;       //Free blocks of a log hold what was appended after the last checkpoint
+        }
+        if (table[b] == CHECKSUM_OPEN) {
+            continue;       //Rewritten by a call that never finished, the next mount takes its contents
+        }
+        if (BLOCK_CHECKSUM(crc32c(0, block_at(b), BLOCK_SIZE)) != table[b]) {
+            ERROR("block %d does not match its checksum", b);
+            if (b >= REFCOUNT_START) {      //Rewritten, checksum included, by -r
+                __atomic_fetch_add(&fixable, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void run_parallel(void *(*worker)(void *), int items) {
+    pthread_t tid[threads];
+    work_range ranges[threads];
+    for (int t = 0; t < threads; t++) {
+        ranges[t].first = (long) items * t / threads;
+        ranges[t].last = (long) items * (t + 1) / threads;
+        pthread_create(&tid[t], NULL, worker, &ranges[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tid[t], NULL);
+    }
+}
+
+static void check_directory(table_view *v) {
+    int named[INODE_AMOUNT] = {0};
+
+    for (int i = 0; i < DIR_AMOUNT; i++) {
+        dir_entry *e = &v->directory[i];
+        if (memchr(e->file_name, 0, sizeof(e->file_name)) == NULL) {
+            ERROR("%s directory entry %d: name not terminated", v->name, i);
+            continue;
+        }
+        if (e->file_name[0] == '\0') {
+            continue;
+        }
+        if (e->i_node_num < 1 || e->i_node_num >= INODE_AMOUNT) {
+            ERROR("%s directory entry %s: i-Node %d out of range", v->name, e->file_name, e->i_node_num);
+            continue;
+        }
+        if (v->inodes[e->i_node_num].size == -1) {
+            ERROR("%s directory entry %s: i-Node %d is free", v->name, e->file_name, e->i_node_num);
+        }
+        if (named[e->i_node_num]++) {
+            ERROR("%s directory entry %s: i-Node %d already named", v->name, e->file_name, e->i_node_num);
+        }
+        for (int j = 0; j < i; j++) {
+            if (strcmp(v->directory[j].file_name, e->file_name) == 0) {
+                ERROR("%s directory: name %s appears twice", v->name, e->file_name);
+            }
+        }
+    }
+    for (int n = 1; n < INODE_AMOUNT; n++) {
+        if (v->inodes[n].size != -1 && !named[n]) {
+            ERROR("%s i-Node %d: in use but not in the directory", v->name, n);
+        }
+    }
+}
+
+/* ======================================================================== */
+/* check_blocks:                                                            */
+/* Claims against the bitmap and the reference counts.                      */
+/* ======================================================================== */
+static void check_blocks(unsigned char *bitmap, uint16_t *refcounts) {
+
+    for (int b = 0; b < BLOCK_AMOUNT; b++) {
+        int used = meta_claims[b] + refs[b] > 0;
+        int marked_free = (bitmap[b / 8] >> (b % 8)) & 1;
+        int bad = 0;
+
+        if (meta_claims[b] > 1 || (meta_claims[b] && refs[b])) {
+            ERROR("block %d claimed twice (%d metadata, %d file references)", b, meta_claims[b], refs[b]);
+        }
+        if (refs[b] > 1 && refcounts[b] != refs[b]) {
+            ERROR("block %d has %d owners but a reference count of %d%s", b, refs[b], refcounts[b],
+                  refcounts[b] <= 1 ? " (cross-linked)" : "");
+            bad = 1;
+        }
+        else if (refs[b] <= 1 && refcounts[b] > 1) {
+            ERROR("block %d has %d owner(s) but a reference count of %d", b, refs[b], refcounts[b]);
+            bad = 1;
+        }
+        if (used && marked_free) {
+            ERROR("block %d is in use but marked free", b);
+            bad = 1;
+        }
+        else if (!used && !marked_free) {
+            ERROR("block %d is marked used but nothing claims it", b);
+            bad = 1;
+        }
+        if (bad) {
+            fixable++;
+        }
+        if (verbose && used) {
+            printf("block %d: %d metadata, %d file references\n", b, meta_claims[b], refs[b]);
+        }
+    }
+}
+
+/* ======================================================================== */
+/* rebuild:                                                                 */
+/* Writes a bitmap and reference count table derived from the claims, and  */
+/* refreshes their checksums so the mounted image verifies cleanly.         */
+/* ======================================================================== */
+static int rebuild(int fd) {
+    unsigned char bitmap[BITMAP_BLOCKS * BLOCK_SIZE];
+    uint16_t refcounts[REFCOUNT_BLOCKS * BLOCK_SIZE / sizeof(uint16_t)];
+    uint32_t checksums[CHECKSUM_BLOCKS * BLOCK_SIZE / sizeof(uint32_t)];
+
+    memset(bitmap, 0, sizeof(bitmap));
+    memset(refcounts, 0, sizeof(refcounts));
+    memcpy(checksums, block_at(CHECKSUM_START), sizeof(checksums));
+    for (int b = 0; b < BLOCK_AMOUNT; b++) {
+        if (meta_claims[b] + refs[b] == 0) {
+            bitmap[b / 8] |= 1 << (b % 8);
+        }
+        refcounts[b] = refs[b] > 1 ? refs[b] : 0;
+    }
+    for (int i = 0; i < BITMAP_BLOCKS; i++) {
+        checksums[BITMAP_START + i] = BLOCK_CHECKSUM(crc32c(0, bitmap + i*BLOCK_SIZE, BLOCK_SIZE));
+    }
+    for (int i = 0; i < REFCOUNT_BLOCKS; i++) {
+        checksums[REFCOUNT_START + i] = BLOCK_CHECKSUM(crc32c(0, (char *) refcounts + i*BLOCK_SIZE, BLOCK_SIZE));
+    }
+
+    if (pwrite(fd, bitmap, sizeof(bitmap), (long) BITMAP_START * BLOCK_SIZE) != sizeof(bitmap) ||
+        pwrite(fd, refcounts, sizeof(refcounts), (long) REFCOUNT_START * BLOCK_SIZE) != sizeof(refcounts) ||
+        (superblock.features & SFS_FEATURE_CHECKSUM &&
+         pwrite(fd, checksums, sizeof(checksums), (long) CHECKSUM_START * BLOCK_SIZE) != sizeof(checksums))) {
+        perror("sfs_fsck: rebuild");
+        return -1;
+    }
+    fsync(fd);
+    return 0;
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv) {
+    char *path = "Tairov_sfs";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:rv")) != -1) {
+        switch (opt) {
+            case 'j': threads = atoi(optarg); break;
+            case 'r': repair = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-j threads] [-r] [-v] [image]\n", argv[0]);
+                return FSCK_FAILED;
+        }
+    }
+    if (optind < argc) {
+        path = argv[optind];
+    }
+    if (threads <= 0) {
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        threads = threads > 0 ? threads : 1;
+    }
+
+    double start = now_ms();
+    int fd = open(path, repair ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return FSCK_FAILED;
+    }
+    if (st.st_size < (long) BLOCK_AMOUNT * BLOCK_SIZE) {
+        printf("sfs_fsck: %s is %ld bytes, an image is %d\n", path, (long) st.st_size, BLOCK_AMOUNT * BLOCK_SIZE);
+        return FSCK_FAILED;
+    }
+    image = mmap(NULL, (size_t) BLOCK_AMOUNT * BLOCK_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        perror("mmap");
+        return FSCK_FAILED;
+    }
+
+    if (load_views() < 0) {
+        return FSCK_FAILED;
+    }
+    run_parallel(inode_worker, n_views * INODE_AMOUNT);
+    if (superblock.features & SFS_FEATURE_CHECKSUM) {
+        run_parallel(checksum_worker, BLOCK_AMOUNT);
+    }
+    for (int v = 0; v < n_views; v++) {
+        check_directory(&views[v]);
+    }
+    check_blocks((unsigned char *) block_at(BITMAP_START), (uint16_t *) block_at(REFCOUNT_START));
+
+    int status = errors ? FSCK_UNCORRECTED : FSCK_OK;
+    if (repair && fixable) {
+        if (rebuild(fd) == 0) {
+            printf("sfs_fsck: rebuilt the bitmap and reference counts (%d problems corrected)\n", fixable);
+            status = errors > fixable ? FSCK_UNCORRECTED : FSCK_CORRECTED;
+        }
+    }
+
+    printf("sfs_fsck: %s: %d blocks, %d view(s), %d errors (%d fixable with -r), %d warnings, "
+           "%d threads, %.1f ms\n", path, BLOCK_AMOUNT, n_views, errors, fixable, warnings, threads,
+           now_ms() - start);
+    munmap(image, (size_t) BLOCK_AMOUNT * BLOCK_SIZE);
+    close(fd);
+    return status;
+}
@@ -0,0 +1,208 @@
+/* ======================================================================== */
+/* sfs_instance:                                                            */
+/* Independent file system instances. Every instance has its own image,     */
+/* emulated device and in-memory state (sfs_t), so a process can mount      */
+/* several file systems and run one per worker thread with nothing shared.  */
+/* Each thread works on a current instance: the legacy calls (mksfs,        */
+/* sfs_fopen, ...) use it, and it is the default instance on "Tairov_sfs"   */
+/* until sfs_select picks another. The *_r calls take the instance          */
+/* explicitly. An instance must not be used by two threads at once.         */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+sfs_t sfs_default = { .image = "Tairov_sfs", .current_op = -1 };
+__thread sfs_t *sfs = &sfs_default;
+
+sfs_t *sfs_create(const char *image) {
+    if (image == NULL || strlen(image) >= sizeof(sfs_default.image)) {
+        printf("SFS_API: CANNOT CREATE INSTANCE; INVALID IMAGE NAME.\n");
+        return NULL;
+    }
+    sfs_t *fs = calloc(1, sizeof(sfs_t));
+    if (fs != NULL) {
+        fs->device = disk_create();
+    }
+    if (fs == NULL || fs->device == NULL) {
+        printf("SFS_API: CANNOT CREATE INSTANCE; OUT OF MEMORY.\n");
+        free(fs);
+        return NULL;
+    }
+    strcpy(fs->image, image);
+    fs->current_op = -1;
+    return fs;
+}
+
+sfs_t *sfs_select(sfs_t *fs) {     //Returns the previous instance, NULL selects the default one
+    sfs_t *previous = sfs;
+    sfs = fs ? fs : &sfs_default;
+    disk_select(sfs->device);
+    return previous;
+}
+
+void sfs_destroy(sfs_t *fs) {      //Finishes queued requests, commits appends, drops views, ends the trace, closes the device; the image stays
+    if (fs == NULL || fs == &sfs_default) {
+        return;
+    }
+    async_shutdown(fs);
+    sfs_t *previous = sfs_select(fs);
+    append_sync();
+    append_reset();
+    map_reset();
+    if (fs->trace) {
+        sfs_trace_stop();
+    }
+    sfs_select(previous == fs ? NULL : previous);
+    disk_destroy(fs->device);
+    free(fs);
+}
+
+/* ======================================================================== */
+/* *_r calls:                                                               */
+/* The API with the instance passed in. The instance is made current for    */
+/* the duration of the call and the caller's own is restored afterwards.    */
+/* ======================================================================== */
+#define ON(fs, type, call) do {                 \
+        sfs_t *previous = sfs_select(fs);       \
+        type result = call;                     \
+        sfs_select(previous);                   \
+        return result;                          \
+    } while (0)
+
+#define ON_VOID(fs, call) do {                  \
+        sfs_t *previous = sfs_select(fs);       \
+        call;                                   \
+        sfs_select(previous);                   \
+    } while (0)
+
+int mksfs_r(sfs_t *fs, int fresh) {
+    ON(fs, int, mksfs(fresh));
+}
+
+int sfs_getnextfilename_r(sfs_t *fs, char *fname) {
+    ON(fs, int, sfs_getnextfilename(fname));
+}
+
+int sfs_readdir_r(sfs_t *fs, int *cursor, char *fname) {
+    ON(fs, int, sfs_readdir(cursor, fname));
+}
+
+int sfs_getfilesize_r(sfs_t *fs, const char *path) {
+    ON(fs, int, sfs_getfilesize(path));
+}
+
+int sfs_fopen_r(sfs_t *fs, char *name) {
+    ON(fs, int, sfs_fopen(name));
+}
+
+int sfs_fclose_r(sfs_t *fs, int fileID) {
+    ON(fs, int, sfs_fclose(fileID));
+}
+
+int sfs_fwrite_r(sfs_t *fs, int fileID, const char *buf, int length) {
+    ON(fs, int, sfs_fwrite(fileID, buf, length));
+}
+
+int sfs_fread_r(sfs_t *fs, int fileID, char *buf, int length) {
+    ON(fs, int, sfs_fread(fileID, buf, length));
+}
+
+int sfs_fseek_r(sfs_t *fs, int fileID, int loc) {
+    ON(fs, int, sfs_fseek(fileID, loc));
+}
+
+int sfs_fflush_r(sfs_t *fs, int fileID) {
+    ON(fs, int, sfs_fflush(fileID));
+}
+
+int sfs_fallocate_r(sfs_t *fs, int fileID, int offset, int length) {
+    ON(fs, int, sfs_fallocate(fileID, offset, length));
+}
+
+int sfs_writev_r(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt) {
+    ON(fs, int, sfs_writev(fileID, iov, iovcnt));
+}
+
+int sfs_readv_r(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt) {
+    ON(fs, int, sfs_readv(fileID, iov, iovcnt));
+}
+
+void *sfs_map_r(sfs_t *fs, int fileID, int offset, int length, int writable) {
+    ON(fs, void *, sfs_map(fileID, offset, length, writable));
+}
+
+int sfs_unmap_r(sfs_t *fs, void *view) {
+    ON(fs, int, sfs_unmap(view));
+}
+
+int sfs_remove_r(sfs_t *fs, char *file) {
+    ON(fs, int, sfs_remove(file));
+}
+
+int sfs_clone_r(sfs_t *fs, const char *src, const char *dst) {
+    ON(fs, int, sfs_clone(src, dst));
+}
+
+void sfs_stats_r(sfs_t *fs, sfs_statistics *out) {
+    ON_VOID(fs, sfs_stats(out));
+}
+
+void sfs_stats_reset_r(sfs_t *fs) {
+    ON_VOID(fs, sfs_stats_reset());
+}
+
+int sfs_stats_format_r(sfs_t *fs, char *buf, int size) {
+    ON(fs, int, sfs_stats_format(buf, size));
+}
+
+int sfs_set_compression_r(sfs_t *fs, int enabled) {
+    ON(fs, int, sfs_set_compression(enabled));
+}
+
+int sfs_set_dedup_r(sfs_t *fs, int enabled) {
+    ON(fs, int, sfs_set_dedup(enabled));
+}
+
+int sfs_snapshot_create_r(sfs_t *fs) {
+    ON(fs, int, sfs_snapshot_create());
+}
+
+int sfs_snapshot_mount_r(sfs_t *fs, int id) {
+    ON(fs, int, sfs_snapshot_mount(id));
+}
+
+int sfs_snapshot_delete_r(sfs_t *fs, int id) {
+    ON(fs, int, sfs_snapshot_delete(id));
+}
+
+void sfs_frag_stats_r(sfs_t *fs, sfs_frag_info *out) {
+    ON_VOID(fs, sfs_frag_stats(out));
+}
+
+int sfs_frag_report_r(sfs_t *fs, char *buf, int size) {
+    ON(fs, int, sfs_frag_report(buf, size));
+}
+
+int sfs_defrag_step_r(sfs_t *fs, int budget) {
+    ON(fs, int, sfs_defrag_step(budget));
+}
+
+int sfs_set_log_r(sfs_t *fs, int enabled) {
+    ON(fs, int, sfs_set_log(enabled));
+}
+
+int sfs_log_clean_r(sfs_t *fs, int budget) {
+    ON(fs, int, sfs_log_clean(budget));
+}
+
+int sfs_trace_start_r(sfs_t *fs, const char *path) {
+    ON(fs, int, sfs_trace_start(path));
+}
+
+int sfs_trace_stop_r(sfs_t *fs) {
+    ON(fs, int, sfs_trace_stop());
+}
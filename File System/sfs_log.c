@@ -0,0 +1,398 @@
+/* ======================================================================== */
+/* sfs_log:                                                                 */
+/* Log-structured write mode (SFS_FEATURE_LOG, see sfs_set_log). The disk   */
+/* is cut in segments of SFS_SEGMENT_BLOCKS blocks and every block written  */
+/* goes to the next free block of the segment the log is in, so random      */
+/* writes reach the disk as one sequential stream:                          */
+/*     - Data and indirect blocks are never written in place, a write moves */
+/*       the block to the head of the log and frees the old one             */
+/*     - i-Node table blocks, the directory, the bitmap, the superblock     */
+/*       and the refcount and checksum tables are only kept in memory;      */
+/*       inode_blocks[] is the i-Node map. A checkpoint, every              */
+/*       SFS_LOG_CHECKPOINT blocks appended and on sfs_fflush, snapshots    */
+/*       and unmount, appends the changed table and directory blocks to     */
+/*       the log and writes the bitmap and then the superblock pointing at  */
+/*       them                                                               */
+/*     - A block freed between checkpoints stays allocated until the next   */
+/*       one, as the last checkpoint may still use it. So after a crash     */
+/*       the disk mounts as it was at the last checkpoint, and writes made  */
+/*       since are lost, not torn. Those blocks are never handed out early: */
+/*       once fewer than SFS_LOG_RESERVE other blocks are free, the         */
+/*       checkpoint is brought forward to the end of the call, and a block  */
+/*       asked for when only held-back ones are left is not found, like on  */
+/*       a full disk                                                        */
+/*     - When a segment fills up the log moves on to the segment with the   */
+/*       most free blocks. The cleaner keeps whole segments free: it picks  */
+/*       the segment with the fewest live blocks that it can move all of,   */
+/*       if at most half of it is live, and copies them to the head of the  */
+/*       log. It runs before a checkpoint when fewer than                   */
+/*       SFS_LOG_CLEAN_LOW segments are clean, and on request with          */
+/*       sfs_log_clean / sfs_log_clean_async.                               */
+/* The on-disk format is the same as without the log, any image mounts.     */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+static int is_free(int block) {
+    return (sfs->bitmap[block/8] >> (block % 8)) & 1;
+}
+
+static int is_freed(int block) {        //Freed since the last checkpoint
+    return (sfs->log_freed[block/8] >> (block % 8)) & 1;
+}
+
+static int segment_size(int segment) {  //The last segment may be short
+    int first = segment * SFS_SEGMENT_BLOCKS;
+    return first + SFS_SEGMENT_BLOCKS <= BLOCK_AMOUNT ? SFS_SEGMENT_BLOCKS : BLOCK_AMOUNT - first;
+}
+
+static int segment_free(int segment) {
+    int first = segment * SFS_SEGMENT_BLOCKS, n = 0;
+    for (int b = first; b < first + segment_size(segment); b++) {
+        n += is_free(b);
+    }
+    return n;
+}
+
+static int free_blocks() {      //Held-back blocks are not free yet
+    int n = 0;
+    for (int i = 0; i < BLOCK_AMOUNT/8; i++) {
+        n += __builtin_popcount(sfs->bitmap[i]);
+    }
+    return n;
+}
+
+static int clean_segments() {
+    int n = 0;
+    for (int s = 0; s < SFS_SEGMENTS; s++) {
+        n += segment_free(s) == segment_size(s);
+    }
+    return n;
+}
+
+int log_active() {      //Writes are held back: log mode on, live file system, no checkpoint running
+    return (sfs->features & SFS_FEATURE_LOG) && !sfs->read_only && !sfs->log_checkpointing;
+}
+
+void log_reset() {
+    sfs->log_segment = -1;
+    sfs->log_next = 0;
+    sfs->log_cleaning = -1;
+    sfs->log_appended = 0;
+    memset(sfs->log_freed, 0, sizeof(sfs->log_freed));
+    sfs->log_freed_count = 0;
+    memset(sfs->log_table_dirty, 0, sizeof(sfs->log_table_dirty));
+    sfs->log_directory_dirty = 0;
+    sfs->log_checkpointing = 0;
+}
+
+int log_defer_free(int block) {     //set_bit: returns 1 if the block is only freed at the next checkpoint
+    if (!log_active() || is_free(block)) {
+        return 0;
+    }
+    if (!is_freed(block)) {
+        sfs->log_freed[block/8] |= 1 << (block % 8);
+        sfs->log_freed_count++;
+    }
+    return 1;
+}
+
+static void release_freed() {       //Frees the blocks held back
+    int checkpointing = sfs->log_checkpointing;
+
+    sfs->log_checkpointing = 1;     //So set_bit frees them for good
+    for (int b = 0; b < BLOCK_AMOUNT && sfs->log_freed_count > 0; b++) {
+        if (is_freed(b)) {
+            sfs->log_freed[b/8] &= ~(1 << (b % 8));
+            sfs->log_freed_count--;
+            set_bit(b);
+        }
+    }
+    sfs->log_checkpointing = checkpointing;
+}
+
+static int open_segment() {     //Moves the log to the segment with the most free blocks, -1 if none has any
+    int best = -1, best_free = 0;
+    for (int i = 1; i <= SFS_SEGMENTS; i++) {       //From the one after the current, so the log sweeps the disk
+        int s = (sfs->log_segment + i + SFS_SEGMENTS) % SFS_SEGMENTS;
+        int n = s == sfs->log_cleaning ? 0 : segment_free(s);
+        if (n > best_free) {
+            best = s;
+            best_free = n;
+        }
+    }
+    if (best < 0) {
+        return -1;
+    }
+    sfs->log_segment = best;
+    sfs->log_next = best * SFS_SEGMENT_BLOCKS;
+    sfs->stats.log.segments_opened++;
+    return 0;
+}
+
+static int head_block(int keep) {       //Next free block at the head of the log, -1 if only keep are left
+    if (free_blocks() <= keep) {
+        return -1;
+    }
+    do {
+        if (sfs->log_segment >= 0) {
+            int end = sfs->log_segment * SFS_SEGMENT_BLOCKS + segment_size(sfs->log_segment);
+            for (; sfs->log_next < end; sfs->log_next++) {
+                if (is_free(sfs->log_next)) {
+                    sfs->log_appended++;
+                    sfs->stats.log.blocks_appended++;
+                    return sfs->log_next++;
+                }
+            }
+        }
+    } while (open_segment() == 0);
+    return -1;
+}
+
+/* ======================================================================== */
+/* log_alloc:                                                               */
+/* get_free_block in log mode: the next free block at the head of the log.  */
+/* Like get_free_block the caller takes it with remove_bit. Blocks held     */
+/* back for the last checkpoint are not handed out, see log_end_call, and   */
+/* the checkpoint keeps enough free to move every table and directory       */
+/* block, so it never has to write one in place.                            */
+/* ======================================================================== */
+int log_alloc() {
+    stats_cache(SFS_CACHE_BITMAP, 1, 0, 0);
+    int block = head_block(DIRECTORY_BLOCKS + sfs->inode_table_length);
+    if (block < 0) {
+        printf("%s", "SFS_API: NO FREE BLOCKS FOUND\n");
+    }
+    return block;
+}
+
+static void relocate(int *block) {      //Points a table or directory block at a block at the head of the log
+    int fresh = head_block(0);
+    if (fresh < 0) {                    //Written in place then
+        return;
+    }
+    remove_bit(fresh);
+    set_bit(*block);
+    *block = fresh;
+}
+
+/* ======================================================================== */
+/* log_checkpoint:                                                          */
+/* Writes everything log mode holds back: changed i-Node table and          */
+/* directory blocks go to the head of the log, then the bitmap and the      */
+/* checksum table, then the superblock with the new i-Node map, which       */
+/* commits the checkpoint, and the refcount table. The blocks freed since   */
+/* the last checkpoint are still in use in that bitmap, so a crash before   */
+/* the superblock leaves the last checkpoint whole; they are freed for good */
+/* and the bitmap written again after it. Does nothing outside log mode.    */
+/* ======================================================================== */
+void log_checkpoint() {
+    if (!log_active()) {
+        return;
+    }
+    if (sfs->log_directory_dirty) {
+        for (int i = 0; i < DIRECTORY_BLOCKS; i++) {
+            relocate(&sfs->i_node_table[0].pointers[i]);
+        }
+        sfs->log_table_dirty[0] = 1;
+    }
+    for (int b = 0; b < sfs->inode_table_length; b++) {
+        if (sfs->log_table_dirty[b]) {
+            relocate(&sfs->inode_blocks[b]);
+        }
+    }
+
+    sfs->log_checkpointing = 1;
+    if (sfs->log_directory_dirty) {
+        write_directory();
+    }
+    for (int b = 0; b < sfs->inode_table_length; b++) {
+        if (sfs->log_table_dirty[b]) {
+            write_inode(b * INODES_PER_BLOCK);
+        }
+    }
+    write_bitmap();
+    checksum_flush();       //The blocks of the last checkpoint keep theirs, it never wrote over them
+    write_superblock();
+    refcount_flush();
+    if (sfs->log_freed_count > 0) {
+        release_freed();
+        write_bitmap();
+        checksum_flush();
+    }
+    sfs->log_checkpointing = 0;
+
+    memset(sfs->log_table_dirty, 0, sizeof(sfs->log_table_dirty));
+    sfs->log_directory_dirty = 0;
+    sfs->log_appended = 0;
+    sfs->stats.log.checkpoints++;
+}
+
+/* ======================================================================== */
+/* log_end_call:                                                            */
+/* end_call in log mode: a checkpoint once enough was appended, or once the */
+/* blocks held back leave fewer than SFS_LOG_RESERVE free, so the next call */
+/* finds them free again.                                                   */
+/* ======================================================================== */
+void log_end_call() {
+    if (!log_active() || sfs->op_depth != 1) {
+        return;
+    }
+    if (sfs->log_freed_count > 0 && free_blocks() < SFS_LOG_RESERVE) {
+        sfs->stats.log.low_space_checkpoints++;
+    }
+    else if (sfs->log_appended < SFS_LOG_CHECKPOINT) {
+        return;
+    }
+    if (sfs->current_op != SFS_OP_LOG_CLEAN && clean_segments() < SFS_LOG_CLEAN_LOW) {
+        log_clean(SFS_LOG_CLEAN_BUDGET);
+    }
+    log_checkpoint();
+}
+
+static int move_block(int region, int *block) {    //Copies a block to the head of the log, -1 if it could not
+    char *buffer = disk_alloc(BLOCK_SIZE);
+    int fresh = -1;
+    if (region_read(region, *block, 1, buffer) >= 0 && (fresh = log_alloc()) >= 0) {
+        remove_bit(fresh);
+        region_write(region, fresh, 1, buffer);
+        block_release(*block);
+        *block = fresh;
+    }
+    free(buffer);
+    return fresh < 0 ? -1 : 0;
+}
+
+static int in_segment(int block, int segment) {
+    return block >= 0 && block / SFS_SEGMENT_BLOCKS == segment;
+}
+
+static int file_slots(i_node *inode, int *slots) {     //Block pointers of a file with blocks, 0 if it has none, -1 if they can't be read (the file is not moved)
+    if (inode->size <= 0 || inode->link_cnt == 0) {
+        return 0;
+    }
+    return load_slots(inode, slots);
+}
+
+/* ======================================================================== */
+/* pick_victim:                                                             */
+/* The segment with the fewest live blocks, at most SFS_LOG_CLEAN_LIVE,     */
+/* that can all be moved: data and indirect blocks only one file uses, and  */
+/* the i-Node table and directory blocks the checkpoint moves anyway. -1 if */
+/* no segment is worth emptying.                                            */
+/* ======================================================================== */
+static int pick_victim() {
+    int movable[SFS_SEGMENTS], slots[MAX_FILE_BLOCKS];
+
+    memset(movable, 0, sizeof(movable));
+    for (int i = 1; i < INODE_AMOUNT; i++) {
+        i_node *inode = &sfs->i_node_table[i];
+        int count = file_slots(inode, slots);
+        for (int j = 0; j < count; j++) {
+            if (slots[j] >= 0 && !block_is_shared(slots[j])) {
+                movable[slots[j] / SFS_SEGMENT_BLOCKS]++;
+            }
+        }
+        if (count > 12 && inode->indirect_pointers >= 0 && !block_is_shared(inode->indirect_pointers)) {
+            movable[inode->indirect_pointers / SFS_SEGMENT_BLOCKS]++;
+        }
+    }
+    for (int b = 0; b < sfs->inode_table_length; b++) {
+        movable[sfs->inode_blocks[b] / SFS_SEGMENT_BLOCKS]++;
+    }
+    for (int i = 0; i < DIRECTORY_BLOCKS; i++) {
+        movable[sfs->i_node_table[0].pointers[i] / SFS_SEGMENT_BLOCKS]++;
+    }
+
+    int victim = -1, victim_live = SFS_SEGMENT_BLOCKS + 1;
+    for (int s = 0; s < SFS_SEGMENTS; s++) {
+        int live = 0;
+        for (int b = s * SFS_SEGMENT_BLOCKS; b < s * SFS_SEGMENT_BLOCKS + segment_size(s); b++) {
+            live += !is_free(b) && !is_freed(b);
+        }
+        if (s != sfs->log_segment && live > 0 && live <= SFS_LOG_CLEAN_LIVE && live == movable[s] && live < victim_live) {
+            victim = s;
+            victim_live = live;
+        }
+    }
+    return victim;
+}
+
+/* ======================================================================== */
+/* log_clean:                                                               */
+/* Spends up to budget block reads and writes emptying one segment. The     */
+/* blocks moved out are freed by the next checkpoint, which is brought      */
+/* forward to the end of the call. Returns the blocks moved, 0 once no      */
+/* segment is worth emptying.                                               */
+/* ======================================================================== */
+int log_clean(int budget) {
+    int slots[MAX_FILE_BLOCKS], old_slots[MAX_FILE_BLOCKS];
+    int moved = 0;
+
+    if (sfs->read_only) {
+        printf("SFS_API: CANNOT CLEAN LOG; SNAPSHOT IS READ-ONLY.\n");
+        return -1;
+    }
+    if (!(sfs->features & SFS_FEATURE_LOG)) {
+        printf("SFS_API: CANNOT CLEAN LOG; LOG MODE IS OFF.\n");
+        return -1;
+    }
+    if (budget < 2) {
+        printf("SFS_API: CANNOT CLEAN LOG; BUDGET TOO SMALL.\n");
+        return -1;
+    }
+    int victim = pick_victim();
+    if (victim < 0) {
+        return 0;
+    }
+
+    sfs->log_cleaning = victim;         //The log must not move into it
+    for (int b = 0; b < sfs->inode_table_length; b++) {
+        if (in_segment(sfs->inode_blocks[b], victim)) {
+            sfs->log_table_dirty[b] = 1;
+        }
+    }
+    for (int i = 0; i < DIRECTORY_BLOCKS; i++) {
+        if (in_segment(sfs->i_node_table[0].pointers[i], victim)) {
+            sfs->log_directory_dirty = 1;
+        }
+    }
+    for (int i = 1; i < INODE_AMOUNT && moved * 2 + 2 <= budget; i++) {
+        i_node *inode = &sfs->i_node_table[i];
+        int count = file_slots(inode, slots);
+        int old_indirect = inode->indirect_pointers;
+        int changed = 0;
+        memcpy(old_slots, slots, sizeof(slots));
+        for (int j = 0; j < count && moved * 2 + 2 <= budget; j++) {
+            if (!in_segment(slots[j], victim) || block_is_shared(slots[j])) {
+                continue;
+            }
+            if (j >= 12 && own_indirect(inode, old_indirect) < 0) {   //Moved first, the slots past it are rewritten
+                break;
+            }
+            if (move_block(SFS_REGION_DATA, &slots[j]) == 0) {
+                moved++;
+                changed = 1;
+            }
+        }
+        if (inode->indirect_pointers == old_indirect && count > 12 && in_segment(old_indirect, victim) && moved * 2 + 2 <= budget &&
+                !block_is_shared(old_indirect) && move_block(SFS_REGION_INDIRECT, &inode->indirect_pointers) == 0) {
+            old_indirect = inode->indirect_pointers;    //Copied and released already
+            moved++;
+            changed = 1;
+        }
+        if (changed || inode->indirect_pointers != old_indirect) {
+            store_slots(inode, slots, old_slots, count, old_indirect);
+            write_inode(i);
+        }
+    }
+    sfs->log_cleaning = -1;
+
+    sfs->stats.log.blocks_cleaned += moved;
+    sfs->log_appended = SFS_LOG_CHECKPOINT;
+    return moved;
+}
@@ -0,0 +1,146 @@
+/* ======================================================================== */
+/* sfs_map:                                                                 */
+/* In-process mappings of file ranges. sfs_map returns a pinned view of     */
+/* part of an open file that can be scanned in place; it stays valid until  */
+/* sfs_unmap. There is no data block cache to point into, so a view is a    */
+/* buffer owned by the mapping. When the range sits in raw blocks that are  */
+/* consecutive on disk it is filled with a single request, otherwise it is  */
+/* read like fread would. sfs_unmap of a writable view writes it back       */
+/* through fwrite, which takes care of shared blocks, dedup, compression    */
+/* and checksums. Views are not kept coherent with fwrite calls made while  */
+/* they are mapped. A file can't be closed while it has views and a         */
+/* snapshot can't be mounted while any view is out. mksfs can't refuse, it  */
+/* frees them all and every view pointer the caller holds is invalid.       */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+static void map_init() {
+    if (!sfs->map_table_ready) {
+        for (int i = 0; i < SFS_MAX_MAPS; i++) {
+            sfs->map_table[i].fileID = -1;
+        }
+        sfs->map_table_ready = 1;
+    }
+}
+
+void map_reset() {          //Mount: every view goes away
+    map_init();
+    for (int i = 0; i < SFS_MAX_MAPS; i++) {
+        if (sfs->map_table[i].fileID >= 0) {
+            free(sfs->map_table[i].buffer);
+            sfs->map_table[i].fileID = -1;
+        }
+    }
+}
+
+int map_count(int fileID) { //Views of an open file, of every file if fileID is -1
+    int count = 0;
+    map_init();
+    for (int i = 0; i < SFS_MAX_MAPS; i++) {
+        count += fileID < 0 ? sfs->map_table[i].fileID >= 0 : sfs->map_table[i].fileID == fileID;
+    }
+    return count;
+}
+
+/* ======================================================================== */
+/* map_extent:                                                              */
+/* Returns the first disk block of blocks [first, last] of the file if      */
+/* they are all raw and consecutive on disk, -1 otherwise.                  */
+/* ======================================================================== */
+static int map_extent(i_node *inode, int first, int last) {
+    int slots[MAX_FILE_BLOCKS];
+    int blocks = size_to_blocks(inode->size);
+
+    if (inode->link_cnt == 0) {
+        return -1;
+    }
+    if (load_slots(inode, slots) < 0) {
+        return -1;
+    }
+    mask_unwritten(inode, slots);      //Reserved blocks read as zeros, not from disk
+    for (int c = first / CHUNK_BLOCKS; c <= last / CHUNK_BLOCKS; c++) {
+        int lo = c * CHUNK_BLOCKS;
+        int n = blocks - lo < CHUNK_BLOCKS ? blocks - lo : CHUNK_BLOCKS;
+        if (chunk_is_compressed(&slots[lo], n)) {
+            return -1;
+        }
+    }
+    for (int b = first; b <= last; b++) {
+        if (slots[b] < 0 || slots[b] != slots[first] + (b - first)) {
+            return -1;
+        }
+    }
+    return slots[first];
+}
+
+void *map_create(int fileID, int offset, int length, int writable) {
+    map_init();
+    if (fileID < 0 || fileID >= MAX_FD_AMOUNT || !sfs->open_fd_table[fileID].inode) {
+        printf("SFS_API: CANNOT MAP FILE; FILE NOT OPEN.\n");
+        return NULL;
+    }
+    i_node *inode = sfs->open_fd_table[fileID].inode;
+    if (offset < 0 || length <= 0 || offset + length > inode->size) {
+        printf("SFS_API: CANNOT MAP FILE; RANGE OUTSIDE THE FILE.\n");
+        return NULL;
+    }
+    if (writable && sfs->read_only) {
+        printf("SFS_API: CANNOT MAP FILE FOR WRITING; SNAPSHOT IS READ-ONLY.\n");
+        return NULL;
+    }
+    int slot = 0;
+    while (slot < SFS_MAX_MAPS && sfs->map_table[slot].fileID >= 0) {
+        slot++;
+    }
+    if (slot == SFS_MAX_MAPS) {
+        printf("SFS_API: CANNOT MAP FILE; ALL %d MAPPINGS IN USE.\n", SFS_MAX_MAPS);
+        return NULL;
+    }
+
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + length - 1) / BLOCK_SIZE;
+    mapping *m = &sfs->map_table[slot];
+    m->buffer = disk_alloc((last - first + 1) * BLOCK_SIZE);
+    m->view = m->buffer + offset % BLOCK_SIZE;
+
+    int extent = map_extent(inode, first, last);
+    int result;
+    if (extent >= 0) {      //Contiguous on disk, one request
+        result = region_read(SFS_REGION_DATA, extent, last - first + 1, m->buffer);
+    }
+    else {
+        result = read_at(fileID, offset, length, m->view) == length ? 0 : -1;
+    }
+    if (result < 0) {
+        free(m->buffer);
+        return NULL;
+    }
+    m->fileID = fileID;
+    m->offset = offset;
+    m->length = length;
+    m->writable = writable;
+    return m->view;
+}
+
+int map_release(void *view) {
+    map_init();
+    for (int i = 0; i < SFS_MAX_MAPS; i++) {
+        mapping *m = &sfs->map_table[i];
+        if (m->fileID < 0 || m->view != view) {
+            continue;
+        }
+        if (m->writable && write_at(m->fileID, m->offset, m->length, m->view) != m->length) {
+            return -1;      //The view stays mapped so nothing written to it is lost
+        }
+        free(m->buffer);
+        m->fileID = -1;
+        return 0;
+    }
+    printf("SFS_API: CANNOT UNMAP; ADDRESS IS NOT A MAPPING.\n");
+    return -1;
+}
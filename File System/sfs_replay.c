@@ -0,0 +1,362 @@
+/* ======================================================================== */
+/* sfs_replay:                                                              */
+/* Replays a trace written by sfs_trace_start (or a FUSE mount run with     */
+/* $SFS_TRACE set) against a fresh image, through the same sfs_* calls, and */
+/* reports throughput and per-call latency next to what was traced.         */
+/* Usage:                                                                   */
+/*     sfs_replay [-p none|hdd|ssd] [-P] [-l] trace                         */
+/* Calls run back to back unless -P keeps the original pacing. -l lists the */
+/* records instead. Written data is a fixed pattern, only sizes are traced. */
+/* File descriptors and views are matched to the ones the replay gets, so   */
+/* calls that failed in the trace fail the same way. Latency counts the     */
+/* device time charged by the disk_emu model, as in sfs_bench.              */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#define IMAGE "Tairov_replay"
+
+//Replay results of one kind of call
+typedef struct {
+    long calls;
+    long errors;
+    double *lat;            //Latency of every call, in microseconds
+    long capacity;
+    double total_us;
+    double traced_us;
+} op_result;
+
+FILE *report;               //Where results go, SFS chatter goes to /dev/null
+disk_model model;
+op_result results[SFS_OP_COUNT];
+int fds[MAX_FD_AMOUNT];     //Replay descriptor of every traced one, -1 if none
+struct { int id; void *view; } views[SFS_MAX_MAPS];
+char *data;                 //Pattern written, and where reads land
+int data_size;
+long bytes_read, bytes_written;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int read_record(FILE *f, sfs_trace_record *r, char *name) {
+    if (fread(r, sizeof(sfs_trace_record), 1, f) != 1) {
+        return 0;
+    }
+    if (r->name_length > 0 && fread(name, r->name_length, 1, f) != 1) {
+        return 0;
+    }
+    name[r->name_length] = '\0';
+    return 1;
+}
+
+char *buffer(int length) {  //At least length bytes of the pattern
+    if (length > data_size) {
+        data = realloc(data, length);
+        for (int i = data_size; i < length; i++) {
+            data[i] = (char)('a' + i % 26);
+        }
+        data_size = length;
+    }
+    return data;
+}
+
+int fd_of(int traced) {     //Unknown descriptors go through as they are, to fail the same way
+    return traced >= 0 && traced < MAX_FD_AMOUNT && fds[traced] >= 0 ? fds[traced] : traced;
+}
+
+void forget_files() {
+    memset(fds, -1, sizeof(fds));
+    memset(views, 0, sizeof(views));
+}
+
+int vector_io(sfs_trace_record *r, int writing) {   //The traced bytes split evenly over the traced iovec count
+    int count = r->offset;
+    if (count <= 0 || r->length < 0) {
+        return writing ? sfs_writev(fd_of(r->fd), NULL, count) : sfs_readv(fd_of(r->fd), NULL, count);
+    }
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    char *base = buffer(r->length);
+    for (int i = 0, done = 0; i < count; i++) {
+        int n = i == count - 1 ? r->length - done : r->length / count;
+        iov[i].iov_base = base + done;
+        iov[i].iov_len = n;
+        done += n;
+    }
+    int result = writing ? sfs_writev(fd_of(r->fd), iov, count) : sfs_readv(fd_of(r->fd), iov, count);
+    free(iov);
+    return result;
+}
+
+/* ======================================================================== */
+/* replay:                                                                  */
+/* Makes the call a record describes and returns its result, comparable to  */
+/* the traced one (0 or -1 for sfs_map).                                    */
+/* ======================================================================== */
+int replay(sfs_trace_record *r, char *name) {
+    char file_name[MAXFILENAME + 1];
+    sfs_frag_info info;
+    int result, cursor;
+
+    switch (r->op) {
+        case SFS_OP_MKSFS:
+            mksfs(r->fd);
+            forget_files();
+            return 0;
+        case SFS_OP_GETNEXTFILENAME:
+            return sfs_getnextfilename(file_name);
+        case SFS_OP_READDIR:
+            cursor = r->offset;
+            return sfs_readdir(cursor < 0 ? NULL : &cursor, file_name);
+        case SFS_OP_GETFILESIZE:
+            return sfs_getfilesize(name);
+        case SFS_OP_FOPEN:
+            result = sfs_fopen(name);
+            if (result >= 0 && r->result >= 0 && r->result < MAX_FD_AMOUNT) {
+                fds[r->result] = result;
+            }
+            return result;
+        case SFS_OP_FCLOSE:
+            result = sfs_fclose(fd_of(r->fd));
+            if (result >= 0 && r->fd >= 0 && r->fd < MAX_FD_AMOUNT) {
+                fds[r->fd] = -1;
+            }
+            return result;
+        case SFS_OP_FWRITE:
+            result = r->offset < 0 ? sfs_fwrite(fd_of(r->fd), buffer(r->length), r->length)
+                                   : sfs_pwrite(fd_of(r->fd), r->offset, buffer(r->length), r->length);
+            bytes_written += result > 0 ? result : 0;
+            return result;
+        case SFS_OP_FREAD:
+            result = r->offset < 0 ? sfs_fread(fd_of(r->fd), buffer(r->length), r->length)
+                                   : sfs_pread(fd_of(r->fd), r->offset, buffer(r->length), r->length);
+            bytes_read += result > 0 ? result : 0;
+            return result;
+        case SFS_OP_WRITEV:
+            result = vector_io(r, 1);
+            bytes_written += result > 0 ? result : 0;
+            return result;
+        case SFS_OP_READV:
+            result = vector_io(r, 0);
+            bytes_read += result > 0 ? result : 0;
+            return result;
+        case SFS_OP_MAP: {
+            void *view = sfs_map(fd_of(r->fd), r->offset, r->length, r->flags & SFS_TRACE_WRITABLE);
+            for (int i = 0; view && i < SFS_MAX_MAPS; i++) {
+                if (views[i].view == NULL) {
+                    views[i].id = r->result;
+                    views[i].view = view;
+                    break;
+                }
+            }
+            return view ? 0 : -1;
+        }
+        case SFS_OP_UNMAP:
+            for (int i = 0; i < SFS_MAX_MAPS; i++) {
+                if (views[i].view && views[i].id == r->fd) {
+                    void *view = views[i].view;
+                    views[i].view = NULL;
+                    return sfs_unmap(view);
+                }
+            }
+            return sfs_unmap(NULL);
+        case SFS_OP_FSEEK:
+            return sfs_fseek(fd_of(r->fd), r->offset);
+        case SFS_OP_FFLUSH:
+            return sfs_fflush(fd_of(r->fd));
+        case SFS_OP_FALLOCATE:
+            return sfs_fallocate(fd_of(r->fd), r->offset, r->length);
+        case SFS_OP_REMOVE:
+            return sfs_remove(name);
+        case SFS_OP_CLONE: {
+            char *dst = strchr(name, '/');      //Source and destination, see sfs_clone
+            if (dst == NULL) {
+                return -1;
+            }
+            char *src = strndup(name, dst - name);
+            result = sfs_clone(src, dst + 1);
+            free(src);
+            return result;
+        }
+        case SFS_OP_SNAPSHOT_CREATE:
+            return sfs_snapshot_create();
+        case SFS_OP_SNAPSHOT_MOUNT:
+            result = sfs_snapshot_mount(r->fd);
+            if (result == 0) {
+                forget_files();     //Mounting closes every file
+            }
+            return result;
+        case SFS_OP_SNAPSHOT_DELETE:
+            return sfs_snapshot_delete(r->fd);
+        case SFS_OP_FRAG_REPORT:
+            if (r->length < 0) {
+                sfs_frag_stats(&info);
+                return 0;
+            }
+            return sfs_frag_report(r->length > 0 ? buffer(r->length) : NULL, r->length);
+        case SFS_OP_DEFRAG:
+            return sfs_defrag_step(r->length);
+        case SFS_OP_LOG_CLEAN:
+            return sfs_log_clean(r->length);
+    }
+    return -1;
+}
+
+int same_result(sfs_trace_record *r, int result) {
+    switch (r->op) {
+        case SFS_OP_FWRITE: case SFS_OP_FREAD: case SFS_OP_WRITEV: case SFS_OP_READV:
+        case SFS_OP_GETFILESIZE: case SFS_OP_READDIR:
+            return result == r->result;
+    }
+    return (result < 0) == (r->result < 0);
+}
+
+void record(op_result *o, double us, double traced_us, int failed) {
+    if (o->calls == o->capacity) {
+        o->capacity = o->capacity ? 2 * o->capacity : 64;
+        o->lat = realloc(o->lat, o->capacity * sizeof(double));
+    }
+    o->lat[o->calls++] = us;
+    o->total_us += us;
+    o->traced_us += traced_us;
+    o->errors += failed;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(op_result *o, double pct) {      //lat must already be sorted
+    int i = (int)(pct / 100.0 * (o->calls - 1) + 0.5);
+    return o->calls ? o->lat[i] : 0;
+}
+
+void list(FILE *f) {
+    sfs_trace_record r;
+    char name[65536];
+
+    printf("%12s %-16s %5s %8s %8s %6s %8s %10s  name\n",
+           "start_us", "call", "fd", "offset", "length", "flags", "result", "latency_us");
+    while (read_record(f, &r, name)) {
+        printf("%12.1f %-16s %5d %8d %8d %6d %8d %10.1f  %s\n", r.start_ns / 1e3, sfs_op_name(r.op),
+               r.fd, r.offset, r.length, r.flags, r.result, r.latency_ns / 1e3, name);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt, paced = 0, listing = 0;
+    char *profile = "none";
+    char magic[8], name[65536];
+    uint32_t header[2];
+    sfs_trace_record r;
+
+    while ((opt = getopt(argc, argv, "p:Pl")) != -1) {
+        switch (opt) {
+            case 'p': profile = optarg; break;
+            case 'P': paced = 1; break;
+            case 'l': listing = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-p none|hdd|ssd] [-P] [-l] trace\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-p none|hdd|ssd] [-P] [-l] trace\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[optind], "rb");
+    if (f == NULL || fread(magic, 8, 1, f) != 1 || memcmp(magic, SFS_TRACE_MAGIC, 8) != 0
+        || fread(header, sizeof(header), 1, f) != 1) {
+        fprintf(stderr, "%s: not an SFS trace\n", argv[optind]);
+        return 1;
+    }
+    if (header[0] != SFS_TRACE_VERSION || header[1] != sizeof(sfs_trace_record)) {
+        fprintf(stderr, "%s: trace version %u is not supported\n", argv[optind], header[0]);
+        return 1;
+    }
+    if (listing) {
+        list(f);
+        fclose(f);
+        return 0;
+    }
+    if (disk_model_preset(profile, &model) != 0) {
+        return 1;
+    }
+
+    report = fdopen(dup(fileno(stdout)), "w");      //Keep the report clean of SFS messages
+    freopen("/dev/null", "w", stdout);
+
+    sfs_t *fs = sfs_create(IMAGE);
+    sfs_select(fs);
+    set_disk_model(&model);
+    mksfs(1);
+    sfs_stats_reset();
+    forget_files();
+
+    long calls = 0, differed = 0;
+    double traced_end = 0, busy_us = 0;
+    double start = now_us();
+    while (read_record(f, &r, name)) {
+        if (r.op >= SFS_OP_COUNT) {
+            continue;
+        }
+        if (paced) {
+            double wait = start + r.start_ns / 1e3 - now_us();
+            if (wait > 0) {
+                usleep((useconds_t) wait);
+            }
+        }
+        double dev_start = disk_elapsed_us();
+        double t = now_us();
+        int result = replay(&r, name);
+        t = now_us() - t;
+        if (!model.sleep) {         //Add the modeled device time that was not slept
+            t += disk_elapsed_us() - dev_start;
+        }
+
+        record(&results[r.op], t, r.latency_ns / 1e3, result < 0);
+        differed += !same_result(&r, result);
+        busy_us += t;
+        calls++;
+        if (r.start_ns / 1e3 + r.latency_ns / 1e3 > traced_end) {
+            traced_end = r.start_ns / 1e3 + r.latency_ns / 1e3;
+        }
+    }
+    double wall_us = now_us() - start;
+    fclose(f);
+
+    fprintf(report, "%ld calls, traced over %.3f s, replayed %s in %.3f s (%.3f s in calls)\n",
+            calls, traced_end / 1e6, paced ? "paced" : "back to back", wall_us / 1e6, busy_us / 1e6);
+    fprintf(report, "%.1f calls/s, %.3f MB read, %.3f MB written, %.3f MB/s\n",
+            busy_us > 0 ? calls * 1e6 / busy_us : 0, bytes_read / 1e6, bytes_written / 1e6,
+            busy_us > 0 ? (bytes_read + bytes_written) / busy_us : 0);      //bytes/us == MB/s
+    fprintf(report, "%-16s %8s %7s %11s %11s %9s %9s %9s\n",
+            "call", "calls", "errors", "traced_avg", "replay_avg", "p50", "p99", "max");
+    for (int op = 0; op < SFS_OP_COUNT; op++) {
+        op_result *o = &results[op];
+        if (o->calls == 0) {
+            continue;
+        }
+        qsort(o->lat, o->calls, sizeof(double), compare_double);
+        fprintf(report, "%-16s %8ld %7ld %11.1f %11.1f %9.1f %9.1f %9.1f\n",
+                sfs_op_name(op), o->calls, o->errors, o->traced_us / o->calls, o->total_us / o->calls,
+                percentile(o, 50), percentile(o, 99), percentile(o, 100));
+        free(o->lat);
+    }
+    fprintf(report, "latencies in us; %ld calls returned something else than traced\n", differed);
+
+    sfs_destroy(fs);
+    unlink(IMAGE);
+    free(data);
+    fclose(report);
+    return 0;
+}
@@ -0,0 +1,278 @@
+/* ======================================================================== */
+/* sfs_snapshot:                                                            */
+/* Copy-on-write snapshots. Taking a snapshot copies the metadata (i-Node   */
+/* table and directory) to fresh blocks and adds the snapshot as an owner   */
+/* of every data and indirect block the live files use, so no data is       */
+/* copied. From then on, writing a shared block gives the live file a copy  */
+/* of its own (dedup_write, chunk_store, store_slots) and removing a file   */
+/* only drops a reference, so the snapshot keeps seeing the old contents.   */
+/* The superblock points at a single block listing the snapshots.           */
+/* A mounted snapshot replaces the live tables in memory and is read-only,  */
+/* mksfs(0) goes back to the live file system.                              */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sfs_api.h"
+
+static int load_records(snapshot_record *records) {
+    memset(records, 0, SFS_MAX_SNAPSHOTS * sizeof(snapshot_record));
+    if (sfs->snapshot_root >= 0
+        && read_meta(SFS_REGION_SNAPSHOT, sfs->snapshot_root, SFS_MAX_SNAPSHOTS * sizeof(snapshot_record), records) < 0) {
+        printf("SFS_API: CANNOT READ SNAPSHOT LIST; READ ERROR.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void write_list(int *blocks, char *data, int size) {    //Spreads a structure over scattered blocks
+    for (int i = 0; i * BLOCK_SIZE < size; i++) {
+        int n = size - i*BLOCK_SIZE < BLOCK_SIZE ? size - i*BLOCK_SIZE : BLOCK_SIZE;
+        write_meta(SFS_REGION_SNAPSHOT, blocks[i], n, data + i*BLOCK_SIZE);
+    }
+}
+
+static int read_list(int *blocks, char *data, int size) {     //-1 if a block can't be read
+    for (int i = 0; i * BLOCK_SIZE < size; i++) {
+        int n = size - i*BLOCK_SIZE < BLOCK_SIZE ? size - i*BLOCK_SIZE : BLOCK_SIZE;
+        if (read_meta(SFS_REGION_SNAPSHOT, blocks[i], n, data + i*BLOCK_SIZE) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ======================================================================== */
+/* table_slots:                                                             */
+/* The block pointers of every file in an i-Node table, all read before     */
+/* any reference count changes, so a read error leaves every count as it    */
+/* was. File i has counts[i] slots (0 for a free i-Node) starting at        */
+/* i*MAX_FILE_BLOCKS. NULL if any of them can't be read.                    */
+/* ======================================================================== */
+static int *table_slots(i_node *table, int *counts) {
+    int *all = malloc(INODE_AMOUNT * MAX_FILE_BLOCKS * sizeof(int));
+    if (all == NULL) {
+        printf("SFS_API: SNAPSHOT OPERATION FAILED; OUT OF MEMORY.\n");
+        return NULL;
+    }
+    for (int i = 1; i < INODE_AMOUNT; i++) {
+        counts[i] = table[i].size == -1 ? 0 : load_slots(&table[i], all + i*MAX_FILE_BLOCKS);
+        if (counts[i] < 0) {
+            printf("SFS_API: SNAPSHOT OPERATION FAILED; READ ERROR.\n");
+            free(all);
+            return NULL;
+        }
+    }
+    return all;
+}
+
+static int find_record(snapshot_record *records, int id) {
+    if (sfs->read_only) {
+        printf("SFS_API: SNAPSHOT OPERATIONS NEED THE LIVE FILE SYSTEM MOUNTED.\n");
+        return -1;
+    }
+    if (load_records(records) < 0) {
+        return -1;
+    }
+    if (id < 0 || id >= SFS_MAX_SNAPSHOTS || !records[id].in_use) {
+        printf("SFS_API: SNAPSHOT %d DOES NOT EXIST.\n", id);
+        return -1;
+    }
+    return 0;
+}
+
+/* ======================================================================== */
+/* snapshot_create:                                                         */
+/* Returns the id of the new snapshot. Costs the metadata copies and one    */
+/* reference count update per block in use, no data block is read or       */
+/* written.                                                                 */
+/* ======================================================================== */
+int snapshot_create() {
+    snapshot_record records[SFS_MAX_SNAPSHOTS];
+    int counts[INODE_AMOUNT];
+
+    if (sfs->read_only) {
+        printf("SFS_API: SNAPSHOT OPERATIONS NEED THE LIVE FILE SYSTEM MOUNTED.\n");
+        return -1;
+    }
+    if (load_records(records) < 0) {
+        return -1;
+    }
+    int id = 0;
+    while (id < SFS_MAX_SNAPSHOTS && records[id].in_use) {
+        id++;
+    }
+    if (id == SFS_MAX_SNAPSHOTS) {
+        printf("SFS_API: CANNOT TAKE SNAPSHOT; ALL %d SNAPSHOT SLOTS IN USE.\n", SFS_MAX_SNAPSHOTS);
+        return -1;
+    }
+    if (append_flush_all() < 0) {       //The snapshot has what the files read as
+        return -1;
+    }
+    i_node *copy = malloc(sizeof(sfs->i_node_table));
+    if (copy == NULL) {
+        printf("SFS_API: CANNOT TAKE SNAPSHOT; OUT OF MEMORY.\n");
+        return -1;
+    }
+    int *slots = table_slots(sfs->i_node_table, counts);
+    if (slots == NULL) {
+        free(copy);
+        return -1;
+    }
+
+    int needed = SNAPSHOT_META_BLOCKS + (sfs->snapshot_root < 0);     //The list itself on the first snapshot
+    int taken[SNAPSHOT_META_BLOCKS + 1];
+    for (int i = 0; i < needed; i++) {
+        taken[i] = get_free_block();
+        if (taken[i] < 0) {
+            for (int j = 0; j < i; j++) {
+                set_bit(taken[j]);
+            }
+            free(slots);
+            free(copy);
+            printf("SFS_API: CANNOT TAKE SNAPSHOT; NO MORE FREE BLOCKS AVAILABLE.\n");
+            return -1;
+        }
+        remove_bit(taken[i]);
+    }
+    if (sfs->snapshot_root < 0) {
+        sfs->snapshot_root = taken[SNAPSHOT_META_BLOCKS];
+        write_superblock();
+    }
+
+    for (int i = 1; i < INODE_AMOUNT; i++) {    //The snapshot becomes an owner of every block in use
+        if (sfs->i_node_table[i].size == -1) {
+            continue;
+        }
+        for (int j = 0; j < counts[i]; j++) {
+            if (slots[i*MAX_FILE_BLOCKS + j] >= 0) {
+                block_share(slots[i*MAX_FILE_BLOCKS + j]);
+            }
+        }
+        if (sfs->i_node_table[i].indirect_pointers >= 0) {
+            block_share(sfs->i_node_table[i].indirect_pointers);
+        }
+    }
+    free(slots);
+
+    snapshot_record *r = &records[id];
+    r->in_use = 1;
+    r->created = (int) time(NULL);
+    memcpy(r->blocks, taken, sizeof(r->blocks));
+
+    memcpy(copy, sfs->i_node_table, sizeof(sfs->i_node_table));
+    for (int i = 0; i < DIRECTORY_BLOCKS; i++) {    //The copied root i-Node points at the copied directory
+        copy[0].pointers[i] = r->blocks[SNAPSHOT_INODE_BLOCKS + i];
+    }
+    write_list(r->blocks, (char *) copy, sizeof(sfs->i_node_table));
+    write_list(r->blocks + SNAPSHOT_INODE_BLOCKS, (char *) sfs->root_directory, sizeof(sfs->root_directory));
+    free(copy);
+
+    write_meta(SFS_REGION_SNAPSHOT, sfs->snapshot_root, sizeof(records), records);
+    write_bitmap();
+    log_checkpoint();               //The list is written in place, the blocks it names must be too
+    return id;
+}
+
+/* ======================================================================== */
+/* snapshot_mount:                                                          */
+/* Replaces the live i-Node table and directory in memory with the ones of  */
+/* the snapshot. Open files are closed and writes are refused until         */
+/* mksfs(0) mounts the live file system again. Refused while any file has   */
+/* views (sfs_map), they would point at files that are no longer open.      */
+/* ======================================================================== */
+int snapshot_mount(int id) {
+    snapshot_record records[SFS_MAX_SNAPSHOTS];
+
+    if (find_record(records, id) < 0) {
+        return -1;
+    }
+    if (map_count(-1) > 0) {
+        printf("SFS_API: CANNOT MOUNT SNAPSHOT; FILES ARE STILL MAPPED.\n");
+        return -1;
+    }
+    if (append_flush_all() < 0) {
+        return -1;
+    }
+    log_checkpoint();               //mksfs(0) reads the live tables back from disk
+    i_node *live = malloc(sizeof(sfs->i_node_table));
+    if (live == NULL) {
+        printf("SFS_API: CANNOT MOUNT SNAPSHOT; OUT OF MEMORY.\n");
+        return -1;
+    }
+    memcpy(live, sfs->i_node_table, sizeof(sfs->i_node_table));
+    if (read_list(records[id].blocks, (char *) sfs->i_node_table, sizeof(sfs->i_node_table)) < 0 || read_directory() < 0) {
+        memcpy(sfs->i_node_table, live, sizeof(sfs->i_node_table));     //The live file system stays mounted
+        free(live);
+        printf("SFS_API: CANNOT MOUNT SNAPSHOT; READ ERROR.\n");
+        return -1;
+    }
+    free(live);
+    append_reset();
+
+    for (int i = 0; i < MAX_FD_AMOUNT; i++) {
+        sfs->open_fd_table[i].inode = 0;
+        sfs->open_fd_table[i].rwpointer = -1;
+    }
+    sfs->root_directory_position = -1;
+    chunk_cache_invalidate(-1);     //Cached chunks are keyed by live i-Node numbers
+    map_reset();
+    sfs->read_only = 1;
+    return 0;
+}
+
+/* ======================================================================== */
+/* snapshot_delete:                                                         */
+/* Drops the snapshot's reference to every block it uses, blocks no live    */
+/* file shares are freed, and frees its metadata copies.                    */
+/* ======================================================================== */
+int snapshot_delete(int id) {
+    snapshot_record records[SFS_MAX_SNAPSHOTS];
+    int counts[INODE_AMOUNT];
+    int *slots;
+
+    if (find_record(records, id) < 0) {
+        return -1;
+    }
+    i_node *copy = malloc(sizeof(sfs->i_node_table));
+    if (copy == NULL) {
+        printf("SFS_API: CANNOT DELETE SNAPSHOT; OUT OF MEMORY.\n");
+        return -1;
+    }
+    if (read_list(records[id].blocks, (char *) copy, sizeof(sfs->i_node_table)) < 0) {
+        free(copy);
+        printf("SFS_API: CANNOT DELETE SNAPSHOT; READ ERROR.\n");
+        return -1;
+    }
+    if ((slots = table_slots(copy, counts)) == NULL) {
+        free(copy);
+        return -1;
+    }
+
+    for (int i = 1; i < INODE_AMOUNT; i++) {
+        if (copy[i].size == -1) {
+            continue;
+        }
+        for (int j = 0; j < counts[i]; j++) {
+            if (slots[i*MAX_FILE_BLOCKS + j] >= 0) {
+                block_release(slots[i*MAX_FILE_BLOCKS + j]);
+            }
+        }
+        if (copy[i].indirect_pointers >= 0) {
+            block_release(copy[i].indirect_pointers);
+        }
+    }
+    free(slots);
+    free(copy);
+
+    for (int i = 0; i < SNAPSHOT_META_BLOCKS; i++) {
+        set_bit(records[id].blocks[i]);
+    }
+    records[id].in_use = 0;
+    write_meta(SFS_REGION_SNAPSHOT, sfs->snapshot_root, sizeof(records), records);
+    write_bitmap();
+    log_checkpoint();
+    return 0;
+}
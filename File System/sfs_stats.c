@@ -0,0 +1,210 @@
+/* ======================================================================== */
+/* sfs_stats:                                                               */
+/* Always-on instrumentation for the SFS API. Every sfs_* call is timed     */
+/* into a log2 latency histogram, and every block request the call issues   */
+/* is charged both to the call and to the on-disk region it touched.        */
+/* Nested API calls are charged to the outermost one.                       */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+static const char *op_names[SFS_OP_COUNT] = {
+    "mksfs", "getnextfilename", "getfilesize", "fopen", "fclose",
+    "fwrite", "fread", "fseek", "remove", "snapshot_create", "snapshot_mount", "snapshot_delete",
+    "writev", "readv", "map", "unmap", "frag_report", "defrag", "fallocate",
+    "fflush", "readdir", "log_clean", "clone"
+};
+static const char *region_names[SFS_REGION_COUNT] = {
+    "superblock", "inode_table", "bitmap", "directory", "indirect", "data", "checksum", "refcount", "snapshot"
+};
+static const char *cache_names[SFS_CACHE_COUNT] = {
+    "inode_table", "bitmap", "directory", "chunk"
+};
+
+void stats_begin(int op) {
+    if (sfs->op_depth++ == 0) {
+        sfs->current_op = op;
+        clock_gettime(CLOCK_MONOTONIC, &sfs->op_start);
+    }
+}
+
+int stats_end(int op, int result) {
+    if (--sfs->op_depth > 0) {
+        return result;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double us = (now.tv_sec - sfs->op_start.tv_sec) * 1e6 + (now.tv_nsec - sfs->op_start.tv_nsec) / 1e3;
+
+    int bucket = 0;
+    for (long t = (long) us; t > 1 && bucket < SFS_HIST_BUCKETS - 1; t >>= 1) {    //floor(log2(us))
+        bucket++;
+    }
+
+    sfs_op_stats *s = &sfs->stats.ops[op];
+    s->calls++;
+    s->total_us += us;
+    s->latency_hist[bucket]++;
+    if (result < 0) {
+        s->errors++;
+    }
+    sfs->current_op = -1;
+    if (sfs->trace) {
+        trace_end(op, result, &now);
+    }
+    return result;
+}
+
+void stats_io(int region, int is_write, int nblocks) {
+    sfs_region_stats *r = &sfs->stats.regions[region];
+    sfs_op_stats *o = sfs->current_op >= 0 ? &sfs->stats.ops[sfs->current_op] : NULL;
+
+    if (is_write) {
+        r->writes++;
+        r->blocks_written += nblocks;
+        if (o) {
+            o->writes++;
+            o->blocks_written += nblocks;
+        }
+    }
+    else {
+        r->reads++;
+        r->blocks_read += nblocks;
+        if (o) {
+            o->reads++;
+            o->blocks_read += nblocks;
+        }
+    }
+}
+
+void stats_cache(int cache, int hits, int misses, int flushes) {
+    sfs->stats.caches[cache].hits += hits;
+    sfs->stats.caches[cache].misses += misses;
+    sfs->stats.caches[cache].flushes += flushes;
+}
+
+void stats_cache_evict(int cache) {
+    sfs->stats.caches[cache].evictions++;
+}
+
+void stats_checksum(int verified, int mismatches, int blocks_flushed) {
+    sfs->stats.checksum.verified += verified;
+    sfs->stats.checksum.mismatches += mismatches;
+    sfs->stats.checksum.blocks_flushed += blocks_flushed;
+}
+
+void stats_dedup(int hits, int misses, int cow_copies) {
+    sfs->stats.dedup.hits += hits;
+    sfs->stats.dedup.misses += misses;
+    sfs->stats.dedup.cow_copies += cow_copies;
+}
+
+int region_read(int region, int start, int nblocks, void *buffer) {     //Every block read of the file system goes through here
+    stats_io(region, 0, nblocks);
+    int result = read_blocks(start, nblocks, buffer);
+    if (result >= 0 && region != SFS_REGION_CHECKSUM && checksum_verify(start, nblocks, buffer) > 0) {
+        return -1;
+    }
+    return result;
+}
+
+int region_write(int region, int start, int nblocks, void *buffer) {    //Every block write of the file system goes through here
+    stats_io(region, 1, nblocks);
+    if (region != SFS_REGION_CHECKSUM && region != SFS_REGION_DATA) {
+        checksum_open(start, nblocks);      //Rewritten in place: a crash before the flush must not fail the mount
+    }
+    if (region != SFS_REGION_CHECKSUM) {
+        checksum_update(start, nblocks, buffer);
+    }
+    if (region == SFS_REGION_DATA) {
+        dedup_forget(start, nblocks);       //The index must never point at overwritten content
+    }
+    return write_blocks(start, nblocks, buffer);
+}
+
+void region_discard(int start, int nblocks) {      //Freed blocks read as zeros once discarded
+    static char zero[BLOCK_SIZE];
+    dedup_forget(start, nblocks);
+    if (discard_blocks(start, nblocks) < 0) {
+        return;                             //Old contents are still there, so are their checksums
+    }
+    for (int block = start; block < start + nblocks; block++) {
+        checksum_update(block, 1, zero);
+    }
+}
+
+const char *sfs_op_name(int op) {
+    return op >= 0 && op < SFS_OP_COUNT ? op_names[op] : "unknown";
+}
+
+void sfs_stats(sfs_statistics *out) {
+    *out = sfs->stats;
+}
+
+void sfs_stats_reset() {
+    memset(&sfs->stats, 0, sizeof(sfs->stats));
+}
+
+/* ======================================================================== */
+/* sfs_stats_format:                                                        */
+/* Renders the counters as text (the content of /.sfs_stats). Behaves like  */
+/* snprintf: returns the full length even when buf is too small or NULL.    */
+/* ======================================================================== */
+int sfs_stats_format(char *buf, int size) {
+    char line[512];
+    int len = 0;
+
+    #define EMIT(...) do {                                                  \
+        int n = snprintf(line, sizeof(line), __VA_ARGS__);                  \
+        if (buf && len < size) {                                            \
+            snprintf(buf + len, size - len, "%s", line);                    \
+        }                                                                   \
+        len += n;                                                           \
+    } while (0)
+
+    EMIT("# op calls errors reads writes blocks_read blocks_written avg_us hist_log2_us\n");
+    for (int i = 0; i < SFS_OP_COUNT; i++) {
+        sfs_op_stats *s = &sfs->stats.ops[i];
+        EMIT("%s %ld %ld %ld %ld %ld %ld %.1f", op_names[i], s->calls, s->errors, s->reads,
+             s->writes, s->blocks_read, s->blocks_written, s->calls ? s->total_us / s->calls : 0.0);
+        int last = SFS_HIST_BUCKETS - 1;
+        while (last > 0 && s->latency_hist[last] == 0) {
+            last--;
+        }
+        for (int b = 0; b <= last; b++) {
+            EMIT(" %ld", s->latency_hist[b]);
+        }
+        EMIT("\n");
+    }
+
+    EMIT("# region reads writes blocks_read blocks_written\n");
+    for (int i = 0; i < SFS_REGION_COUNT; i++) {
+        sfs_region_stats *r = &sfs->stats.regions[i];
+        EMIT("region.%s %ld %ld %ld %ld\n", region_names[i], r->reads, r->writes,
+             r->blocks_read, r->blocks_written);
+    }
+
+    EMIT("# cache hits misses flushes evictions\n");
+    for (int i = 0; i < SFS_CACHE_COUNT; i++) {
+        sfs_cache_stats *c = &sfs->stats.caches[i];
+        EMIT("cache.%s %ld %ld %ld %ld\n", cache_names[i], c->hits, c->misses, c->flushes, c->evictions);
+    }
+
+    EMIT("# checksum verified mismatches blocks_flushed\n");
+    EMIT("checksum %ld %ld %ld\n", sfs->stats.checksum.verified, sfs->stats.checksum.mismatches,
+         sfs->stats.checksum.blocks_flushed);
+
+    EMIT("# dedup hits misses cow_copies\n");
+    EMIT("dedup %ld %ld %ld\n", sfs->stats.dedup.hits, sfs->stats.dedup.misses, sfs->stats.dedup.cow_copies);
+
+    EMIT("# log checkpoints blocks_appended segments_opened blocks_cleaned low_space_checkpoints\n");
+    EMIT("log %ld %ld %ld %ld %ld\n", sfs->stats.log.checkpoints, sfs->stats.log.blocks_appended,
+         sfs->stats.log.segments_opened, sfs->stats.log.blocks_cleaned, sfs->stats.log.low_space_checkpoints);
+    #undef EMIT
+    return len;
+}
@@ -0,0 +1,242 @@
+/* sfs_test4.c
+ *
+ * Tests for sfs_clone: the two files share every block until one of them
+ * is written, either side can be removed, and a write that finds no block
+ * for its copy fails without touching either file. The image is checked
+ * with sfs_fsck at the end (make sfs_fsck first).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "sfs_api.h"
+
+#define FILE_BLOCKS 20          /* Past the 12 direct pointers, so the indirect block is shared too */
+#define FILE_BYTES (FILE_BLOCKS * BLOCK_SIZE)
+
+static char source[FILE_BYTES];         /* What the source file should hold */
+static char copy[FILE_BYTES];           /* What the clone should hold */
+static char buffer[MAX_FILE_SIZE];
+
+/* pattern() - fill a buffer with bytes that differ from file to file.
+ */
+static void pattern(char *buf, int length, int seed)
+{
+  int i;
+
+  for (i = 0; i < length; i++) {
+    buf[i] = (char) (seed * 131 + i * 7 + (i >> 10));
+  }
+}
+
+static int free_blocks()
+{
+  sfs_frag_info info;
+
+  sfs_frag_stats(&info);
+  return info.free_blocks;
+}
+
+/* same() - returns 1 if the closed file holds exactly length bytes of
+ * expect.
+ */
+static int same(char *name, const char *expect, int length)
+{
+  int fd = sfs_fopen(name);
+  int n;
+
+  if (fd < 0) {
+    return 0;
+  }
+  sfs_fseek(fd, 0);
+  n = sfs_fread(fd, buffer, length);
+  sfs_fclose(fd);
+  return n == length && memcmp(buffer, expect, length) == 0 && sfs_getfilesize(name) == length;
+}
+
+static int write_file(char *name, int offset, const char *data, int length)
+{
+  int fd = sfs_fopen(name);
+  int n;
+
+  if (fd < 0) {
+    return -1;
+  }
+  sfs_fseek(fd, offset);
+  n = sfs_fwrite(fd, data, length);
+  sfs_fclose(fd);
+  return n;
+}
+
+/* fill_disk() - uses up every block but leave of them, in files named
+ * FILL0, FILL1, ...  Returns how many fill files there are.
+ */
+static int fill_disk(int leave)
+{
+  char name[16];
+  int count = 0;
+
+  pattern(buffer, leave * BLOCK_SIZE, 99);
+  write_file("KEEP", 0, buffer, leave * BLOCK_SIZE);
+  for (;;) {
+    sprintf(name, "FILL%d", count++);
+    pattern(buffer, MAX_FILE_SIZE, count);
+    if (write_file(name, 0, buffer, MAX_FILE_SIZE) < 0) {
+      break;
+    }
+  }
+  sfs_remove("KEEP");
+  return count;
+}
+
+static void empty_disk(int count)
+{
+  char name[16];
+  int i;
+
+  for (i = 0; i < count; i++) {
+    sprintf(name, "FILL%d", i);
+    sfs_remove(name);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int error_count = 0;
+  int before, fills, status;
+  char x = 'X';
+
+  mksfs(1);
+
+  /* A clone reads as its source and costs no data blocks.
+   */
+  pattern(source, FILE_BYTES, 1);
+  write_file("SOURCE", 0, source, FILE_BYTES);
+  memcpy(copy, source, FILE_BYTES);
+  before = free_blocks();
+  if (sfs_clone("SOURCE", "CLONE") != 0) {
+    fprintf(stderr, "ERROR: sfs_clone failed\n");
+    error_count++;
+  }
+  if (free_blocks() != before) {
+    fprintf(stderr, "ERROR: clone took %d blocks, it should share them all\n", before - free_blocks());
+    error_count++;
+  }
+  if (!same("CLONE", copy, FILE_BYTES)) {
+    fprintf(stderr, "ERROR: clone does not read as its source\n");
+    error_count++;
+  }
+  if (sfs_clone("SOURCE", "CLONE") >= 0 || sfs_clone("MISSING", "OTHER") >= 0) {
+    fprintf(stderr, "ERROR: clone onto an existing name or from a missing file succeeded\n");
+    error_count++;
+  }
+
+  /* Writes to either side stay on that side, in a direct and an indirect
+   * block.
+   */
+  pattern(buffer, 100, 2);
+  write_file("CLONE", 100, buffer, 100);
+  memcpy(copy + 100, buffer, 100);
+  write_file("CLONE", 15 * BLOCK_SIZE + 5, &x, 1);
+  copy[15 * BLOCK_SIZE + 5] = x;
+  pattern(buffer, 2 * BLOCK_SIZE, 3);
+  write_file("SOURCE", 17 * BLOCK_SIZE, buffer, 2 * BLOCK_SIZE);
+  memcpy(source + 17 * BLOCK_SIZE, buffer, 2 * BLOCK_SIZE);
+  if (!same("SOURCE", source, FILE_BYTES)) {
+    fprintf(stderr, "ERROR: writing the clone changed its source\n");
+    error_count++;
+  }
+  if (!same("CLONE", copy, FILE_BYTES)) {
+    fprintf(stderr, "ERROR: writing the source changed its clone\n");
+    error_count++;
+  }
+
+  /* Removing the source leaves the clone whole, removing a clone leaves
+   * its source whole.
+   */
+  sfs_remove("SOURCE");
+  if (!same("CLONE", copy, FILE_BYTES)) {
+    fprintf(stderr, "ERROR: removing the source changed the clone\n");
+    error_count++;
+  }
+  sfs_clone("CLONE", "SECOND");
+  sfs_remove("SECOND");
+  if (!same("CLONE", copy, FILE_BYTES)) {
+    fprintf(stderr, "ERROR: removing a clone changed its source\n");
+    error_count++;
+  }
+  sfs_remove("CLONE");
+  if (free_blocks() != before + FILE_BLOCKS + 1) {
+    fprintf(stderr, "ERROR: %d blocks free after removing every file, expected %d\n",
+            free_blocks(), before + FILE_BLOCKS + 1);
+    error_count++;
+  }
+
+  /* With one free block the clone can't get both a copy of the data block
+   * and of the indirect block that points at it. The write fails and
+   * neither file changes; once there is room it goes through.
+   */
+  pattern(source, FILE_BYTES, 4);
+  write_file("SOURCE", 0, source, FILE_BYTES);
+  memcpy(copy, source, FILE_BYTES);
+  sfs_clone("SOURCE", "CLONE");
+  fills = fill_disk(1);
+  if (free_blocks() != 1) {
+    fprintf(stderr, "Warning: %d blocks left free, the test wants 1\n", free_blocks());
+  }
+  if (write_file("CLONE", 15 * BLOCK_SIZE + 5, &x, 1) >= 0) {
+    fprintf(stderr, "ERROR: clone write succeeded on a full disk\n");
+    error_count++;
+  }
+  if (!same("SOURCE", source, FILE_BYTES) || !same("CLONE", copy, FILE_BYTES)) {
+    fprintf(stderr, "ERROR: failed clone write changed a file\n");
+    error_count++;
+  }
+  sfs_remove("SOURCE");
+  write_file("OTHER", 0, source, 5 * BLOCK_SIZE);   /* Reuses the blocks only the clone holds now if the counts are wrong */
+  if (!same("CLONE", copy, FILE_BYTES)) {
+    fprintf(stderr, "ERROR: clone lost blocks after its source was removed\n");
+    error_count++;
+  }
+  sfs_remove("OTHER");
+
+  /* A new file whose first write can't be stored stays empty and holds
+   * no blocks.
+   */
+  before = free_blocks();
+  if (write_file("FRESH", 0, source, FILE_BYTES) >= 0) {
+    fprintf(stderr, "ERROR: first write of a new file succeeded on a full disk\n");
+    error_count++;
+  }
+  if (sfs_getfilesize("FRESH") != 0 || free_blocks() != before) {
+    fprintf(stderr, "ERROR: failed first write left size %d and %d blocks used\n",
+            sfs_getfilesize("FRESH"), before - free_blocks());
+    error_count++;
+  }
+  sfs_remove("FRESH");
+
+  empty_disk(fills);
+  if (write_file("CLONE", 15 * BLOCK_SIZE + 5, &x, 1) != 1) {
+    fprintf(stderr, "ERROR: clone write failed with free blocks\n");
+    error_count++;
+  }
+  copy[15 * BLOCK_SIZE + 5] = x;
+
+  /* Everything survives a remount and the image checks clean.
+   */
+  mksfs(0);
+  if (!same("CLONE", copy, FILE_BYTES)) {
+    fprintf(stderr, "ERROR: clone differs after remounting\n");
+    error_count++;
+  }
+  status = system("./sfs_fsck Tairov_sfs");
+  if (status != 0) {
+    fprintf(stderr, "ERROR: sfs_fsck exited with status %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    error_count++;
+  }
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
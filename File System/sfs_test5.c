@@ -0,0 +1,979 @@
+/* sfs_test5.c
+ *
+ * Tests for the optional features. Every part formats a fresh disk, turns
+ * its feature on, checks that files read back as written, then checks how
+ * the feature fails (a full disk, a read-only snapshot, ...) and that the
+ * failure leaves the files as they were. The image each part leaves behind
+ * is checked with sfs_fsck (make sfs_fsck first).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "sfs_api.h"
+
+static char test_str[] = "The quick brown fox jumps over the lazy dog.\n";
+
+static char data[MAX_FILE_SIZE];        /* What the file being tested should hold */
+static char other[MAX_FILE_SIZE];       /* What a second file should hold */
+static char buffer[MAX_FILE_SIZE];
+static int error_count = 0;
+
+static void check(int ok, const char *what)
+{
+  if (!ok) {
+    fprintf(stderr, "ERROR: %s\n", what);
+    error_count++;
+  }
+}
+
+/* text() - fill a buffer with test_str over and over, which compresses
+ * and deduplicates well. noise() fills it with bytes that don't.
+ */
+static void text(char *buf, int length)
+{
+  int i;
+
+  for (i = 0; i < length; i++) {
+    buf[i] = test_str[i % (sizeof(test_str) - 1)];
+  }
+}
+
+static void noise(char *buf, int length)
+{
+  int i;
+
+  for (i = 0; i < length; i++) {
+    buf[i] = (char) rand();
+  }
+}
+
+static int free_blocks()
+{
+  sfs_frag_info info;
+
+  sfs_frag_stats(&info);
+  return info.free_blocks;
+}
+
+/* same() - returns 1 if the closed file holds exactly length bytes of
+ * expect.
+ */
+static int same(char *name, const char *expect, int length)
+{
+  int fd = sfs_fopen(name);
+  int n;
+
+  if (fd < 0) {
+    return 0;
+  }
+  sfs_fseek(fd, 0);
+  n = sfs_fread(fd, buffer, length);
+  sfs_fclose(fd);
+  return n == length && memcmp(buffer, expect, length) == 0 && sfs_getfilesize(name) == length;
+}
+
+/* write_file() - small appends are buffered until the file is closed,
+ * so a write only counts if the close worked too.
+ */
+static int write_file(char *name, int offset, const char *buf, int length)
+{
+  int fd = sfs_fopen(name);
+  int n;
+
+  if (fd < 0) {
+    return -1;
+  }
+  sfs_fseek(fd, offset);
+  n = sfs_fwrite(fd, buf, length);
+  if (sfs_fclose(fd) != 0) {
+    n = -1;
+  }
+  return n;
+}
+
+/* fill_disk() - uses up every free block, in files named FILL0, FILL1,
+ * ... holding noise.  Returns how many fill files there are.
+ */
+static int fill_disk()
+{
+  static char fill[MAX_FILE_SIZE];
+  char name[16];
+  int count = 0;
+
+  noise(fill, MAX_FILE_SIZE);
+  for (;;) {
+    sprintf(name, "FILL%d", count++);
+    if (write_file(name, 0, fill, MAX_FILE_SIZE) < 0) {
+      break;
+    }
+  }
+  return count;
+}
+
+static void empty_disk(int count)
+{
+  char name[16];
+  int i;
+
+  for (i = 0; i < count; i++) {
+    sprintf(name, "FILL%d", i);
+    sfs_remove(name);
+  }
+}
+
+static void fsck_image(const char *part, const char *image)
+{
+  char command[300];
+  int status;
+
+  sprintf(command, "./sfs_fsck %s", image);
+  status = system(command);
+  if (status != 0) {
+    fprintf(stderr, "ERROR: %s: sfs_fsck %s exited with status %d\n", part, image,
+            WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    error_count++;
+  }
+}
+
+/* check_image() - remounts, so everything held in memory reaches the
+ * disk, and runs sfs_fsck on the image.
+ */
+static void check_image(const char *part)
+{
+  mksfs(0);
+  fsck_image(part, "Tairov_sfs");
+}
+
+/* Compression: text takes fewer blocks than its size, rewriting part of a
+ * compressed chunk keeps the rest of it, and a chunk that no longer fits
+ * in the free blocks is left as it was.
+ */
+static void test_compression()
+{
+  int before, fills;
+
+  mksfs(1);
+  sfs_set_compression(1);
+  text(data, 40 * BLOCK_SIZE);
+  before = free_blocks();
+  write_file("TEXT", 0, data, 40 * BLOCK_SIZE);
+  check(before - free_blocks() < 40, "compression: text was not stored compressed");
+  check(same("TEXT", data, 40 * BLOCK_SIZE), "compression: compressed file reads back wrong");
+
+  noise(data + 5000, 10);
+  write_file("TEXT", 5000, data + 5000, 10);
+  check(same("TEXT", data, 40 * BLOCK_SIZE), "compression: rewritten chunk reads back wrong");
+  noise(buffer, 8 * BLOCK_SIZE);
+  write_file("NOISE", 0, buffer, 8 * BLOCK_SIZE);
+  memcpy(other, buffer, 8 * BLOCK_SIZE);
+  check(same("NOISE", other, 8 * BLOCK_SIZE), "compression: incompressible file reads back wrong");
+
+  fills = fill_disk();
+  noise(buffer, CHUNK_BYTES);
+  check(write_file("TEXT", 0, buffer, CHUNK_BYTES) < 0, "compression: chunk grew on a full disk");
+  check(same("TEXT", data, 40 * BLOCK_SIZE), "compression: failed chunk write changed the file");
+  empty_disk(fills);
+  check(write_file("TEXT", 0, buffer, CHUNK_BYTES) == CHUNK_BYTES, "compression: chunk write failed with free blocks");
+  memcpy(data, buffer, CHUNK_BYTES);
+  check(same("TEXT", data, 40 * BLOCK_SIZE), "compression: grown chunk reads back wrong");
+  check_image("compression");
+  check(same("TEXT", data, 40 * BLOCK_SIZE), "compression: file differs after remounting");
+}
+
+/* Dedup: a second copy of a file costs no data blocks and still fits on a
+ * full disk, writing to either copy leaves the other alone, and a shared
+ * block that can't be copied is not written.
+ */
+static void test_dedup()
+{
+  sfs_statistics stats;
+  int before, fills;
+  char x = 'X';
+
+  mksfs(1);
+  sfs_set_dedup(1);
+  noise(data, 8 * BLOCK_SIZE);
+  write_file("FIRST", 0, data, 8 * BLOCK_SIZE);
+  before = free_blocks();
+  sfs_stats_reset();
+  write_file("SECOND", 0, data, 8 * BLOCK_SIZE);
+  sfs_stats(&stats);
+  check(free_blocks() == before, "dedup: duplicate file took data blocks");
+  check(stats.dedup.hits == 8, "dedup: duplicate blocks were not found in the index");
+
+  memcpy(other, data, 8 * BLOCK_SIZE);
+  other[100] = x;
+  write_file("SECOND", 100, &x, 1);
+  check(same("FIRST", data, 8 * BLOCK_SIZE), "dedup: writing a duplicate changed the original");
+  check(same("SECOND", other, 8 * BLOCK_SIZE), "dedup: written duplicate reads back wrong");
+
+  sfs_set_dedup(0);             /* The fill files all hold the same noise */
+  fills = fill_disk();
+  sfs_set_dedup(1);
+  check(write_file("THIRD", 0, data, 8 * BLOCK_SIZE) == 8 * BLOCK_SIZE, "dedup: duplicate did not fit on a full disk");
+  check(write_file("FIRST", 2 * BLOCK_SIZE, &x, 1) < 0, "dedup: shared block was written on a full disk");
+  check(same("FIRST", data, 8 * BLOCK_SIZE) && same("THIRD", data, 8 * BLOCK_SIZE),
+        "dedup: failed copy on write changed a file");
+  empty_disk(fills);
+  check(write_file("FIRST", 2 * BLOCK_SIZE, &x, 1) == 1, "dedup: copy on write failed with free blocks");
+  check(same("THIRD", data, 8 * BLOCK_SIZE), "dedup: copy on write changed the other owner");
+  data[2 * BLOCK_SIZE] = x;
+  check(same("FIRST", data, 8 * BLOCK_SIZE), "dedup: copied block reads back wrong");
+  check_image("dedup");
+  check(same("FIRST", data, 8 * BLOCK_SIZE) && same("SECOND", other, 8 * BLOCK_SIZE),
+        "dedup: files differ after remounting");
+}
+
+/* Inline files: up to SFS_INLINE_MAX bytes take no data block, growing
+ * past it moves the file to a block, and a file that finds no block for
+ * that stays inline and unchanged.
+ */
+static void test_inline()
+{
+  int before, fills;
+
+  mksfs(1);
+  text(data, 2 * SFS_INLINE_MAX);
+  before = free_blocks();
+  write_file("SMALL", 0, data, 40);
+  write_file("SMALL", 40, data + 40, SFS_INLINE_MAX - 40);
+  check(free_blocks() == before, "inline: small file took a data block");
+  check(same("SMALL", data, SFS_INLINE_MAX), "inline: small file reads back wrong");
+  data[10] = 'X';
+  write_file("SMALL", 10, data + 10, 1);
+  check(same("SMALL", data, SFS_INLINE_MAX), "inline: rewritten small file reads back wrong");
+
+  fills = fill_disk();
+  check(write_file("SMALL", SFS_INLINE_MAX, data + SFS_INLINE_MAX, SFS_INLINE_MAX) < 0,
+        "inline: small file grew on a full disk");
+  check(same("SMALL", data, SFS_INLINE_MAX), "inline: failed growth changed the file");
+  check(write_file("TINY", 0, data, 20) == 20 && same("TINY", data, 20), "inline: small file did not fit on a full disk");
+  empty_disk(fills);
+  before = free_blocks();
+  check(write_file("SMALL", SFS_INLINE_MAX, data + SFS_INLINE_MAX, SFS_INLINE_MAX) == SFS_INLINE_MAX,
+        "inline: small file did not grow with free blocks");
+  check(before - free_blocks() == 1, "inline: grown file does not use one block");
+  check(same("SMALL", data, 2 * SFS_INLINE_MAX), "inline: grown file reads back wrong");
+  sfs_remove("TINY");
+  check_image("inline");
+  check(same("SMALL", data, 2 * SFS_INLINE_MAX), "inline: file differs after remounting");
+}
+
+/* Snapshots: a mounted snapshot reads as the files did when it was taken
+ * and refuses every change, writing a block the snapshot shares copies it
+ * or fails untouched on a full disk, and deleting the snapshot gives its
+ * blocks back.
+ */
+static void test_snapshots()
+{
+  char small[30];
+  int before, fills, id, fd;
+  char x = 'X';
+
+  mksfs(1);
+  noise(data, 20 * BLOCK_SIZE);
+  write_file("LIVE", 0, data, 20 * BLOCK_SIZE);
+  text(small, sizeof(small));
+  write_file("GONE", 0, small, sizeof(small));
+  memcpy(other, data, 20 * BLOCK_SIZE);
+  id = sfs_snapshot_create();
+  check(id >= 0, "snapshots: sfs_snapshot_create failed");
+
+  write_file("LIVE", 15 * BLOCK_SIZE + 5, &x, 1);
+  data[15 * BLOCK_SIZE + 5] = x;
+  sfs_remove("GONE");
+  write_file("NEW", 0, small, sizeof(small));
+  check(same("LIVE", data, 20 * BLOCK_SIZE), "snapshots: written file reads back wrong");
+
+  check(sfs_snapshot_mount(id) == 0, "snapshots: sfs_snapshot_mount failed");
+  check(same("LIVE", other, 20 * BLOCK_SIZE), "snapshots: snapshot does not have the old contents");
+  check(same("GONE", small, sizeof(small)), "snapshots: snapshot lost a file removed since");
+  check(sfs_getfilesize("NEW") < 0, "snapshots: snapshot has a file created since");
+  fd = sfs_fopen("LIVE");
+  check(sfs_fwrite(fd, &x, 1) < 0, "snapshots: write to a mounted snapshot succeeded");
+  sfs_fclose(fd);
+  check(sfs_fopen("CREATED") < 0, "snapshots: file created in a mounted snapshot");
+  check(sfs_remove("LIVE") < 0, "snapshots: file removed from a mounted snapshot");
+  check(sfs_clone("LIVE", "CLONE") < 0, "snapshots: file cloned in a mounted snapshot");
+  check(sfs_snapshot_create() < 0, "snapshots: snapshot taken of a mounted snapshot");
+  check(sfs_set_compression(1) < 0 && sfs_set_log(1) < 0, "snapshots: feature changed in a mounted snapshot");
+  check(same("LIVE", other, 20 * BLOCK_SIZE), "snapshots: refused calls changed the snapshot");
+
+  mksfs(0);
+  check(same("LIVE", data, 20 * BLOCK_SIZE) && same("NEW", small, sizeof(small)),
+        "snapshots: live files differ after the snapshot was mounted");
+  fills = fill_disk();
+  check(write_file("LIVE", 0, &x, 1) < 0, "snapshots: block shared with a snapshot was written on a full disk");
+  check(sfs_snapshot_create() < 0, "snapshots: snapshot taken on a full disk");
+  check(same("LIVE", data, 20 * BLOCK_SIZE), "snapshots: failed copy on write changed the file");
+  empty_disk(fills);
+
+  before = free_blocks();
+  check(sfs_snapshot_delete(id) == 0, "snapshots: sfs_snapshot_delete failed");
+  check(sfs_snapshot_mount(id) < 0, "snapshots: deleted snapshot was mounted");
+  check(free_blocks() - before == SNAPSHOT_META_BLOCKS + 2,     /* The old data and indirect blocks of LIVE */
+        "snapshots: deleting the snapshot did not give its blocks back");
+  sfs_remove("NEW");
+  check_image("snapshots");
+  check(same("LIVE", data, 20 * BLOCK_SIZE), "snapshots: file differs after remounting");
+}
+
+/* writev/readv: buffers are written and read as one contiguous range, a
+ * read is short at the end of the file, and a batch that is too big or
+ * doesn't fit on the disk is refused whole.
+ */
+static void test_vectors()
+{
+  struct iovec iov[3];
+  char tail[2][40];
+  int fd, fills;
+
+  mksfs(1);
+  noise(data, 23100);
+  fd = sfs_fopen("VECTOR");
+  iov[0].iov_base = data;
+  iov[0].iov_len = 100;
+  iov[1].iov_base = data + 100;
+  iov[1].iov_len = 3000;
+  iov[2].iov_base = data + 3100;
+  iov[2].iov_len = 20000;
+  check(sfs_writev(fd, iov, 3) == 23100, "vectors: sfs_writev did not write every buffer");
+  sfs_fseek(fd, 0);
+  iov[0].iov_base = other;
+  iov[0].iov_len = 5000;
+  iov[1].iov_base = other + 5000;
+  iov[1].iov_len = 18100;
+  check(sfs_readv(fd, iov, 2) == 23100 && memcmp(other, data, 23100) == 0,
+        "vectors: sfs_readv read back wrong");
+  sfs_fseek(fd, 23100 - 50);
+  iov[0].iov_base = tail[0];
+  iov[0].iov_len = 40;
+  iov[1].iov_base = tail[1];
+  iov[1].iov_len = 40;
+  check(sfs_readv(fd, iov, 2) == 50 && memcmp(tail[0], data + 23050, 40) == 0 &&
+        memcmp(tail[1], data + 23090, 10) == 0, "vectors: short sfs_readv at the end of the file is wrong");
+
+  check(sfs_writev(fd, iov, -1) < 0, "vectors: negative buffer count accepted");
+  iov[0].iov_base = buffer;
+  iov[0].iov_len = MAX_FILE_SIZE;
+  iov[1].iov_base = buffer;
+  iov[1].iov_len = 1;
+  check(sfs_writev(fd, iov, 2) < 0, "vectors: batch past the maximum file size accepted");
+  sfs_fclose(fd);
+  check(sfs_writev(fd, iov, 1) < 0, "vectors: sfs_writev on a closed file succeeded");
+
+  fills = fill_disk();
+  fd = sfs_fopen("VECTOR");
+  sfs_fseek(fd, 23100);
+  iov[0].iov_base = buffer;
+  iov[0].iov_len = 3 * BLOCK_SIZE;
+  iov[1].iov_base = buffer;
+  iov[1].iov_len = 2 * BLOCK_SIZE;
+  check(sfs_writev(fd, iov, 2) < 0, "vectors: batch written on a full disk");
+  sfs_fclose(fd);
+  check(same("VECTOR", data, 23100), "vectors: failed batch changed the file");
+  empty_disk(fills);
+  check_image("vectors");
+  check(same("VECTOR", data, 23100), "vectors: file differs after remounting");
+}
+
+/* sfs_map: a view holds the range it was given, a writable one is written
+ * back by sfs_unmap and stays mapped if that fails, and the file can't be
+ * closed nor a snapshot mounted while views are out.
+ */
+static void test_map()
+{
+  char *view, *views[SFS_MAX_MAPS];
+  int fd, fills, i, id;
+
+  mksfs(1);
+  noise(data, 10 * BLOCK_SIZE);
+  write_file("MAPPED", 0, data, 10 * BLOCK_SIZE);
+  id = sfs_snapshot_create();
+  fd = sfs_fopen("MAPPED");
+  view = sfs_map(fd, 1500, 3000, 0);
+  check(view != NULL && memcmp(view, data + 1500, 3000) == 0, "map: view does not hold the range");
+  check(sfs_fclose(fd) < 0, "map: file with a view was closed");
+  check(sfs_snapshot_mount(id) < 0, "map: snapshot mounted while a view is out");
+  check(sfs_unmap(view) == 0, "map: sfs_unmap failed");
+  check(sfs_unmap(view) < 0, "map: view unmapped twice");
+  check(sfs_map(fd, 9 * BLOCK_SIZE, 2 * BLOCK_SIZE, 0) == NULL, "map: range past the end of the file mapped");
+  check(sfs_map(MAX_FD_AMOUNT, 0, 10, 0) == NULL, "map: file that is not open mapped");
+  for (i = 0; i < SFS_MAX_MAPS; i++) {
+    views[i] = sfs_map(fd, i, 10, 0);
+  }
+  check(sfs_map(fd, 0, 10, 0) == NULL, "map: more views handed out than the table holds");
+  for (i = 0; i < SFS_MAX_MAPS; i++) {
+    sfs_unmap(views[i]);
+  }
+
+  /* The snapshot shares every block, so writing a view back needs a copy */
+  view = sfs_map(fd, 2 * BLOCK_SIZE + 10, 100, 1);
+  memset(view, 'X', 100);
+  fills = fill_disk();
+  check(sfs_unmap(view) < 0, "map: view written back on a full disk");
+  check(memcmp(view, "XXXX", 4) == 0, "map: view unmapped although it was not written back");
+  empty_disk(fills);
+  check(sfs_unmap(view) == 0, "map: view not written back with free blocks");
+  memset(data + 2 * BLOCK_SIZE + 10, 'X', 100);
+  check(sfs_fclose(fd) == 0, "map: file with no views left did not close");
+  check(same("MAPPED", data, 10 * BLOCK_SIZE), "map: written back view reads back wrong");
+
+  sfs_snapshot_mount(id);
+  fd = sfs_fopen("MAPPED");
+  check(sfs_map(fd, 0, 10, 1) == NULL, "map: writable view of a mounted snapshot");
+  sfs_fclose(fd);
+  mksfs(0);
+  sfs_snapshot_delete(id);
+  check_image("map");
+}
+
+/* Instances: two threads run a file system each, with the same file
+ * names, and neither sees the other's files, the default instance's, or
+ * its full disk.
+ */
+struct worker {
+  sfs_t *fs;
+  const char *expect;           /* What SAME should hold on the instance */
+  int ok;
+};
+
+static void *instance_worker(void *arg)
+{
+  struct worker *w = arg;
+  char *read_back = malloc(30 * BLOCK_SIZE);
+  int round, fd;
+
+  sfs_select(w->fs);
+  mksfs(1);
+  w->ok = read_back != NULL;
+  for (round = 0; round < 20 && w->ok; round++) {
+    fd = sfs_fopen("SAME");
+    w->ok = sfs_fwrite(fd, w->expect, 30 * BLOCK_SIZE) == 30 * BLOCK_SIZE;
+    sfs_fseek(fd, 0);
+    w->ok &= sfs_fread(fd, read_back, 30 * BLOCK_SIZE) == 30 * BLOCK_SIZE;
+    w->ok &= memcmp(read_back, w->expect, 30 * BLOCK_SIZE) == 0;
+    sfs_fclose(fd);
+    sfs_remove("SAME");
+  }
+  fd = sfs_fopen("SAME");
+  sfs_fwrite(fd, w->expect, 30 * BLOCK_SIZE);
+  sfs_fclose(fd);
+  free(read_back);
+  return NULL;
+}
+
+static void test_instances()
+{
+  struct worker workers[2];
+  pthread_t threads[2];
+  char long_name[300];
+  int i, fills;
+
+  mksfs(1);
+  text(data, 30 * BLOCK_SIZE);
+  write_file("SAME", 0, data, 30 * BLOCK_SIZE);
+  noise(other, 30 * BLOCK_SIZE);
+  noise(buffer, 30 * BLOCK_SIZE);
+  workers[0].fs = sfs_create("Tairov_a");
+  workers[0].expect = other;
+  workers[1].fs = sfs_create("Tairov_b");
+  workers[1].expect = buffer;
+  for (i = 0; i < 2; i++) {
+    pthread_create(&threads[i], NULL, instance_worker, &workers[i]);
+  }
+  for (i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+    check(workers[i].ok, "instances: file read back wrong on a worker's instance");
+  }
+  check(same("SAME", data, 30 * BLOCK_SIZE), "instances: workers changed the default instance");
+
+  fills = fill_disk();
+  sfs_select(workers[0].fs);
+  check(same("SAME", other, 30 * BLOCK_SIZE), "instances: file differs on an instance");
+  check(write_file("MORE", 0, data, 30 * BLOCK_SIZE) == 30 * BLOCK_SIZE,
+        "instances: full default disk stopped a write to another instance");
+  sfs_select(NULL);
+  empty_disk(fills);
+  for (i = 0; i < 2; i++) {
+    sfs_destroy(workers[i].fs);
+  }
+
+  memset(long_name, 'a', sizeof(long_name) - 1);
+  long_name[sizeof(long_name) - 1] = '\0';
+  check(sfs_create(NULL) == NULL && sfs_create(long_name) == NULL, "instances: instance with a bad image name created");
+  check_image("instances");
+  fsck_image("instances", "Tairov_a");
+  fsck_image("instances", "Tairov_b");
+}
+
+/* Async requests: a batch queued at once runs in submission order, with
+ * results collected by sfs_async_wait or handed to a callback, and each
+ * failed request reports what the synchronous call would have.
+ */
+static void count_callback(sfs_request *r, void *arg)
+{
+  if (sfs_async_result(r) >= 0) {
+    (*(int *) arg)++;
+  }
+}
+
+static int wait_result()
+{
+  sfs_request *r = sfs_async_wait(NULL);
+  int result = r ? sfs_async_result(r) : -2;
+
+  sfs_async_free(r);
+  return result;
+}
+
+static void test_async()
+{
+  char name[MAXFILENAME + 2];
+  int fd, i, fills, completed = 0;
+
+  mksfs(1);
+  noise(data, 12 * BLOCK_SIZE);
+  sfs_open_async(NULL, "ASYNC", NULL, NULL);
+  fd = wait_result();
+  check(fd >= 0, "async: file did not open");
+  for (i = 0; i < 3; i++) {
+    sfs_write_async(NULL, fd, i * 4 * BLOCK_SIZE, data + i * 4 * BLOCK_SIZE, 4 * BLOCK_SIZE, NULL, NULL);
+  }
+  sfs_read_async(NULL, fd, 0, other, 12 * BLOCK_SIZE, NULL, NULL);
+  for (i = 0; i < 3; i++) {
+    check(wait_result() == 4 * BLOCK_SIZE, "async: write did not complete");
+  }
+  check(wait_result() == 12 * BLOCK_SIZE && memcmp(other, data, 12 * BLOCK_SIZE) == 0,
+        "async: read queued after the writes did not see them");
+  for (i = 0; i < 4; i++) {
+    sfs_read_async(NULL, fd, i * BLOCK_SIZE, other + i * BLOCK_SIZE, BLOCK_SIZE, count_callback, &completed);
+  }
+  check(sfs_async_wait(NULL) == NULL && completed == 4, "async: callbacks did not all run");
+
+  memset(name, 'a', sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  check(sfs_open_async(NULL, name, NULL, NULL) == NULL, "async: open with a name too long was queued");
+  sfs_read_async(NULL, fd, 20 * BLOCK_SIZE, other, 10, NULL, NULL);
+  check(wait_result() < 0, "async: read past the end of the file succeeded");
+  sfs_close_async(NULL, fd, NULL, NULL);
+  check(wait_result() == 0, "async: close failed");
+  sfs_write_async(NULL, fd, 0, data, 10, NULL, NULL);
+  check(wait_result() < 0, "async: write to a closed file succeeded");
+  check(sfs_async_poll(NULL) == NULL, "async: completion left over");
+
+  fills = fill_disk();
+  sfs_open_async(NULL, "ASYNC", NULL, NULL);
+  fd = wait_result();
+  noise(buffer, 4 * BLOCK_SIZE);
+  sfs_write_async(NULL, fd, 12 * BLOCK_SIZE, buffer, 4 * BLOCK_SIZE, NULL, NULL);
+  check(wait_result() < 0, "async: write succeeded on a full disk");
+  sfs_close_async(NULL, fd, NULL, NULL);
+  wait_result();
+  check(same("ASYNC", data, 12 * BLOCK_SIZE), "async: failed write changed the file");
+  empty_disk(fills);
+  check_image("async");
+  check(same("ASYNC", data, 12 * BLOCK_SIZE), "async: file differs after remounting");
+}
+
+/* Defrag: files written a block at a time in turn are fragmented, the
+ * defragmenter makes each one extent even with a write between steps, and
+ * it leaves files alone when there is no free run or their blocks are
+ * shared with a snapshot.
+ */
+static int fragmented_files()
+{
+  sfs_frag_info info;
+
+  sfs_frag_stats(&info);
+  return info.fragmented_files;
+}
+
+static void test_defrag()
+{
+  char report[4096];
+  int i, id, fills, steps;
+  char x = 'X';
+
+  mksfs(1);
+  noise(data, 16 * BLOCK_SIZE);
+  noise(other, 16 * BLOCK_SIZE);
+  for (i = 0; i < 16; i++) {
+    write_file("A", i * BLOCK_SIZE, data + i * BLOCK_SIZE, BLOCK_SIZE);
+    write_file("B", i * BLOCK_SIZE, other + i * BLOCK_SIZE, BLOCK_SIZE);
+  }
+  check(fragmented_files() == 2, "defrag: interleaved files are not fragmented");
+  check(sfs_frag_report(report, sizeof(report)) < (int) sizeof(report) && strstr(report, "file A 16 ") != NULL,
+        "defrag: report does not list the file");
+
+  id = sfs_snapshot_create();
+  sfs_snapshot_mount(id);
+  check(sfs_defrag_step(64) < 0, "defrag: mounted snapshot was defragmented");
+  mksfs(0);
+  check(sfs_defrag_step(64) == 0, "defrag: blocks shared with a snapshot were moved");
+  sfs_snapshot_delete(id);
+  check(sfs_defrag_step(1) < 0, "defrag: budget too small for a block accepted");
+  fills = fill_disk();
+  check(sfs_defrag_step(64) == 0, "defrag: blocks moved on a full disk");
+  empty_disk(fills);
+  check(fragmented_files() == 2 && same("A", data, 16 * BLOCK_SIZE) && same("B", other, 16 * BLOCK_SIZE),
+        "defrag: refused steps changed the files");
+
+  check(sfs_defrag_step(4) == 2, "defrag: step did not spend its budget");
+  write_file("A", 5 * BLOCK_SIZE, &x, 1);
+  data[5 * BLOCK_SIZE] = x;
+  for (steps = 0; steps < 100 && sfs_defrag_step(8) > 0; steps++) {
+  }
+  check(fragmented_files() == 0, "defrag: files are still fragmented");
+  check(same("A", data, 16 * BLOCK_SIZE) && same("B", other, 16 * BLOCK_SIZE), "defrag: moved files read back wrong");
+  check_image("defrag");
+  check(same("A", data, 16 * BLOCK_SIZE), "defrag: file differs after remounting");
+}
+
+/* fallocate: reserved space reads as zeros and is written without
+ * allocating, and a reservation that doesn't fit gives back every block
+ * it took and leaves the file as it was.
+ */
+static void test_fallocate()
+{
+  int fd, before, fills, id;
+
+  mksfs(1);
+  memset(data, 0, 30 * BLOCK_SIZE);
+  noise(other, 10 * BLOCK_SIZE);
+  write_file("SPARE", 0, other, 10 * BLOCK_SIZE);
+  fd = sfs_fopen("RESERVED");
+  before = free_blocks();
+  check(sfs_fallocate(fd, 0, 30 * BLOCK_SIZE) == 0, "fallocate: sfs_fallocate failed");
+  check(before - free_blocks() == 31, "fallocate: reservation did not take the blocks and the indirect one");
+  check(fragmented_files() == 0, "fallocate: reservation is not one extent");
+  check(sfs_getfilesize("RESERVED") == 30 * BLOCK_SIZE, "fallocate: file did not grow");
+  sfs_fclose(fd);
+  check(same("RESERVED", data, 30 * BLOCK_SIZE), "fallocate: reserved space does not read as zeros");
+
+  before = free_blocks();
+  text(data, 100);
+  write_file("RESERVED", 0, data, 100);
+  noise(data + 5 * BLOCK_SIZE, 10 * BLOCK_SIZE);
+  write_file("RESERVED", 5 * BLOCK_SIZE, data + 5 * BLOCK_SIZE, 10 * BLOCK_SIZE);
+  check(free_blocks() == before, "fallocate: write into reserved space allocated blocks");
+  check(same("RESERVED", data, 30 * BLOCK_SIZE), "fallocate: reserved space reads back wrong after a write");
+
+  fd = sfs_fopen("RESERVED");
+  check(sfs_fallocate(fd, 0, 10) == 0 && free_blocks() == before, "fallocate: space the file has was taken again");
+  check(sfs_fallocate(fd, -1, 10) < 0 && sfs_fallocate(fd, 0, MAX_FILE_SIZE + 1) < 0,
+        "fallocate: range outside the maximum file size accepted");
+  check(sfs_fallocate(MAX_FD_AMOUNT, 0, 10) < 0, "fallocate: file that is not open reserved");
+  sfs_fclose(fd);
+  id = sfs_snapshot_create();
+  sfs_snapshot_mount(id);
+  fd = sfs_fopen("RESERVED");
+  check(sfs_fallocate(fd, 0, 40 * BLOCK_SIZE) < 0, "fallocate: space reserved in a mounted snapshot");
+  sfs_fclose(fd);
+  mksfs(0);
+  sfs_snapshot_delete(id);
+
+  fills = fill_disk();
+  sfs_remove("SPARE");          /* Ten blocks free, fewer than the reservation needs */
+  before = free_blocks();
+  fd = sfs_fopen("RESERVED");
+  check(sfs_fallocate(fd, 0, 50 * BLOCK_SIZE) < 0, "fallocate: reservation bigger than the free space succeeded");
+  sfs_fclose(fd);
+  check(free_blocks() == before, "fallocate: failed reservation kept blocks");
+  check(same("RESERVED", data, 30 * BLOCK_SIZE), "fallocate: failed reservation changed the file");
+  empty_disk(fills);
+  check_image("fallocate");
+  check(same("RESERVED", data, 30 * BLOCK_SIZE), "fallocate: file differs after remounting");
+}
+
+/* i-Node table: it takes a block only when the i-Nodes it has run out,
+ * holds a file for every directory entry, and a file that needs a table
+ * block on a full disk is not created.
+ */
+static void test_i_nodes()
+{
+  char name[16];
+  int i, before, fills;
+
+  mksfs(1);
+  before = free_blocks();
+  for (i = 0; i < INODES_PER_BLOCK - 1; i++) {
+    sprintf(name, "FILE%d", i);
+    write_file(name, 0, name, strlen(name));
+  }
+  check(free_blocks() == before, "i-nodes: table grew while it had free i-Nodes");
+  for (; i < DIR_AMOUNT; i++) {
+    sprintf(name, "FILE%d", i);
+    write_file(name, 0, name, strlen(name));
+  }
+  check(before - free_blocks() == INODE_TABLE_BLOCKS - 1, "i-nodes: table did not grow a block at a time");
+  check(sfs_fopen("ONE_TOO_MANY") < 0 && sfs_getfilesize("ONE_TOO_MANY") < 0,
+        "i-nodes: file created past the directory size");
+  for (i = 0; i < DIR_AMOUNT; i += 2) {
+    sprintf(name, "FILE%d", i);
+    sfs_remove(name);
+  }
+  before = free_blocks();
+  for (i = 0; i < DIR_AMOUNT; i += 2) {
+    sprintf(name, "FILE%d", i);
+    write_file(name, 0, name, strlen(name));
+  }
+  check(free_blocks() == before, "i-nodes: freed i-Nodes were not reused");
+  check_image("i-nodes");
+  for (i = 0; i < DIR_AMOUNT; i++) {
+    sprintf(name, "FILE%d", i);
+    if (!same(name, name, strlen(name))) {
+      fprintf(stderr, "ERROR: i-nodes: %s differs after remounting\n", name);
+      error_count++;
+    }
+  }
+
+  /* The fill files use i-Nodes 1 to fills, new files take the rest of the
+   * table's last block and then need one more.
+   */
+  mksfs(1);
+  fills = fill_disk();
+  for (i = 0; i < DIR_AMOUNT; i++) {
+    sprintf(name, "FILE%d", i);
+    if (write_file(name, 0, name, strlen(name)) < 0) {
+      break;
+    }
+  }
+  check((fills + i + 1) % INODES_PER_BLOCK == 0, "i-nodes: creation failed with free i-Nodes in the table");
+  check(sfs_getfilesize(name) < 0 && free_blocks() == 0, "i-nodes: file that found no table block was created");
+  empty_disk(1);
+  check(write_file(name, 0, name, strlen(name)) == (int) strlen(name) && same(name, name, strlen(name)),
+        "i-nodes: table did not grow with free blocks");
+  empty_disk(fills);
+  check_image("i-nodes");
+  check(same(name, name, strlen(name)), "i-nodes: new file differs after remounting");
+}
+
+/* Append buffering: small appends reach the disk a chunk at a time and
+ * read back as written before they do, and an append that finds no block
+ * fails at sfs_fflush or sfs_fclose, leaving the file as it was.
+ */
+static void test_appends()
+{
+  sfs_statistics stats;
+  int i, fd, size, fills, id;
+
+  mksfs(1);
+  text(data, 8 * BLOCK_SIZE);
+  fd = sfs_fopen("APPENDS");
+  sfs_stats_reset();
+  for (i = 0; i < 200; i++) {
+    check(sfs_fwrite(fd, data + i * 37, 37) == 37, "appends: small append failed");
+  }
+  sfs_stats(&stats);
+  check(stats.ops[SFS_OP_FWRITE].writes < 50, "appends: small appends were not gathered");
+  check(sfs_getfilesize("APPENDS") == 200 * 37, "appends: size does not count buffered appends");
+  sfs_fseek(fd, 0);
+  check(sfs_fread(fd, buffer, 200 * 37) == 200 * 37 && memcmp(buffer, data, 200 * 37) == 0,
+        "appends: buffered appends read back wrong");
+  sfs_fseek(fd, 200 * 37);
+  size = 8 * BLOCK_SIZE;        /* The last block full, so the next append needs a new one */
+  check(sfs_fwrite(fd, data + 200 * 37, size - 200 * 37) == size - 200 * 37 && sfs_fclose(fd) == 0,
+        "appends: append up to the end of a block failed");
+  check(same("APPENDS", data, size), "appends: file reads back wrong after closing");
+
+  id = sfs_snapshot_create();
+  sfs_snapshot_mount(id);
+  fd = sfs_fopen("APPENDS");
+  check(sfs_fwrite(fd, test_str, 10) < 0, "appends: append to a mounted snapshot was buffered");
+  sfs_fclose(fd);
+  mksfs(0);
+  sfs_snapshot_delete(id);
+
+  fills = fill_disk();
+  fd = sfs_fopen("APPENDS");
+  check(sfs_fwrite(fd, test_str, 10) == 10 && sfs_getfilesize("APPENDS") == size + 10,
+        "appends: append on a full disk was not buffered");
+  check(sfs_fflush(fd) < 0, "appends: sfs_fflush succeeded on a full disk");
+  check(sfs_getfilesize("APPENDS") == size, "appends: failed flush changed the size");
+  check(sfs_fwrite(fd, test_str, 10) == 10 && sfs_fclose(fd) < 0, "appends: sfs_fclose succeeded on a full disk");
+  check(same("APPENDS", data, size), "appends: failed appends changed the file");
+  empty_disk(fills);
+  check(write_file("APPENDS", size, test_str, 10) == 10, "appends: append failed with free blocks");
+  memcpy(data + size, test_str, 10);
+  check_image("appends");
+  check(same("APPENDS", data, size + 10), "appends: file differs after remounting");
+}
+
+/* count_names() - adds one to seen[n] for a name DIRn, returns 0 for any
+ * other name.
+ */
+static int count_names(const char *name, int *seen)
+{
+  int n;
+
+  if (sscanf(name, "DIR%d", &n) != 1 || n < 0 || n >= DIR_AMOUNT) {
+    return 0;
+  }
+  seen[n]++;
+  return 1;
+}
+
+/* readdir: two listings at once each see every file once, a listing
+ * that files are removed and created under still sees every file that
+ * stays once, and a bad cursor is refused.
+ */
+static void test_readdir()
+{
+  char name[MAXFILENAME + 1];
+  int seen[DIR_AMOUNT], again[DIR_AMOUNT];
+  int i, first, second, listed, ok;
+
+  mksfs(1);
+  for (i = 0; i < 40; i++) {
+    sprintf(name, "DIR%d", i);
+    write_file(name, 0, name, strlen(name));
+  }
+  memset(seen, 0, sizeof(seen));
+  memset(again, 0, sizeof(again));
+  first = second = 0;
+  ok = 1;
+  while (sfs_readdir(&first, name) == 1) {
+    ok &= count_names(name, seen);
+    if (sfs_readdir(&second, name) == 1) {
+      ok &= count_names(name, again);
+    }
+  }
+  while (sfs_readdir(&second, name) == 1) {
+    ok &= count_names(name, again);
+  }
+  for (i = 0; i < 40; i++) {
+    ok &= seen[i] == 1 && again[i] == 1;
+  }
+  check(ok, "readdir: two listings at once did not each see every file once");
+  check(sfs_readdir(&first, name) == 0 && first == DIR_AMOUNT, "readdir: listing did not stay at its end");
+  first = -1;
+  check(sfs_readdir(&first, name) < 0 && sfs_readdir(NULL, name) < 0, "readdir: bad cursor accepted");
+
+  memset(seen, 0, sizeof(seen));
+  first = 0;
+  ok = 1;
+  for (listed = 0; sfs_readdir(&first, name) == 1; listed++) {
+    ok &= count_names(name, seen);
+    if (listed == 10) {
+      for (i = 0; i < 40; i += 3) {
+        sprintf(name, "DIR%d", i);
+        sfs_remove(name);
+      }
+      for (i = 40; i < 50; i++) {
+        sprintf(name, "DIR%d", i);
+        write_file(name, 0, name, strlen(name));
+      }
+    }
+  }
+  for (i = 0; i < 40; i++) {
+    ok &= seen[i] <= 1 && (i % 3 == 0 || seen[i] == 1);
+  }
+  for (i = 40; i < 50; i++) {
+    ok &= seen[i] <= 1;
+  }
+  check(ok, "readdir: listing went wrong when files were removed and created");
+
+  check_image("readdir");
+  memset(seen, 0, sizeof(seen));
+  memset(again, 0, sizeof(again));
+  first = 0;
+  ok = 1;
+  while (sfs_getnextfilename(name) == 1) {
+    ok &= count_names(name, seen);
+    if (sfs_readdir(&first, name) == 1) {
+      ok &= count_names(name, again);
+    }
+  }
+  for (i = 0; i < 50; i++) {
+    ok &= seen[i] == (i < 40 && i % 3 == 0 ? 0 : 1) && again[i] == seen[i];
+  }
+  check(ok, "readdir: files listed wrong after remounting");
+}
+
+/* Log mode: rewritten blocks move to the head of the log and the old ones
+ * are freed at the next checkpoint, the cleaner moves files without
+ * changing them, and on a full disk a rewrite fails while removing a file
+ * brings the checkpoint forward so its blocks can be used.
+ */
+static void test_log()
+{
+  sfs_statistics stats;
+  int i, fd, offset, before, fills, id;
+
+  mksfs(1);
+  sfs_set_log(1);
+  noise(data, 20 * BLOCK_SIZE);
+  noise(other, 20 * BLOCK_SIZE);
+  write_file("A", 0, data, 20 * BLOCK_SIZE);
+  write_file("B", 0, other, 20 * BLOCK_SIZE);
+  fd = sfs_fopen("A");
+  sfs_fflush(fd);
+  sfs_fclose(fd);
+  before = free_blocks();
+  sfs_stats_reset();
+  for (i = 0; i < 300; i++) {
+    offset = rand() % (20 * BLOCK_SIZE - 100);
+    noise(data + offset, 100);
+    write_file("A", offset, data + offset, 100);
+  }
+  fd = sfs_fopen("A");
+  sfs_fflush(fd);
+  sfs_fclose(fd);
+  sfs_stats(&stats);
+  check(stats.log.blocks_appended >= 300 && stats.log.checkpoints > 0, "log: rewrites did not go to the head of the log");
+  check(free_blocks() == before, "log: rewritten blocks were not freed at the checkpoint");
+  check(same("A", data, 20 * BLOCK_SIZE) && same("B", other, 20 * BLOCK_SIZE), "log: rewritten file reads back wrong");
+
+  check(sfs_log_clean(1) < 0, "log: budget too small for a block accepted");
+  id = sfs_snapshot_create();
+  sfs_snapshot_mount(id);
+  check(sfs_log_clean(64) < 0, "log: mounted snapshot was cleaned");
+  mksfs(0);
+  sfs_snapshot_delete(id);
+  for (i = 0; i < 20 && sfs_log_clean(64) > 0; i++) {
+  }
+  check(same("A", data, 20 * BLOCK_SIZE) && same("B", other, 20 * BLOCK_SIZE), "log: cleaned files read back wrong");
+
+  fills = fill_disk();
+  check(write_file("A", 5 * BLOCK_SIZE, data, 10) < 0, "log: block rewritten on a full disk");
+  check(same("A", data, 20 * BLOCK_SIZE) && same("B", other, 20 * BLOCK_SIZE), "log: failed rewrite changed a file");
+  sfs_stats_reset();
+  sfs_remove("FILL0");
+  sfs_stats(&stats);
+  check(stats.log.low_space_checkpoints == 1 && free_blocks() >= MAX_FILE_BLOCKS,
+        "log: blocks of a removed file were held back on a full disk");
+  memcpy(data + 5 * BLOCK_SIZE, data, 10);
+  check(write_file("A", 5 * BLOCK_SIZE, data, 10) == 10, "log: rewrite failed after a file was removed");
+  empty_disk(fills);
+  check_image("log");
+  check(same("A", data, 20 * BLOCK_SIZE) && same("B", other, 20 * BLOCK_SIZE), "log: files differ after remounting");
+  sfs_set_log(0);
+  check(sfs_log_clean(64) < 0, "log: cleaned with log mode off");
+  check_image("log");
+}
+
+int
+main(int argc, char **argv)
+{
+  test_compression();
+  test_dedup();
+  test_inline();
+  test_snapshots();
+  test_vectors();
+  test_map();
+  test_instances();
+  test_async();
+  test_defrag();
+  test_fallocate();
+  test_i_nodes();
+  test_appends();
+  test_readdir();
+  test_log();
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,110 @@
+/* ======================================================================== */
+/* sfs_trace:                                                               */
+/* Opt-in trace of the API calls made on an instance, for replaying real    */
+/* access patterns with sfs_replay. Every outermost sfs_* call timed by     */
+/* sfs_stats.c is appended to the trace file as one fixed-size record:      */
+/* when it started, how long it took, its arguments, its result and the     */
+/* file name it was given, if any. Data is never recorded, only sizes.      */
+/* The FUSE wrappers trace to the file named by $SFS_TRACE.                 */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+
+#define TRACE_NAME_MAX 256      //Longer names are cut, FUSE paths stay well below
+
+static void trace_clear() {
+    sfs_trace_record *r = &sfs->trace_call;
+    memset(r, 0, sizeof(sfs_trace_record));
+    r->fd = r->offset = r->length = -1;
+    sfs->trace_name = NULL;
+}
+
+static uint64_t ns_between(struct timespec *from, struct timespec *to) {
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000000ull + to->tv_nsec - from->tv_nsec;
+}
+
+int sfs_trace_start(const char *path) {
+    uint32_t header[2] = { SFS_TRACE_VERSION, sizeof(sfs_trace_record) };
+
+    if (sfs->trace) {
+        printf("SFS_API: CANNOT START TRACE; ALREADY TRACING.\n");
+        return -1;
+    }
+    if (path == NULL || (sfs->trace = fopen(path, "wb")) == NULL) {
+        printf("SFS_API: CANNOT START TRACE; CANNOT OPEN %s.\n", path ? path : "(null)");
+        return -1;
+    }
+    if (fwrite(SFS_TRACE_MAGIC, 8, 1, sfs->trace) != 1 || fwrite(header, sizeof(header), 1, sfs->trace) != 1) {
+        printf("SFS_API: CANNOT START TRACE; CANNOT WRITE %s.\n", path);
+        fclose(sfs->trace);
+        sfs->trace = NULL;
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &sfs->trace_start);
+    trace_clear();
+    return 0;
+}
+
+int sfs_trace_stop() {
+    if (sfs->trace == NULL) {
+        printf("SFS_API: CANNOT STOP TRACE; NOT TRACING.\n");
+        return -1;
+    }
+    int result = fclose(sfs->trace);
+    sfs->trace = NULL;
+    if (result != 0) {
+        printf("SFS_API: TRACE FILE COULD NOT BE WRITTEN.\n");
+        return -1;
+    }
+    return 0;
+}
+
+void trace_args(int fd, int offset, int length, int flags, const char *name) {     //Nested calls are part of the outer one
+    if (sfs->trace == NULL || sfs->op_depth != 1) {
+        return;
+    }
+    sfs_trace_record *r = &sfs->trace_call;
+    r->fd = fd;
+    r->offset = offset;
+    r->length = length;
+    r->flags = flags;
+    sfs->trace_name = name;
+}
+
+int trace_view(void *view) {       //Stable id of a view, never negative
+    uint64_t p = (uintptr_t) view;
+    return (int)((p ^ (p >> 31)) & 0x7fffffff);
+}
+
+/* ======================================================================== */
+/* trace_end:                                                               */
+/* Called by stats_end when an outermost call returns. A failed write stops */
+/* the trace rather than leave a file with records missing in the middle.   */
+/* ======================================================================== */
+void trace_end(int op, int result, struct timespec *now) {
+    char buf[sizeof(sfs_trace_record) + TRACE_NAME_MAX];
+    sfs_trace_record *r = &sfs->trace_call;
+
+    uint64_t latency = ns_between(&sfs->op_start, now);
+    r->start_ns = ns_between(&sfs->trace_start, &sfs->op_start);
+    r->latency_ns = latency > UINT32_MAX ? UINT32_MAX : (uint32_t) latency;
+    r->op = op;
+    r->result = result;
+    r->name_length = 0;
+    if (sfs->trace_name) {
+        size_t n = strlen(sfs->trace_name);
+        r->name_length = n > TRACE_NAME_MAX ? TRACE_NAME_MAX : n;
+        memcpy(buf + sizeof(sfs_trace_record), sfs->trace_name, r->name_length);
+    }
+    memcpy(buf, r, sizeof(sfs_trace_record));
+
+    if (fwrite(buf, sizeof(sfs_trace_record) + r->name_length, 1, sfs->trace) != 1) {
+        printf("SFS_API: TRACE WRITE FAILED; TRACING STOPPED.\n");
+        fclose(sfs->trace);
+        sfs->trace = NULL;
+    }
+    trace_clear();
+}